@@ -1,17 +1,55 @@
+#define _GNU_SOURCE        // recvmmsg()
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "index_lsm.h"
+
 #define PEER_NAME_LEN      10
 #define CONTENT_NAME_LEN   10
 #define IP_STRLEN          16
-#define TABLE_MAX          512
+#define TABLE_MAX          512    // Default rows; -m sets another capacity
+#define MAX_ADDRS          4
+#define PROVIDERS_MAX      512    // Rows one 'P' answer lists at most
+#define MULTI_MAX          64     // Names per 'N' datagram
+#define MULTI_HDR          5      // 'N' + id (2) + count (2)
+#define MULTI_REC          17     // found (1) + peer (10) + IPv4 (4) + port (2)
+#define SESS_MAX           65535  // Tokens carry a 16-bit slot
+#define REQ_MAX            (MULTI_HDR + MULTI_MAX * CONTENT_NAME_LEN) // Largest request
+#define CONN_MAX           256    // Stream connections served at once
+#define CONN_IN            16384  // Receive buffer per connection
+#define CONN_OUT_HIGH      (1 << 20) // Stop reading a client whose replies pile up
+#define UDP_BURST          BATCH_MAX // Datagrams taken per wakeup
+#define BATCH_MAX          64     // Requests whose lookups are overlapped
+#define REPLY_MAX          (MULTI_HDR + MULTI_MAX * MULTI_REC) // Largest reply datagram
+#define STAGE_SLOTS        4096   // Depth of each staged-mode ring (power of two)
+#define STAGE_IO_MAX       16     // Receive threads in staged mode
+#define HUGE_PAGE          (2u << 20)
+#define BUSY_POLL_US       50     // SO_BUSY_POLL budget for blocking reads in -B mode
+#define STORE_SCAN_MAX     4096   // Registrations of one content loaded from the store
+#define HOT_MAGIC          "P2PHOT2"
+#define HOT_TIMEOUT_S      5      // Either side gives up on a stalled handoff
+#define HOT_CHUNK          65536  // Snapshot bytes per write
 
 #define PDU_R  'R'
 #define PDU_S  'S'
@@ -21,6 +59,14 @@
 #define PDU_E  'E'
 #define PDU_D  'D'
 #define PDU_C  'C'
+#define PDU_X  'X'
+#define PDU_W  'W'
+#define PDU_P  'P'
+#define PDU_N  'N'
+#define PDU_H  'H'
+#define PDU_r  'r'
+#define PDU_t  't'
+#define PDU_x  'x'
 
 typedef struct __attribute__((packed)) {
     char type;
@@ -30,16 +76,89 @@ typedef struct __attribute__((packed)) {
     uint16_t port_net;
 } PDU;
 
+// A peer identity (name + primary address) shared by all its registrations.
+// After an 'H' handshake it is also bound to the requester's UDP address and
+// addressed by a token, so later requests need not repeat it
 typedef struct {
     int in_use;
+    uint16_t gen;                     // Changes on reuse, so old tokens miss
     char peer[PEER_NAME_LEN+1];
-    char content[CONTENT_NAME_LEN+1];
     char ip[IP_STRLEN];
+    struct sockaddr_in src;           // Handshake source; sin_port 0 if none
+    int rows;                         // Registrations referring to it
+    int next;                         // Next session with the same hash, or next free one
+} Session;
+
+typedef struct {
+    int in_use;
+    int sess;                         // Owner: peer name and primary address
+    char content[CONTENT_NAME_LEN+1];
+    char extra[MAX_ADDRS-1][IP_STRLEN]; // Further addresses ('X')
+    int n_ip;                         // Including the primary one
     uint16_t port;
     uint32_t use_count;
+    uint32_t use_saved;               // use_count as last written to the store (-s)
+    int next;                 // Next row with the same content hash (or free row), -1 at the end
 } Row;
 
-static Row table_[TABLE_MAX];
+// With a store (-s), a content whose registrations are all in the table.
+// Entries are evicted by a clock sweep, taking their rows with them
+typedef struct {
+    int in_use;
+    int ref;                          // Used since the hand last passed
+    char content[CONTENT_NAME_LEN+1];
+    int next;                         // Next with the same content hash, or next free one
+} Resident;
+
+// A long-lived TCP or Unix-domain client. Requests arrive as frames of
+// length (2, big endian) + the same bytes a datagram would carry; replies go
+// back framed the same way, in request order. All replies to one read are
+// collected in 'out' and written together
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;          // TCP: remote address. Unix: unique 0.x.x.x
+    unsigned char in[CONN_IN];
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+    size_t out_off;                   // Already written
+    size_t out_cap;
+} Conn;
+
+// Where a reply goes: the UDP socket and the requester's address, or a stream
+typedef struct {
+    int sock;
+    struct sockaddr_in addr;
+    socklen_t alen;
+    Conn *conn;                       // NULL for UDP
+} Client;
+
+static Row *table_;
+static int table_cap_;
+static int *bucket_;                // First row per content hash, -1 if none
+static uint32_t bucket_mask_;       // Buckets - 1; at least twice the rows, power of two
+static int free_row_ = -1;
+static Session *sess_;
+static int sess_cap_;
+static int *sess_bucket_;           // First session per (peer, ip) hash
+static uint32_t sess_mask_;
+static int free_sess_ = -1;
+
+// Store (-s): the table caches the contents listed in res_, all writes go
+// through to store_, and use counts are written back on eviction
+static lsm *store_;
+static Resident *res_;
+static int res_cap_;
+static int *res_bucket_;            // Same hashing as bucket_
+static int free_res_ = -1;
+static int res_hand_;
+static int res_pin_ = -1;           // Content being served: never evicted
+static int evict_one(void);
+
+// Page size policy for the table arena (-g): explicit hugetlb pages, then
+// transparent huge pages, then normal pages; or only THP / only 4k pages
+enum { PAGES_AUTO, PAGES_THP, PAGES_4K };
+static int pages_ = PAGES_AUTO;
 
 static void reset_pdu(PDU *p) { memset(p, 0, sizeof(*p)); }
 
@@ -49,11 +168,371 @@ static void copy_field_padded(char *dst, size_t dsz, const char *src, size_t lim
     for (; n < dsz; ++n) dst[n] = '\0';
 }
 
+// FNV-1a over at most 'limit' bytes of a name
+static uint32_t fnv1a(uint32_t h, const char *s, int limit) {
+    int i;
+    for (i = 0; i < limit && s[i]; ++i) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t content_hash(const char *content) {
+    return fnv1a(2166136261u, content, CONTENT_NAME_LEN) & bucket_mask_;
+}
+
+static uint32_t session_hash(const char *peer, const char *ip) {
+    return fnv1a(fnv1a(2166136261u, peer, PEER_NAME_LEN), ip, IP_STRLEN) & sess_mask_;
+}
+
+static uint32_t pow2_at_least(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+// Prefer the NUMA node of the calling thread for [p, p+len). Pages are
+// placed when first touched, and the table owner is the one that touches
+// them, but this also holds if the memory is first touched elsewhere
+static void arena_bind_local(void *p, size_t len) {
+#ifdef SYS_mbind
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= 64) return;
+    unsigned long mask = 1ul << node;
+    (void)syscall(SYS_mbind, p, len, MPOL_PREFERRED, &mask, 64ul, 0u);
+#else
+    (void)p; (void)len;
+#endif
+}
+
+// One zeroed region for the whole table. At tens of millions of rows every
+// lookup touches pages spread over gigabytes; with 2 MiB pages the TLB covers
+// 512 times more of them. Returns NULL on failure; *kind tells which pages
+static void *arena_alloc(size_t bytes, const char **kind) {
+    size_t len = (bytes + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    void *p = MAP_FAILED;
+
+    if (bytes < HUGE_PAGE) {
+        // Small tables (the default) gain nothing from a 2 MiB page
+        *kind = "normal pages";
+        return calloc(1, bytes);
+    }
+    if (pages_ == PAGES_AUTO) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        *kind = "hugetlb pages";
+    }
+    if (p == MAP_FAILED) {
+        // No reserved huge pages: map aligned to 2 MiB so THP can back it
+        char *raw = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) return NULL;
+        char *al = (char *)(((uintptr_t)raw + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+        if (al > raw) munmap(raw, (size_t)(al - raw));
+        munmap(al + len, (size_t)(raw + HUGE_PAGE - al));
+        p = al;
+        *kind = "normal pages";
+        if (pages_ != PAGES_4K && madvise(p, len, MADV_HUGEPAGE) == 0) *kind = "transparent huge pages";
+        if (pages_ == PAGES_4K) (void)madvise(p, len, MADV_NOHUGEPAGE);
+    }
+    arena_bind_local(p, len);
+    return p;
+}
+
+// Carve n bytes, cache-line aligned, off the arena at *off
+static void *arena_take(char *base, size_t *off, size_t n) {
+    void *p = base + *off;
+    *off += (n + 63) & ~(size_t)63;
+    return p;
+}
+
+// Allocate room for 'rows' registrations, their hash index and sessions from
+// one arena. Free rows and sessions are chained through 'next'
+static int table_init(int rows) {
+    table_cap_   = rows;
+    sess_cap_    = rows < SESS_MAX ? rows : SESS_MAX;
+    bucket_mask_ = pow2_at_least(2u * (uint32_t)rows) - 1;
+    sess_mask_   = pow2_at_least(2u * (uint32_t)sess_cap_) - 1;
+
+    size_t sz[4] = {
+        (size_t)table_cap_ * sizeof(*table_),
+        ((size_t)bucket_mask_ + 1) * sizeof(*bucket_),
+        (size_t)sess_cap_ * sizeof(*sess_),
+        ((size_t)sess_mask_ + 1) * sizeof(*sess_bucket_),
+    };
+    size_t total = 0;
+    for (int k = 0; k < 4; ++k) total += (sz[k] + 63) & ~(size_t)63;
+    const char *kind;
+    char *base = arena_alloc(total, &kind);
+    if (!base) return -1;
+    size_t off = 0;
+    table_       = arena_take(base, &off, sz[0]);
+    bucket_      = arena_take(base, &off, sz[1]);
+    sess_        = arena_take(base, &off, sz[2]);
+    sess_bucket_ = arena_take(base, &off, sz[3]);
+    if (total >= HUGE_PAGE) printf("Table: %d rows, %zu MiB on %s\n", rows, total >> 20, kind);
+
+    memset(bucket_,      0xff, ((size_t)bucket_mask_ + 1) * sizeof(*bucket_));
+    memset(sess_bucket_, 0xff, ((size_t)sess_mask_ + 1) * sizeof(*sess_bucket_));
+    for (int i = table_cap_ - 1; i >= 0; --i) {
+        table_[i].next = free_row_;
+        free_row_ = i;
+    }
+    srand((unsigned)time(NULL) ^ (unsigned)getpid());
+    for (int k = sess_cap_ - 1; k >= 0; --k) {
+        sess_[k].gen  = (uint16_t)rand(); // Tokens differ per run
+        sess_[k].next = free_sess_;
+        free_sess_ = k;
+    }
+    return 0;
+}
+
+static const char *row_peer(int row) { return sess_[table_[row].sess].peer; }
+
+static const char *row_ip(int row, int k) {
+    return k == 0 ? sess_[table_[row].sess].ip : table_[row].extra[k-1];
+}
+
+static uint32_t sess_token(int s) { return ((uint32_t)(s + 1) << 16) | sess_[s].gen; }
+
+static void session_free(int s) {
+    int *pp = &sess_bucket_[session_hash(sess_[s].peer, sess_[s].ip)];
+    while (*pp >= 0 && *pp != s) pp = &sess_[*pp].next;
+    if (*pp == s) *pp = sess_[s].next;
+    sess_[s].in_use = 0;
+    sess_[s].next   = free_sess_;
+    free_sess_ = s;
+}
+
+// The session for (peer, ip), created if needed. A handshake ('src' given)
+// binds it to the requester. When all are taken, a handshaken session with
+// no registrations left is reused. Returns the slot, or -1
+static int session_get(const char *peer, const char *ip, const struct sockaddr_in *src) {
+    uint32_t h = session_hash(peer, ip);
+    int s;
+
+    for (s = sess_bucket_[h]; s >= 0; s = sess_[s].next) {
+        if (strncmp(sess_[s].peer, peer, PEER_NAME_LEN) == 0 &&
+            strncmp(sess_[s].ip, ip, IP_STRLEN) == 0) {
+            break;
+        }
+    }
+    if (s < 0) {
+        while (free_sess_ < 0 && store_ && evict_one() == 0) {}
+        if (free_sess_ < 0) {
+            // Rare: look for an idle one to take over
+            for (s = 0; s < sess_cap_ && sess_[s].rows != 0; ++s) {}
+            if (s == sess_cap_) return -1;
+            session_free(s);
+        }
+        s = free_sess_;
+        free_sess_ = sess_[s].next;
+        sess_[s].in_use = 1;
+        sess_[s].gen   += 1;
+        sess_[s].rows   = 0;
+        memset(&sess_[s].src, 0, sizeof(sess_[s].src));
+        copy_field_padded(sess_[s].peer, sizeof(sess_[s].peer), peer, PEER_NAME_LEN);
+        copy_field_padded(sess_[s].ip,   sizeof(sess_[s].ip),   ip,   IP_STRLEN-1);
+        sess_[s].next = sess_bucket_[h];
+        sess_bucket_[h] = s;
+    }
+    if (src) sess_[s].src = *src;
+    return s;
+}
+
+// Free s once no registration refers to it and nobody holds a token for it
+static void session_gc(int s) {
+    if (sess_[s].rows == 0 && sess_[s].src.sin_port == 0) {
+        session_free(s);
+    }
+}
+
+static void session_put(int s) {
+    sess_[s].rows -= 1;
+    session_gc(s);
+}
+
+// The session a compact request's token names, if it comes from where the
+// handshake came from. Returns the slot, or -1
+static int session_from_token(uint32_t token, const struct sockaddr_in *cli) {
+    int s = (int)(token >> 16) - 1;
+    if (s < 0 || s >= sess_cap_ || !sess_[s].in_use || sess_token(s) != token) return -1;
+    if (sess_[s].src.sin_port != cli->sin_port ||
+        sess_[s].src.sin_addr.s_addr != cli->sin_addr.s_addr) return -1;
+    return s;
+}
+
+static void hash_insert(int row) {
+    uint32_t h = content_hash(table_[row].content);
+    table_[row].next = bucket_[h];
+    bucket_[h] = row;
+}
+
+static void hash_remove(int row) {
+    int *pp = &bucket_[content_hash(table_[row].content)];
+    while (*pp >= 0 && *pp != row) pp = &table_[*pp].next;
+    if (*pp == row) *pp = table_[row].next;
+}
+
+static int ipv4_ok(const char *ip) {
+    struct in_addr a;
+    return inet_pton(AF_INET, ip, &a) == 1;
+}
+
+// Row i as the store keeps it
+static void row_record(int i, lsm_rec *r) {
+    memset(r, 0, sizeof(*r));
+    memcpy(r->content, table_[i].content, CONTENT_NAME_LEN);
+    memcpy(r->peer, row_peer(i), PEER_NAME_LEN);
+    for (int k = 0; k < table_[i].n_ip; ++k) {
+        inet_pton(AF_INET, row_ip(i, k), &r->ip[k]);
+    }
+    r->n_ip = (uint8_t)table_[i].n_ip;
+    r->port = table_[i].port;
+    r->use_count = table_[i].use_count;
+}
+
+// Drop row i from the table only
+static void row_release(int i) {
+    hash_remove(i);
+    table_[i].in_use = 0;
+    table_[i].next = free_row_;
+    free_row_ = i;
+    session_put(table_[i].sess);
+}
+
+// A free row, evicting cached contents if there is none. -1 if all that is
+// left is the content being served
+static int take_row(void) {
+    while (free_row_ < 0 && store_ && evict_one() == 0) {}
+    int i = free_row_;
+    if (i >= 0) free_row_ = table_[i].next;
+    return i;
+}
+
+static int resident_find(const char *content) {
+    int e;
+    for (e = res_bucket_[content_hash(content)]; e >= 0; e = res_[e].next) {
+        if (strncmp(res_[e].content, content, CONTENT_NAME_LEN) == 0) break;
+    }
+    return e;
+}
+
+// Take e's rows out of the table, saving use counts that changed
+static void resident_evict(int e) {
+    uint32_t h = content_hash(res_[e].content);
+    int i = bucket_[h];
+    while (i >= 0) {
+        int next = table_[i].next;
+        if (strncmp(table_[i].content, res_[e].content, CONTENT_NAME_LEN) == 0) {
+            if (table_[i].use_count != table_[i].use_saved) {
+                lsm_rec r;
+                row_record(i, &r);
+                lsm_put(store_, &r);
+            }
+            row_release(i);
+        }
+        i = next;
+    }
+    int *pp = &res_bucket_[h];
+    while (*pp >= 0 && *pp != e) pp = &res_[*pp].next;
+    if (*pp == e) *pp = res_[e].next;
+    res_[e].in_use = 0;
+    res_[e].next = free_res_;
+    free_res_ = e;
+}
+
+// Evict the next content the clock hand finds unused. 0, or -1 if nothing
+// but the pinned content is cached
+static int evict_one(void) {
+    for (int step = 0; step < 2 * res_cap_; ++step) {
+        int e = res_hand_;
+        res_hand_ = (res_hand_ + 1) % res_cap_;
+        if (!res_[e].in_use || e == res_pin_) continue;
+        if (res_[e].ref) {
+            res_[e].ref = 0;
+            continue;
+        }
+        resident_evict(e);
+        return 0;
+    }
+    return -1;
+}
+
+// Make sure all registrations of 'content' are in the table (a no-op without
+// a store). Contents the store does not hold are cached too, as empty, so
+// repeated misses do not reach the disk
+static void resident(const char *content) {
+    if (!store_) return;
+    int e = resident_find(content);
+    if (e >= 0) {
+        res_[e].ref = 1;
+        res_pin_ = e;
+        return;
+    }
+    if (free_res_ < 0 && evict_one() < 0) return;
+    e = free_res_;
+    if (e < 0) return;
+    free_res_ = res_[e].next;
+    res_[e].in_use = 1;
+    res_[e].ref = 1;
+    copy_field_padded(res_[e].content, sizeof(res_[e].content), content, CONTENT_NAME_LEN);
+    uint32_t h = content_hash(content);
+    res_[e].next = res_bucket_[h];
+    res_bucket_[h] = e;
+    res_pin_ = e;
+
+    static lsm_rec recs[STORE_SCAN_MAX];
+    int n = lsm_scan(store_, content, recs, STORE_SCAN_MAX);
+    for (int k = 0; k < n; ++k) {
+        char peer[PEER_NAME_LEN+1], ip[IP_STRLEN];
+        copy_field_padded(peer, sizeof(peer), recs[k].peer, PEER_NAME_LEN);
+        inet_ntop(AF_INET, &recs[k].ip[0], ip, sizeof(ip));
+
+        // Row first: taking it may evict, and that could free a new session
+        int i = take_row();
+        int sess = i >= 0 ? session_get(peer, ip, NULL) : -1;
+        if (sess < 0) {
+            // The table is too small for this content: serve what fits
+            if (i >= 0) {
+                table_[i].next = free_row_;
+                free_row_ = i;
+            }
+            break;
+        }
+        table_[i].in_use = 1;
+        table_[i].sess   = sess;
+        copy_field_padded(table_[i].content, sizeof(table_[i].content), content, CONTENT_NAME_LEN);
+        table_[i].n_ip = recs[k].n_ip ? recs[k].n_ip : 1;
+        for (int a = 1; a < table_[i].n_ip; ++a) {
+            inet_ntop(AF_INET, &recs[k].ip[a], table_[i].extra[a-1], IP_STRLEN);
+        }
+        table_[i].port = recs[k].port;
+        table_[i].use_count = recs[k].use_count;
+        table_[i].use_saved = recs[k].use_count;
+        sess_[sess].rows += 1;
+        hash_insert(i);
+    }
+}
+
+// Allocate the residency set: one entry per row is enough, since an entry
+// with no rows is only a cached miss
+static int resident_init(void) {
+    res_cap_ = table_cap_;
+    res_ = calloc((size_t)res_cap_, sizeof(*res_));
+    res_bucket_ = malloc(((size_t)bucket_mask_ + 1) * sizeof(*res_bucket_));
+    if (!res_ || !res_bucket_) return -1;
+    memset(res_bucket_, 0xff, ((size_t)bucket_mask_ + 1) * sizeof(*res_bucket_));
+    for (int e = res_cap_ - 1; e >= 0; --e) {
+        res_[e].next = free_res_;
+        free_res_ = e;
+    }
+    return 0;
+}
+
 static int lookup_same_entry(const char *peer, const char *content) {
     int i;
-    for (i = 0; i < TABLE_MAX; ++i) {
-        if (!table_[i].in_use) continue;
-        if (strncmp(table_[i].peer, peer, PEER_NAME_LEN) == 0 &&
+    resident(content);
+    for (i = bucket_[content_hash(content)]; i >= 0; i = table_[i].next) {
+        if (strncmp(row_peer(i), peer, PEER_NAME_LEN) == 0 &&
             strncmp(table_[i].content, content, CONTENT_NAME_LEN) == 0) {
             return i;
         }
@@ -61,13 +540,23 @@ static int lookup_same_entry(const char *peer, const char *content) {
     return -1;
 }
 
-static int choose_least_used_row(const char *content) {
+// Deregister a row the cache does not hold: a content with more registrations
+// than one lookup loads keeps the rest only in the store. Returns 0, or -1 if
+// there is no such registration
+static int store_forget(const char *peer, const char *content) {
+    lsm_rec r;
+    if (!store_ || !lsm_get(store_, content, peer, &r)) return -1;
+    return lsm_del(store_, content, peer) == 0 ? 0 : -1;
+}
+
+// Least used provider of 'content' among the rows chained from bucket h
+static int least_used_in_bucket(uint32_t h, const char *content) {
     int i;
     int sel = -1;
     uint32_t best = 0;
 
-    for (i = 0; i < TABLE_MAX; ++i) {
-        if (!table_[i].in_use) continue;
+    resident(content);
+    for (i = bucket_[h]; i >= 0; i = table_[i].next) {
         if (strncmp(table_[i].content, content, CONTENT_NAME_LEN) != 0) continue;
         if (sel < 0 || table_[i].use_count < best) {
             sel  = i;
@@ -77,7 +566,174 @@ static int choose_least_used_row(const char *content) {
     return sel;
 }
 
-static void process_register(int sock, const struct sockaddr_in *cli, socklen_t clen, const PDU *req) {
+static int choose_least_used_row(const char *content) {
+    return least_used_in_bucket(content_hash(content), content);
+}
+
+// Add (session, content, port). Returns 0, or -1 if the peer already
+// registered the content or the table is full
+static int add_row(int sess, const char *cont, uint16_t port) {
+    if (store_ && !ipv4_ok(sess_[sess].ip)) return -1; // The store keeps IPv4 only
+
+    // Counted from here: loading the content or making room may evict rows,
+    // and must not free the session with them
+    sess_[sess].rows += 1;
+    int i = lookup_same_entry(sess_[sess].peer, cont) >= 0 ? -1 : take_row();
+    if (i < 0) {
+        sess_[sess].rows -= 1;
+        return -1;
+    }
+
+    table_[i].in_use = 1;
+    table_[i].sess   = sess;
+    copy_field_padded(table_[i].content, sizeof(table_[i].content), cont, CONTENT_NAME_LEN);
+    table_[i].n_ip = 1;
+    table_[i].port = port;
+    table_[i].use_count = 0;
+    table_[i].use_saved = 0;
+    hash_insert(i);
+    if (store_) {
+        lsm_rec r;
+        row_record(i, &r);
+        lsm_put(store_, &r);
+    }
+    return 0;
+}
+
+static void remove_row(int i) {
+    if (store_) lsm_del(store_, table_[i].content, row_peer(i));
+    row_release(i);
+}
+
+// Add 'ip' to row i's addresses. Returns 0, or -1 if they are full
+static int add_row_address(int i, const char *ip) {
+    int k;
+    for (k = 0; k < table_[i].n_ip; ++k) {
+        if (strncmp(row_ip(i, k), ip, IP_STRLEN) == 0) return 0;
+    }
+    if (k == MAX_ADDRS || (store_ && !ipv4_ok(ip))) return -1;
+    copy_field_padded(table_[i].extra[k-1], sizeof(table_[i].extra[k-1]), ip, IP_STRLEN-1);
+    table_[i].n_ip += 1;
+    if (store_) {
+        lsm_rec r;
+        row_record(i, &r);
+        r.use_count = table_[i].use_saved; // Use counts are only written back on eviction
+        lsm_put(store_, &r);
+    }
+    return 0;
+}
+
+// Staged mode (-P): receive threads decode datagrams into StageReq
+// descriptors and push them into one MPSC ring; the main thread alone owns
+// the table, applies them in batches and pushes every reply into an SPSC ring
+// drained by a sender thread. Only the owner ever touches table_ or sess_
+typedef struct {
+    _Atomic size_t seq;               // == position: free; position + 1: filled
+    struct sockaddr_in addr;
+    uint32_t hash;                    // Content bucket, UINT32_MAX if none
+    uint16_t len;
+    unsigned char req[REQ_MAX];
+} StageReq;
+
+typedef struct {
+    struct sockaddr_in addr;
+    uint16_t len;
+    unsigned char data[REPLY_MAX];
+} StageReply;
+
+static StageReq *stage_in_;              // Bounded MPSC ring (per-slot sequence numbers)
+static _Atomic size_t stage_in_head_;    // Next position a producer claims
+static size_t stage_in_tail_;            // Owner only
+static StageReply *stage_out_;           // Bounded SPSC ring, owner -> sender
+static _Atomic size_t stage_out_head_;
+static _Atomic size_t stage_out_tail_;
+static int staged_;
+static int stage_sock_;
+
+// Low-latency mode (-B, -c): after each request, keep polling the sockets
+// without sleeping for busy_us_ before blocking again, so a request that
+// arrives meanwhile skips the wakeup. Threads are pinned from CPU cpu_ on
+static long busy_us_ = -1;               // -1: always block
+static int cpu_ = -1;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+// Still inside the spin window that started with the last request at 'last'
+static int busy_spinning(uint64_t last) {
+    return busy_us_ >= 0 && now_us() - last < (uint64_t)busy_us_;
+}
+
+// Pin the calling thread to CPU cpu_ + k (wrapping), if -c was given
+static void pin_thread(int k) {
+    if (cpu_ < 0) return;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((int)((cpu_ + k) % (ncpu > 0 ? ncpu : 1)), &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Cannot pin to CPU %ld\n", (cpu_ + k) % (ncpu > 0 ? ncpu : 1));
+    }
+}
+
+// Spin briefly for the common short stall, then sleep (up to 1 ms) so an idle
+// stage costs no CPU
+static void stage_backoff(unsigned *spins) {
+    if (*spins < 64) {
+        (*spins)++;
+        sched_yield();
+        return;
+    }
+    struct timespec ts = { 0, *spins < 1024 ? 20000 : 1000000 };
+    if (*spins < 1024) (*spins)++;
+    nanosleep(&ts, NULL);
+}
+
+// Owner: hand one reply to the sender thread, waiting while its ring is full
+static void stage_reply(const Client *c, const void *buf, size_t len) {
+    size_t h = atomic_load_explicit(&stage_out_head_, memory_order_relaxed);
+    unsigned spins = 0;
+
+    while (h - atomic_load_explicit(&stage_out_tail_, memory_order_acquire) == STAGE_SLOTS) {
+        stage_backoff(&spins);
+    }
+    StageReply *r = &stage_out_[h & (STAGE_SLOTS - 1)];
+    r->addr = c->addr;
+    r->len  = (uint16_t)len;
+    memcpy(r->data, buf, len);
+    atomic_store_explicit(&stage_out_head_, h + 1, memory_order_release);
+}
+
+// Queue a reply on a stream connection; the main loop writes it out
+static void conn_queue(Conn *cn, const void *buf, size_t len) {
+    if (cn->out_len + 2 + len > cn->out_cap) {
+        size_t cap = cn->out_cap ? cn->out_cap : 4096;
+        while (cap < cn->out_len + 2 + len) cap *= 2;
+        unsigned char *p = realloc(cn->out, cap);
+        if (!p) return; // Dropped: the client times out as it would on UDP
+        cn->out = p;
+        cn->out_cap = cap;
+    }
+    cn->out[cn->out_len]     = (unsigned char)(len >> 8);
+    cn->out[cn->out_len + 1] = (unsigned char)len;
+    memcpy(cn->out + cn->out_len + 2, buf, len);
+    cn->out_len += 2 + len;
+}
+
+static void reply(const Client *c, const void *buf, size_t len) {
+    if (c->conn) {
+        conn_queue(c->conn, buf, len);
+    } else if (staged_) {
+        stage_reply(c, buf, len);
+    } else {
+        sendto(c->sock, buf, len, 0, (const struct sockaddr*)&c->addr, c->alen);
+    }
+}
+
+static void process_register(const Client *c, const PDU *req) {
     PDU resp; reset_pdu(&resp);
 
     char peer[PEER_NAME_LEN+1];   memset(peer, 0, sizeof(peer));   copy_field_padded(peer,  sizeof(peer),  req->peer,    PEER_NAME_LEN);
@@ -85,165 +741,1227 @@ static void process_register(int sock, const struct sockaddr_in *cli, socklen_t
     char ip[IP_STRLEN];           memset(ip,   0, sizeof(ip));     copy_field_padded(ip,    sizeof(ip),    req->ip,      IP_STRLEN-1);
     uint16_t port = ntohs(req->port_net);
 
-    if (peer[0] == '\0' || cont[0] == '\0' || ip[0] == '\0' || port == 0) {
-        resp.type = PDU_E;
-        sendto(sock, &resp, sizeof(resp), 0, (const struct sockaddr*)cli, clen);
-        return;
+    int sess = -1;
+    if (peer[0] != '\0' && cont[0] != '\0' && ip[0] != '\0' && port != 0) {
+        sess = session_get(peer, ip, NULL);
     }
-
-    if (lookup_same_entry(peer, cont) >= 0) {
+    if (sess < 0) {
         resp.type = PDU_E;
-        sendto(sock, &resp, sizeof(resp), 0, (const struct sockaddr*)cli, clen);
+        reply(c, &resp, sizeof(resp));
         return;
     }
-
-    int i;
-    for (i = 0; i < TABLE_MAX; ++i) {
-        if (!table_[i].in_use) break;
-    }
-    if (i == TABLE_MAX) {
+    if (add_row(sess, cont, port) < 0) {
+        session_gc(sess); // Drop it again if it was made for this request
         resp.type = PDU_E;
-        sendto(sock, &resp, sizeof(resp), 0, (const struct sockaddr*)cli, clen);
+        reply(c, &resp, sizeof(resp));
         return;
     }
 
-    table_[i].in_use = 1;
-    copy_field_padded(table_[i].peer,    sizeof(table_[i].peer),    peer, PEER_NAME_LEN);
-    copy_field_padded(table_[i].content, sizeof(table_[i].content), cont, CONTENT_NAME_LEN);
-    copy_field_padded(table_[i].ip,      sizeof(table_[i].ip),      ip,   IP_STRLEN-1);
-    table_[i].port = port;
-    table_[i].use_count = 0;
-
     resp.type = PDU_A;
-    sendto(sock, &resp, sizeof(resp), 0, (const struct sockaddr*)cli, clen);
+    reply(c, &resp, sizeof(resp));
 }
 
-static void process_search(int sock, const struct sockaddr_in *cli, socklen_t clen, const PDU *req) {
+static void process_search(const Client *c, const PDU *req) {
     PDU resp; reset_pdu(&resp);
 
     char cont[CONTENT_NAME_LEN+1]; memset(cont, 0, sizeof(cont)); copy_field_padded(cont, sizeof(cont), req->content, CONTENT_NAME_LEN);
 
     if (cont[0] == '\0') {
         resp.type = PDU_E;
-        sendto(sock, &resp, sizeof(resp), 0, (const struct sockaddr*)cli, clen);
+        reply(c, &resp, sizeof(resp));
         return;
     }
 
     int sel = choose_least_used_row(cont);
     if (sel < 0) {
         resp.type = PDU_E;
-        sendto(sock, &resp, sizeof(resp), 0, (const struct sockaddr*)cli, clen);
+        reply(c, &resp, sizeof(resp));
         return;
     }
 
     resp.type = PDU_S;
-    copy_field_padded(resp.peer,    sizeof(resp.peer),    table_[sel].peer,    PEER_NAME_LEN);
+    copy_field_padded(resp.peer,    sizeof(resp.peer),    row_peer(sel),       PEER_NAME_LEN);
     copy_field_padded(resp.content, sizeof(resp.content), table_[sel].content, CONTENT_NAME_LEN);
-    copy_field_padded(resp.ip,      sizeof(resp.ip),      table_[sel].ip,      IP_STRLEN-1);
+    copy_field_padded(resp.ip,      sizeof(resp.ip),      row_ip(sel, 0),      IP_STRLEN-1);
     resp.port_net = htons(table_[sel].port);
 
-    sendto(sock, &resp, sizeof(resp), 0, (const struct sockaddr*)cli, clen);
+    reply(c, &resp, sizeof(resp));
     table_[sel].use_count += 1;
 }
 
-static void process_deregister(int sock, const struct sockaddr_in *cli, socklen_t clen, const PDU *req) {
+static void process_add_address(const Client *c, const PDU *req) {
     PDU resp; reset_pdu(&resp);
 
     char peer[PEER_NAME_LEN+1];   memset(peer, 0, sizeof(peer));   copy_field_padded(peer,  sizeof(peer),  req->peer,    PEER_NAME_LEN);
     char cont[CONTENT_NAME_LEN+1];memset(cont, 0, sizeof(cont));   copy_field_padded(cont,  sizeof(cont),  req->content, CONTENT_NAME_LEN);
+    char ip[IP_STRLEN];           memset(ip,   0, sizeof(ip));     copy_field_padded(ip,    sizeof(ip),    req->ip,      IP_STRLEN-1);
 
+    int i = lookup_same_entry(peer, cont);
+    if (i < 0 || ip[0] == '\0') {
+        resp.type = PDU_E;
+        reply(c, &resp, sizeof(resp));
+        return;
+    }
+
+    if (add_row_address(i, ip) < 0) {
+        resp.type = PDU_E;
+        reply(c, &resp, sizeof(resp));
+        return;
+    }
+
+    resp.type = PDU_A;
+    reply(c, &resp, sizeof(resp));
+}
+
+static void process_search_all(const Client *c, const PDU *req) {
+    PDU resp; reset_pdu(&resp);
+
+    char cont[CONTENT_NAME_LEN+1]; memset(cont, 0, sizeof(cont)); copy_field_padded(cont, sizeof(cont), req->content, CONTENT_NAME_LEN);
+
+    int sel = cont[0] ? choose_least_used_row(cont) : -1;
+    if (sel < 0) {
+        resp.type = PDU_E;
+        reply(c, &resp, sizeof(resp));
+        return;
+    }
+
+    int k;
+    for (k = 0; k < table_[sel].n_ip; ++k) {
+        reset_pdu(&resp);
+        resp.type = PDU_W;
+        copy_field_padded(resp.peer,    sizeof(resp.peer),    row_peer(sel),       PEER_NAME_LEN);
+        copy_field_padded(resp.content, sizeof(resp.content), table_[sel].content, CONTENT_NAME_LEN);
+        copy_field_padded(resp.ip,      sizeof(resp.ip),      row_ip(sel, k),      IP_STRLEN-1);
+        resp.port_net = htons(table_[sel].port);
+        reply(c, &resp, sizeof(resp));
+    }
+
+    PDU end; reset_pdu(&end); end.type = PDU_W;
+    reply(c, &end, sizeof(end));
+    table_[sel].use_count += 1;
+}
+
+static void process_providers(const Client *c, const PDU *req) {
+    PDU resp;
+
+    char cont[CONTENT_NAME_LEN+1]; memset(cont, 0, sizeof(cont)); copy_field_padded(cont, sizeof(cont), req->content, CONTENT_NAME_LEN);
+
+    int rows[PROVIDERS_MAX];
+    int n = 0;
     int i;
-    for (i = 0; i < TABLE_MAX; ++i) {
-        if (!table_[i].in_use) continue;
-        if (strncmp(table_[i].peer, peer, PEER_NAME_LEN) == 0 &&
-            strncmp(table_[i].content, cont, CONTENT_NAME_LEN) == 0) {
-            table_[i].in_use = 0;
-            resp.type = PDU_A;
-            sendto(sock, &resp, sizeof(resp), 0, (const struct sockaddr*)cli, clen);
-            return;
+    if (cont[0]) resident(cont);
+    for (i = cont[0] ? bucket_[content_hash(cont)] : -1; i >= 0; i = table_[i].next) {
+        if (strncmp(table_[i].content, cont, CONTENT_NAME_LEN) != 0) continue;
+        // Insertion by use_count: the least used provider goes first, and
+        // past PROVIDERS_MAX the most used one falls off the end
+        int k;
+        if (n < PROVIDERS_MAX) k = n++;
+        else if (table_[rows[n-1]].use_count > table_[i].use_count) k = n - 1;
+        else continue;
+        while (k > 0 && table_[rows[k-1]].use_count > table_[i].use_count) {
+            rows[k] = rows[k-1];
+            k--;
         }
+        rows[k] = i;
+    }
+    if (n == 0) {
+        reset_pdu(&resp);
+        resp.type = PDU_E;
+        reply(c, &resp, sizeof(resp));
+        return;
+    }
+
+    for (i = 0; i < n; ++i) {
+        reset_pdu(&resp);
+        resp.type = PDU_P;
+        copy_field_padded(resp.peer,    sizeof(resp.peer),    row_peer(rows[i]),       PEER_NAME_LEN);
+        copy_field_padded(resp.content, sizeof(resp.content), table_[rows[i]].content, CONTENT_NAME_LEN);
+        copy_field_padded(resp.ip,      sizeof(resp.ip),      row_ip(rows[i], 0),      IP_STRLEN-1);
+        resp.port_net = htons(table_[rows[i]].port);
+        reply(c, &resp, sizeof(resp));
+    }
+
+    PDU end; reset_pdu(&end); end.type = PDU_P;
+    reply(c, &end, sizeof(end));
+    table_[rows[0]].use_count += 1;
+}
+
+static void process_deregister(const Client *c, const PDU *req) {
+    PDU resp; reset_pdu(&resp);
+
+    char peer[PEER_NAME_LEN+1];   memset(peer, 0, sizeof(peer));   copy_field_padded(peer,  sizeof(peer),  req->peer,    PEER_NAME_LEN);
+    char cont[CONTENT_NAME_LEN+1];memset(cont, 0, sizeof(cont));   copy_field_padded(cont,  sizeof(cont),  req->content, CONTENT_NAME_LEN);
+
+    int i = lookup_same_entry(peer, cont);
+    if (i >= 0) {
+        remove_row(i);
+        resp.type = PDU_A;
+        reply(c, &resp, sizeof(resp));
+        return;
+    }
+    if (store_forget(peer, cont) == 0) {
+        resp.type = PDU_A;
+        reply(c, &resp, sizeof(resp));
+        return;
     }
 
     resp.type = PDU_E;
-    sendto(sock, &resp, sizeof(resp), 0, (const struct sockaddr*)cli, clen);
+    reply(c, &resp, sizeof(resp));
+}
+
+// 'N': resolve up to MULTI_MAX names in one datagram. All names are hashed
+// and their buckets prefetched first, then resolved, so the cache misses of
+// the batch overlap instead of being paid one lookup at a time.
+//   request: 'N' | id (2) | count (2) | count x name (10)
+//   reply:   'N' | id (2) | count (2) | count x { found (1) | peer (10) | IPv4 (4) | port (2) }
+// Results are in request order; a name with no provider has found = 0.
+static void process_multi(const Client *c, const unsigned char *req, size_t len) {
+    unsigned char out[MULTI_HDR + MULTI_MAX * MULTI_REC];
+    char names[MULTI_MAX][CONTENT_NAME_LEN+1];
+    uint32_t h[MULTI_MAX];
+    int count = (req[3] << 8) | req[4];
+    int k;
+
+    if (count > MULTI_MAX || len != (size_t)(MULTI_HDR + count * CONTENT_NAME_LEN)) {
+        PDU e; reset_pdu(&e); e.type = PDU_E;
+        reply(c, &e, sizeof(e));
+        return;
+    }
+
+    for (k = 0; k < count; ++k) {
+        copy_field_padded(names[k], sizeof(names[k]), (const char *)req + MULTI_HDR + k * CONTENT_NAME_LEN, CONTENT_NAME_LEN);
+        h[k] = content_hash(names[k]);
+        __builtin_prefetch(&bucket_[h[k]]);
+    }
+    for (k = 0; k < count; ++k) {
+        if (bucket_[h[k]] >= 0) __builtin_prefetch(&table_[bucket_[h[k]]]);
+    }
+
+    memcpy(out, req, MULTI_HDR);
+    for (k = 0; k < count; ++k) {
+        unsigned char *rec = out + MULTI_HDR + k * MULTI_REC;
+        int sel = names[k][0] ? least_used_in_bucket(h[k], names[k]) : -1;
+        struct in_addr a;
+
+        memset(rec, 0, MULTI_REC);
+        if (sel < 0 || inet_aton(row_ip(sel, 0), &a) == 0) continue;
+        uint16_t port_net = htons(table_[sel].port);
+        rec[0] = 1;
+        memcpy(rec + 1, row_peer(sel), PEER_NAME_LEN);
+        memcpy(rec + 11, &a.s_addr, 4);
+        memcpy(rec + 15, &port_net, 2);
+        table_[sel].use_count += 1;
+    }
+    reply(c, out, MULTI_HDR + count * MULTI_REC);
+}
+
+// 'H': open a session for (peer, ip) bound to the requester's address and
+// answer 'H' + token (4). Later requests from that address may then use the
+// compact forms handled by process_compact. A bare 'H' means no session could
+// be opened; 'E' stays what an index without sessions answers
+static void process_hello(const Client *c, const PDU *req) {
+    char peer[PEER_NAME_LEN+1];   memset(peer, 0, sizeof(peer));   copy_field_padded(peer,  sizeof(peer),  req->peer,    PEER_NAME_LEN);
+    char ip[IP_STRLEN];           memset(ip,   0, sizeof(ip));     copy_field_padded(ip,    sizeof(ip),    req->ip,      IP_STRLEN-1);
+
+    int sess = peer[0] && ip[0] ? session_get(peer, ip, &c->addr) : -1;
+    if (sess < 0) {
+        unsigned char none = PDU_H;
+        reply(c, &none, 1);
+        return;
+    }
+
+    uint32_t token = sess_token(sess);
+    unsigned char out[5] = { PDU_H, (unsigned char)(token >> 24), (unsigned char)(token >> 16),
+                             (unsigned char)(token >> 8), (unsigned char)token };
+    reply(c, out, sizeof(out));
+}
+
+// Compact requests: the token stands for the peer name and primary address
+//   'r' | token (4) | port (2) | name (10)         register
+//   't' | token (4) | name (10)                    deregister
+//   'x' | token (4) | name (10) | IPv4 (4)         add an address
+// Each is answered with one byte: 'A', 'E', or 'H' when the token is unknown
+// (e.g. the index restarted) and the client should handshake again
+static void process_compact(const Client *c, const unsigned char *req, size_t len) {
+    static const size_t need[3] = { 17, 15, 19 };
+    int kind = req[0] == PDU_r ? 0 : req[0] == PDU_t ? 1 : 2;
+    unsigned char ans = PDU_E;
+
+    if (len != need[kind]) {
+        reply(c, &ans, 1);
+        return;
+    }
+    uint32_t token = ((uint32_t)req[1] << 24) | ((uint32_t)req[2] << 16) | ((uint32_t)req[3] << 8) | req[4];
+    int sess = session_from_token(token, &c->addr);
+    if (sess < 0) {
+        ans = PDU_H;
+        reply(c, &ans, 1);
+        return;
+    }
+
+    const unsigned char *name = req + (kind == 0 ? 7 : 5);
+    char cont[CONTENT_NAME_LEN+1]; memset(cont, 0, sizeof(cont)); copy_field_padded(cont, sizeof(cont), (const char *)name, CONTENT_NAME_LEN);
+
+    if (cont[0] == '\0') {
+        // Nothing to do
+    } else if (kind == 0) {
+        uint16_t port = (uint16_t)((req[5] << 8) | req[6]);
+        if (port != 0 && add_row(sess, cont, port) == 0) ans = PDU_A;
+    } else {
+        int i = lookup_same_entry(sess_[sess].peer, cont);
+        if (i >= 0 && kind == 1) {
+            remove_row(i);
+            ans = PDU_A;
+        } else if (kind == 1) {
+            if (store_forget(sess_[sess].peer, cont) == 0) ans = PDU_A;
+        } else if (i >= 0) {
+            struct in_addr a;
+            char ip[IP_STRLEN];
+            memcpy(&a.s_addr, name + CONTENT_NAME_LEN, 4);
+            if (inet_ntop(AF_INET, &a, ip, sizeof(ip)) && add_row_address(i, ip) == 0) ans = PDU_A;
+        }
+    }
+    reply(c, &ans, 1);
+}
+
+// One 'O' row per registration in the store
+static int list_stored(void *arg, const lsm_rec *r) {
+    const Client *c = arg;
+    PDU row; reset_pdu(&row);
+    row.type = PDU_O;
+    copy_field_padded(row.peer,    sizeof(row.peer),    r->peer,    PEER_NAME_LEN);
+    copy_field_padded(row.content, sizeof(row.content), r->content, CONTENT_NAME_LEN);
+    inet_ntop(AF_INET, &r->ip[0], row.ip, sizeof(row.ip));
+    row.port_net = htons(r->port);
+    reply(c, &row, sizeof(row));
+    return 0;
 }
 
-static void process_list(int sock, const struct sockaddr_in *cli, socklen_t clen) {
+static void process_list(const Client *c) {
     int i;
     PDU row;
 
-    for (i = 0; i < TABLE_MAX; ++i) {
+    if (store_) {
+        // The table holds only the cached part
+        lsm_each(store_, list_stored, (void *)c);
+        PDU end; reset_pdu(&end); end.type = PDU_O;
+        reply(c, &end, sizeof(end));
+        return;
+    }
+    for (i = 0; i < table_cap_; ++i) {
         if (!table_[i].in_use) continue;
 
         reset_pdu(&row);
         row.type = PDU_O;
-        copy_field_padded(row.peer,    sizeof(row.peer),    table_[i].peer,    PEER_NAME_LEN);
+        copy_field_padded(row.peer,    sizeof(row.peer),    row_peer(i),       PEER_NAME_LEN);
         copy_field_padded(row.content, sizeof(row.content), table_[i].content, CONTENT_NAME_LEN);
-        copy_field_padded(row.ip,      sizeof(row.ip),      table_[i].ip,      IP_STRLEN-1);
+        copy_field_padded(row.ip,      sizeof(row.ip),      row_ip(i, 0),      IP_STRLEN-1);
         row.port_net = htons(table_[i].port);
 
-        sendto(sock, &row, sizeof(row), 0, (const struct sockaddr*)cli, clen);
+        reply(c, &row, sizeof(row));
     }
 
     PDU end; reset_pdu(&end); end.type = PDU_O;
-    sendto(sock, &end, sizeof(end), 0, (const struct sockaddr*)cli, clen);
+    reply(c, &end, sizeof(end));
+}
+
+// Handle one request: a datagram, or the body of one stream frame
+static void dispatch(const Client *c, const unsigned char *raw, size_t n) {
+    PDU req;
+
+    if (n >= MULTI_HDR && raw[0] == PDU_N) {
+        process_multi(c, raw, n);
+        return;
+    }
+    if (n >= 5 && (raw[0] == PDU_r || raw[0] == PDU_t || raw[0] == PDU_x)) {
+        process_compact(c, raw, n);
+        return;
+    }
+    if (n != sizeof(req)) {
+        fprintf(stderr, "Discarding malformed PDU of length %ld bytes\n", (long)n);
+        return;
+    }
+    memcpy(&req, raw, sizeof(req));
+
+    switch (req.type) {
+    case PDU_R: process_register   (c, &req);  break;
+    case PDU_S: process_search     (c, &req);  break;
+    case PDU_T: process_deregister (c, &req);  break;
+    case PDU_X: process_add_address(c, &req);  break;
+    case PDU_W: process_search_all (c, &req);  break;
+    case PDU_P: process_providers  (c, &req);  break;
+    case PDU_H: process_hello      (c, &req);  break;
+    case PDU_O: process_list       (c);        break;
+    default: {
+        PDU e; reset_pdu(&e); e.type = PDU_E;
+        reply(c, &e, sizeof(e));
+    } break;
+    }
+}
+
+// Offset of the content name a request looks up, or 0 if it has none
+static size_t request_key(const unsigned char *raw, size_t n) {
+    if (n == sizeof(PDU)) {
+        switch (raw[0]) {
+        case PDU_R: case PDU_S: case PDU_T: case PDU_X: case PDU_W: case PDU_P:
+            return 1 + PEER_NAME_LEN;
+        }
+        return 0;
+    }
+    if (raw[0] == PDU_r && n >= 7 + CONTENT_NAME_LEN) return 7;
+    if ((raw[0] == PDU_t || raw[0] == PDU_x) && n >= 5 + CONTENT_NAME_LEN) return 5;
+    return 0;
+}
+
+// Content bucket a request looks up, UINT32_MAX if none
+static uint32_t request_hash(const unsigned char *raw, size_t n) {
+    size_t off = request_key(raw, n);
+    return off ? content_hash((const char *)raw + off) : UINT32_MAX;
+}
+
+// Handle n requests in order, overlapping their table misses: hash every key
+// (unless 'hash' already holds them) and prefetch the buckets, then the first
+// rows, then those rows' sessions, and only then resolve them. One lookup at a
+// time would wait for each of those dependent loads in turn
+static void dispatch_batch(const Client *c, unsigned char *const *raw, const size_t *len,
+                           const uint32_t *hash, int n) {
+    int row[BATCH_MAX];
+    uint32_t h[BATCH_MAX];
+    int k;
+
+    for (k = 0; k < n; ++k) {
+        row[k] = -1;
+        h[k] = hash ? hash[k] : request_hash(raw[k], len[k]);
+        if (h[k] != UINT32_MAX) __builtin_prefetch(&bucket_[h[k]]);
+    }
+    for (k = 0; k < n; ++k) {
+        if (h[k] == UINT32_MAX) continue;
+        row[k] = bucket_[h[k]];
+        if (row[k] >= 0) __builtin_prefetch(&table_[row[k]]);
+    }
+    for (k = 0; k < n; ++k) {
+        if (row[k] >= 0) __builtin_prefetch(&sess_[table_[row[k]].sess]);
+    }
+    for (k = 0; k < n; ++k) {
+        dispatch(&c[k], raw[k], len[k]);
+    }
+}
+
+static Conn *conn_[CONN_MAX];
+static uint32_t conn_serial_;
+static const char *store_dir_;
+
+static void conn_accept(int lsock, int is_unix) {
+    for (;;) {
+        struct sockaddr_in ra;
+        socklen_t rlen = sizeof(ra);
+        int fd = accept(lsock, is_unix ? NULL : (struct sockaddr*)&ra, is_unix ? NULL : &rlen);
+        if (fd < 0) return;
+
+        int k = 0;
+        while (k < CONN_MAX && conn_[k]) ++k;
+        Conn *cn = k < CONN_MAX ? calloc(1, sizeof(*cn)) : NULL;
+        if (!cn) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (!is_unix) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Replies are batched here
+            cn->addr = ra;
+        } else {
+            // No address to bind sessions to: 0.0.0.0/8 never sends datagrams
+            cn->addr.sin_family      = AF_INET;
+            cn->addr.sin_addr.s_addr = htonl(++conn_serial_ & 0xffffff);
+            cn->addr.sin_port        = htons(1);
+        }
+        cn->fd = fd;
+        conn_[k] = cn;
+    }
+}
+
+static void conn_close(int k) {
+    close(conn_[k]->fd);
+    free(conn_[k]->out);
+    free(conn_[k]);
+    conn_[k] = NULL;
+}
+
+// Write what is queued. Returns -1 if the connection broke
+static int conn_flush(Conn *cn) {
+    while (cn->out_off < cn->out_len) {
+        ssize_t w = send(cn->fd, cn->out + cn->out_off, cn->out_len - cn->out_off, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        cn->out_off += (size_t)w;
+    }
+    cn->out_len = cn->out_off = 0;
+    return 0;
+}
+
+// Handle every complete frame received so far, BATCH_MAX at a time, unless
+// replies already pile up. Returns -1 on a frame longer than any request
+static int conn_process(Conn *cn) {
+    static Client c[BATCH_MAX];
+    unsigned char *raw[BATCH_MAX];
+    size_t len[BATCH_MAX];
+    int rc = 0;
+    size_t off = 0;
+
+    for (int k = 0; k < BATCH_MAX; ++k) {
+        c[k].sock = -1;
+        c[k].addr = cn->addr;
+        c[k].alen = sizeof(c[k].addr);
+        c[k].conn = cn;
+    }
+    while (rc == 0 && cn->in_len - off >= 2 && cn->out_len - cn->out_off < CONN_OUT_HIGH) {
+        int n = 0;
+        while (n < BATCH_MAX && cn->in_len - off >= 2) {
+            size_t flen = ((size_t)cn->in[off] << 8) | cn->in[off + 1];
+            if (flen > REQ_MAX) { rc = -1; break; }
+            if (cn->in_len - off - 2 < flen) break;
+            raw[n] = cn->in + off + 2;
+            len[n++] = flen;
+            off += 2 + flen;
+        }
+        if (n == 0) break;
+        dispatch_batch(c, raw, len, NULL, n);
+    }
+    memmove(cn->in, cn->in + off, cn->in_len - off);
+    cn->in_len -= off;
+    return rc;
+}
+
+// Returns -1 once the client has gone or sent a frame that cannot fit
+static int conn_read(Conn *cn) {
+    if (cn->in_len == sizeof(cn->in)) return 0; // Full of frames held back
+    ssize_t r = recv(cn->fd, cn->in + cn->in_len, sizeof(cn->in) - cn->in_len, 0);
+    if (r == 0) return -1;
+    if (r < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    cn->in_len += (size_t)r;
+    return conn_process(cn);
+}
+
+static int listen_tcp(int port) {
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+    if (l < 0) { perror("socket"); return -1; }
+    int one = 1;
+    setsockopt(l, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family      = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_ANY);
+    a.sin_port        = htons((uint16_t)port);
+    if (bind(l, (struct sockaddr*)&a, sizeof(a)) < 0 || listen(l, 64) < 0) {
+        perror("tcp bind");
+        close(l);
+        return -1;
+    }
+    fcntl(l, F_SETFL, fcntl(l, F_GETFL) | O_NONBLOCK);
+    return l;
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un a;
+    if (strlen(path) >= sizeof(a.sun_path)) {
+        fprintf(stderr, "Unix socket path too long\n");
+        return -1;
+    }
+    int l = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (l < 0) { perror("socket"); return -1; }
+
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    strcpy(a.sun_path, path);
+    unlink(path); // Left over from an earlier run
+    if (bind(l, (struct sockaddr*)&a, sizeof(a)) < 0 || listen(l, 64) < 0) {
+        perror("unix bind");
+        close(l);
+        return -1;
+    }
+    fcntl(l, F_SETFL, fcntl(l, F_GETFL) | O_NONBLOCK);
+    return l;
+}
+
+// Hot restart (-H): a new index started with the same -H path connects to the
+// running one, which stops reading requests and hands over its sockets
+// (SCM_RIGHTS) followed by a snapshot of the table. Once the new index has
+// loaded it and acknowledged, the old one exits and the new one serves the
+// same sockets, starting with whatever queued up meanwhile. If the handoff
+// fails before the acknowledgement, the old index carries on.
+//   old -> header, with the UDP socket and any listeners attached
+//   old -> header.sessions x HotSess, then header.rows x HotRow
+//   new -> 'K'
+// Handshaken sessions keep their slots, so tokens stay valid. Stream
+// connections are not handed over: their clients reconnect. With a store (-s)
+// the old index writes back its cache and closes the store, and the snapshot
+// carries no rows: both sides must agree on having one
+typedef struct __attribute__((packed)) {
+    char     magic[8];
+    uint16_t row_size;                // Layout check: a binary with other records refuses
+    uint16_t sess_size;
+    uint32_t rows;
+    uint32_t sessions;
+    uint8_t  listeners;               // Attached after the UDP socket: 1 TCP, 2 Unix
+    uint8_t  store;                   // Rows are in the old index's store, not sent
+} HotHeader;
+
+typedef struct __attribute__((packed)) {
+    uint32_t slot;
+    uint16_t gen;
+    char     peer[PEER_NAME_LEN];
+    char     ip[IP_STRLEN];
+    uint32_t src_addr;                // Network order
+    uint16_t src_port;
+} HotSess;
+
+typedef struct __attribute__((packed)) {
+    char     peer[PEER_NAME_LEN];
+    char     content[CONTENT_NAME_LEN];
+    char     ip[MAX_ADDRS][IP_STRLEN];
+    uint8_t  n_ip;
+    uint16_t port;
+    uint32_t use_count;
+} HotRow;
+
+static int hot_write(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int hot_read(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Buffer one snapshot record, writing full chunks
+static int hot_put(int fd, char *buf, size_t *used, const void *rec, size_t len) {
+    if (*used + len > HOT_CHUNK) {
+        if (hot_write(fd, buf, *used) < 0) return -1;
+        *used = 0;
+    }
+    memcpy(buf + *used, rec, len);
+    *used += len;
+    return 0;
+}
+
+static void hot_timeouts(int fd) {
+    struct timeval tv = { HOT_TIMEOUT_S, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Old side: a new index connected to the handoff socket. Exits once it has
+// taken over; returns if it did not
+static void hot_give(int hs, int s, int ts, int us) {
+    int c = accept(hs, NULL, NULL);
+    if (c < 0) return;
+    hot_timeouts(c);
+
+    if (store_) {
+        // Nothing but the store carries over: save the cached use counts
+        for (int e = 0; e < res_cap_; ++e) {
+            if (res_[e].in_use) resident_evict(e);
+        }
+        res_pin_ = -1;
+        lsm_close(store_);
+        store_ = NULL;
+    }
+
+    HotHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, HOT_MAGIC, sizeof(HOT_MAGIC));
+    h.row_size  = sizeof(HotRow);
+    h.sess_size = sizeof(HotSess);
+    h.store     = store_dir_ != NULL;
+    for (int i = 0; i < table_cap_; ++i) h.rows += table_[i].in_use ? 1u : 0u;
+    for (int k = 0; k < sess_cap_; ++k) h.sessions += sess_[k].in_use && sess_[k].src.sin_port ? 1u : 0u;
+
+    int fds[3] = { s };
+    int nfd = 1;
+    if (ts >= 0) { fds[nfd++] = ts; h.listeners |= 1; }
+    if (us >= 0) { fds[nfd++] = us; h.listeners |= 2; }
+    union { char buf[CMSG_SPACE(sizeof(fds))]; struct cmsghdr align; } ctl;
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)nfd);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type  = SCM_RIGHTS;
+    cm->cmsg_len   = CMSG_LEN(sizeof(int) * (size_t)nfd);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * (size_t)nfd);
+
+    static char buf[HOT_CHUNK];
+    size_t used = 0;
+    int ok = sendmsg(c, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(h);
+    for (int k = 0; ok && k < sess_cap_; ++k) {
+        if (!sess_[k].in_use || !sess_[k].src.sin_port) continue;
+        HotSess r;
+        memset(&r, 0, sizeof(r));
+        r.slot = (uint32_t)k;
+        r.gen  = sess_[k].gen;
+        memcpy(r.peer, sess_[k].peer, PEER_NAME_LEN);
+        memcpy(r.ip, sess_[k].ip, IP_STRLEN);
+        r.src_addr = sess_[k].src.sin_addr.s_addr;
+        r.src_port = sess_[k].src.sin_port;
+        ok = hot_put(c, buf, &used, &r, sizeof(r)) == 0;
+    }
+    for (int i = 0; ok && i < table_cap_; ++i) {
+        if (!table_[i].in_use) continue;
+        HotRow r;
+        memset(&r, 0, sizeof(r));
+        memcpy(r.peer, row_peer(i), PEER_NAME_LEN);
+        memcpy(r.content, table_[i].content, CONTENT_NAME_LEN);
+        for (int k = 0; k < table_[i].n_ip; ++k) memcpy(r.ip[k], row_ip(i, k), IP_STRLEN);
+        r.n_ip      = (uint8_t)table_[i].n_ip;
+        r.port      = table_[i].port;
+        r.use_count = table_[i].use_count;
+        ok = hot_put(c, buf, &used, &r, sizeof(r)) == 0;
+    }
+    char ack = 0;
+    ok = ok && hot_write(c, buf, used) == 0 && hot_read(c, &ack, 1) == 0 && ack == 'K';
+    close(c);
+    if (ok) {
+        printf("Handed %u rows and %u sessions over to the new index\n", h.rows, h.sessions);
+        fflush(stdout);
+        exit(0);
+    }
+    fprintf(stderr, "Hot restart did not complete; still serving\n");
+    if (store_dir_) {
+        store_ = lsm_open(store_dir_);
+        if (!store_) {
+            fprintf(stderr, "Cannot reopen the store in %s\n", store_dir_);
+            exit(1);
+        }
+    }
+}
+
+// New side: take over from an index serving 'path'. Returns 1 with the
+// sockets in *s, *ts and *us (-1 if not handed over), 0 if no index answers
+// there, -1 if the handoff failed
+static int hot_take(const char *path, int *s, int *ts, int *us) {
+    struct sockaddr_un a;
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(a.sun_path)) return 0; // listen_unix() reports it
+    strcpy(a.sun_path, path);
+    int c = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (c < 0) return -1;
+    if (connect(c, (struct sockaddr*)&a, sizeof(a)) < 0) {
+        close(c);
+        return 0;
+    }
+    hot_timeouts(c);
+
+    HotHeader h;
+    int fds[3];
+    union { char buf[CMSG_SPACE(sizeof(fds))]; struct cmsghdr align; } ctl;
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    int nfd = 0;
+    ssize_t n = recvmsg(c, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cm = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        nfd = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        memcpy(fds, CMSG_DATA(cm), sizeof(int) * (size_t)nfd);
+    }
+    // The rest of a header split across reads (no descriptors come with it)
+    if (n > 0 && (size_t)n < sizeof(h) && hot_read(c, (char *)&h + n, sizeof(h) - (size_t)n) < 0) n = -1;
+    if (n <= 0 || memcmp(h.magic, HOT_MAGIC, sizeof(HOT_MAGIC)) != 0 || h.row_size != sizeof(HotRow) ||
+        h.sess_size != sizeof(HotSess) || nfd != 1 + !!(h.listeners & 1) + !!(h.listeners & 2)) {
+        fprintf(stderr, "The index on %s sent no usable handoff\n", path);
+        goto fail;
+    }
+    if (!h.store != !store_dir_) {
+        fprintf(stderr, h.store ? "The running index keeps its rows in a store; take it over with -s\n"
+                                : "The running index has no store; take it over without -s\n");
+        goto fail;
+    }
+
+    // Sessions first, in their old slots, then the free list around them
+    for (uint32_t k = 0; k < h.sessions; ++k) {
+        HotSess r;
+        if (hot_read(c, &r, sizeof(r)) < 0) goto fail;
+        int slot = (int)r.slot;
+        if (slot >= sess_cap_ || sess_[slot].in_use) continue; // Its client handshakes again
+        sess_[slot].in_use = 1;
+        sess_[slot].gen    = r.gen;
+        sess_[slot].rows   = 0;
+        copy_field_padded(sess_[slot].peer, sizeof(sess_[slot].peer), r.peer, PEER_NAME_LEN);
+        copy_field_padded(sess_[slot].ip,   sizeof(sess_[slot].ip),   r.ip,   IP_STRLEN-1);
+        memset(&sess_[slot].src, 0, sizeof(sess_[slot].src));
+        sess_[slot].src.sin_family      = AF_INET;
+        sess_[slot].src.sin_addr.s_addr = r.src_addr;
+        sess_[slot].src.sin_port        = r.src_port;
+        uint32_t sh = session_hash(sess_[slot].peer, sess_[slot].ip);
+        sess_[slot].next = sess_bucket_[sh];
+        sess_bucket_[sh] = slot;
+    }
+    free_sess_ = -1;
+    for (int k = sess_cap_ - 1; k >= 0; --k) {
+        if (sess_[k].in_use) continue;
+        sess_[k].next = free_sess_;
+        free_sess_ = k;
+    }
+
+    uint32_t dropped = 0;
+    for (uint32_t k = 0; k < h.rows; ++k) {
+        HotRow r;
+        char peer[PEER_NAME_LEN+1], ip[IP_STRLEN];
+        if (hot_read(c, &r, sizeof(r)) < 0) goto fail;
+        copy_field_padded(peer, sizeof(peer), r.peer, PEER_NAME_LEN);
+        copy_field_padded(ip, sizeof(ip), r.ip[0], IP_STRLEN-1);
+        int i = free_row_;
+        int sess = i >= 0 && r.n_ip >= 1 && r.n_ip <= MAX_ADDRS ? session_get(peer, ip, NULL) : -1;
+        if (sess < 0) {
+            dropped++; // A smaller -m than the old index had
+            continue;
+        }
+        free_row_ = table_[i].next;
+        table_[i].in_use = 1;
+        table_[i].sess   = sess;
+        copy_field_padded(table_[i].content, sizeof(table_[i].content), r.content, CONTENT_NAME_LEN);
+        for (int m = 1; m < r.n_ip; ++m) {
+            copy_field_padded(table_[i].extra[m-1], sizeof(table_[i].extra[m-1]), r.ip[m], IP_STRLEN-1);
+        }
+        table_[i].n_ip      = r.n_ip;
+        table_[i].port      = r.port;
+        table_[i].use_count = r.use_count;
+        table_[i].use_saved = r.use_count;
+        sess_[sess].rows += 1;
+        hash_insert(i);
+    }
+    if (hot_write(c, "K", 1) < 0) goto fail;
+    close(c);
+
+    *s  = fds[0];
+    *ts = h.listeners & 1 ? fds[1] : -1;
+    *us = h.listeners & 2 ? fds[nfd - 1] : -1;
+    printf("Took over from the running index: %u rows, %u sessions", h.rows - dropped, h.sessions);
+    if (dropped) printf(" (%u rows did not fit)", dropped);
+    printf("\n");
+    return 1;
+
+fail:
+    for (int k = 0; k < nfd; ++k) close(fds[k]);
+    close(c);
+    return -1;
+}
+
+// Staged mode receive thread: take datagrams off the shared socket, drop what
+// dispatch would discard, precompute the content bucket and publish a
+// descriptor to the owner
+static void *stage_io_main(void *arg) {
+    int s = stage_sock_;
+    uint64_t last = 0;
+    static _Thread_local unsigned char raw[UDP_BURST][REQ_MAX];
+    struct sockaddr_in from[UDP_BURST];
+    struct mmsghdr mh[UDP_BURST];
+    struct iovec iov[UDP_BURST];
+
+    pin_thread(*(int *)arg);
+    for (;;) {
+        memset(mh, 0, sizeof(mh));
+        for (int b = 0; b < UDP_BURST; ++b) {
+            iov[b].iov_base = raw[b];
+            iov[b].iov_len  = sizeof(raw[b]);
+            mh[b].msg_hdr.msg_iov     = &iov[b];
+            mh[b].msg_hdr.msg_iovlen  = 1;
+            mh[b].msg_hdr.msg_name    = &from[b];
+            mh[b].msg_hdr.msg_namelen = sizeof(from[b]);
+        }
+        int spin = busy_spinning(last);
+        int n = recvmmsg(s, mh, UDP_BURST, spin ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) perror("recvmmsg");
+            if (spin) sched_yield();
+            continue;
+        }
+        if (busy_us_ >= 0) last = now_us();
+        for (int b = 0; b < n; ++b) {
+            size_t len = mh[b].msg_len;
+            int ok = len == sizeof(PDU) ||
+                     (len >= MULTI_HDR && raw[b][0] == PDU_N) ||
+                     (len >= 5 && (raw[b][0] == PDU_r || raw[b][0] == PDU_t || raw[b][0] == PDU_x));
+            if (!ok) {
+                fprintf(stderr, "Discarding malformed PDU of length %ld bytes\n", (long)len);
+                continue;
+            }
+
+            // Claim a slot: its sequence equals the position while it is free
+            size_t pos = atomic_load_explicit(&stage_in_head_, memory_order_relaxed);
+            unsigned spins = 0;
+            StageReq *q;
+            for (;;) {
+                q = &stage_in_[pos & (STAGE_SLOTS - 1)];
+                size_t seq = atomic_load_explicit(&q->seq, memory_order_acquire);
+                if (seq == pos) {
+                    if (atomic_compare_exchange_weak_explicit(&stage_in_head_, &pos, pos + 1,
+                                                              memory_order_relaxed, memory_order_relaxed)) break;
+                } else if (seq < pos) {
+                    stage_backoff(&spins); // Full: the owner is behind
+                    pos = atomic_load_explicit(&stage_in_head_, memory_order_relaxed);
+                } else {
+                    pos = atomic_load_explicit(&stage_in_head_, memory_order_relaxed);
+                }
+            }
+            q->addr = from[b];
+            q->len  = (uint16_t)len;
+            q->hash = request_hash(raw[b], len);
+            memcpy(q->req, raw[b], len);
+            atomic_store_explicit(&q->seq, pos + 1, memory_order_release);
+        }
+    }
+    return NULL;
+}
+
+// Staged mode sender thread: drain the reply ring with sendmmsg()
+static void *stage_send_main(void *arg) {
+    int s = stage_sock_;
+    struct mmsghdr mh[UDP_BURST];
+    struct iovec iov[UDP_BURST];
+    size_t t = 0;
+    unsigned spins = 0;
+
+    pin_thread(*(int *)arg);
+    for (;;) {
+        size_t h = atomic_load_explicit(&stage_out_head_, memory_order_acquire);
+        if (h == t) {
+            stage_backoff(&spins);
+            continue;
+        }
+        spins = 0;
+        int n = h - t < UDP_BURST ? (int)(h - t) : UDP_BURST;
+        memset(mh, 0, sizeof(mh));
+        for (int b = 0; b < n; ++b) {
+            StageReply *r = &stage_out_[(t + (size_t)b) & (STAGE_SLOTS - 1)];
+            iov[b].iov_base = r->data;
+            iov[b].iov_len  = r->len;
+            mh[b].msg_hdr.msg_iov     = &iov[b];
+            mh[b].msg_hdr.msg_iovlen  = 1;
+            mh[b].msg_hdr.msg_name    = &r->addr;
+            mh[b].msg_hdr.msg_namelen = sizeof(r->addr);
+        }
+        int sent = sendmmsg(s, mh, (unsigned)n, 0);
+        if (sent < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            perror("sendmmsg");
+            sent = 1; // Skip the datagram that fails
+        }
+        t += (size_t)sent;
+        atomic_store_explicit(&stage_out_tail_, t, memory_order_release);
+    }
+    return NULL;
+}
+
+// Staged mode owner loop: apply descriptors in batches of up to BATCH_MAX
+static int run_staged(int s, int io_threads) {
+    static int slot[STAGE_IO_MAX + 1];
+    pthread_t th;
+
+    stage_in_  = calloc(STAGE_SLOTS, sizeof(*stage_in_));
+    stage_out_ = calloc(STAGE_SLOTS, sizeof(*stage_out_));
+    if (!stage_in_ || !stage_out_) {
+        fprintf(stderr, "Cannot allocate the staged-mode rings\n");
+        return 1;
+    }
+    for (size_t k = 0; k < STAGE_SLOTS; ++k) atomic_init(&stage_in_[k].seq, k);
+    staged_ = 1;
+    stage_sock_ = s;
+    for (int k = 0; k <= io_threads; ++k) {
+        slot[k] = k + 1; // The owner takes the first CPU
+        if (pthread_create(&th, NULL, k == 0 ? stage_send_main : stage_io_main, &slot[k]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(th);
+    }
+    printf("Staged mode: %d receive thread(s), one table owner, one sender\n", io_threads);
+    fflush(stdout);
+
+    static Client c[BATCH_MAX];
+    unsigned char *raw[BATCH_MAX];
+    size_t len[BATCH_MAX];
+    uint32_t hash[BATCH_MAX];
+    unsigned spins = 0;
+
+    for (;;) {
+        int n = 0;
+        while (n < BATCH_MAX) {
+            StageReq *q = &stage_in_[(stage_in_tail_ + (size_t)n) & (STAGE_SLOTS - 1)];
+            if (atomic_load_explicit(&q->seq, memory_order_acquire) != stage_in_tail_ + (size_t)n + 1) break;
+            c[n].sock = s;
+            c[n].addr = q->addr;
+            c[n].alen = sizeof(q->addr);
+            c[n].conn = NULL;
+            raw[n]  = q->req;
+            len[n]  = q->len;
+            hash[n] = q->hash;
+            n++;
+        }
+        if (n == 0) {
+            stage_backoff(&spins);
+            continue;
+        }
+        spins = 0;
+        dispatch_batch(c, raw, len, hash, n);
+        if (store_) lsm_maintain(store_);
+
+        // Hand the slots back for the lap after next
+        for (int k = 0; k < n; ++k) {
+            StageReq *q = &stage_in_[(stage_in_tail_ + (size_t)k) & (STAGE_SLOTS - 1)];
+            atomic_store_explicit(&q->seq, stage_in_tail_ + (size_t)k + STAGE_SLOTS, memory_order_release);
+        }
+        stage_in_tail_ += (size_t)n;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-B spin_us] [-c first_cpu] [-g auto|thp|4k] [-H handoff_path] [-m max_rows] [-P io_threads] [-s store_dir] [-t tcp_port] [-u unix_path] <udp_port>\n", prog);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <udp_port>\n", argv[0]);
+    int tcp_port = 0;
+    int rows = TABLE_MAX;
+    int io_threads = 0;
+    const char *unix_path = NULL;
+    const char *store_dir = NULL;
+    const char *hot_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "B:c:g:H:m:P:s:t:u:")) != -1) {
+        switch (opt) {
+        case 'B': busy_us_ = atol(optarg); if (busy_us_ < 0) busy_us_ = 0; break;
+        case 'c': cpu_     = atoi(optarg); break;
+        case 'g':
+            if      (strcmp(optarg, "auto") == 0) pages_ = PAGES_AUTO;
+            else if (strcmp(optarg, "thp")  == 0) pages_ = PAGES_THP;
+            else if (strcmp(optarg, "4k")   == 0) pages_ = PAGES_4K;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'H': hot_path   = optarg;       break;
+        case 'm': rows       = atoi(optarg); break;
+        case 'P': io_threads = atoi(optarg); break;
+        case 's': store_dir  = optarg;       break;
+        case 't': tcp_port  = atoi(optarg); break;
+        case 'u': unix_path = optarg;       break;
+        default:  usage(argv[0]);           return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
         return 1;
     }
-    int port = atoi(argv[1]);
-    if (port <= 0 || port > 65535) {
+    int port = atoi(argv[optind]);
+    if (port <= 0 || port > 65535 || tcp_port < 0 || tcp_port > 65535) {
         fprintf(stderr, "Port number must be in range 1..65535\n");
         return 1;
     }
 
-    int s = socket(AF_INET, SOCK_DGRAM, 0);
-    if (s < 0) { perror("socket"); return 1; }
+    if (io_threads < 0 || io_threads > STAGE_IO_MAX) {
+        fprintf(stderr, "Receive threads must be in range 1..%d\n", STAGE_IO_MAX);
+        return 1;
+    }
+    if (io_threads > 0 && (tcp_port || unix_path)) {
+        fprintf(stderr, "Staged mode (-P) serves UDP only; drop -t/-u\n");
+        return 1;
+    }
+    if (io_threads > 0 && hot_path) {
+        fprintf(stderr, "Hot restart (-H) needs the default loop; drop -P\n");
+        return 1;
+    }
+    if (rows <= 0 || rows > (1 << 30)) {
+        fprintf(stderr, "Row count must be in range 1..%d\n", 1 << 30);
+        return 1;
+    }
+    // Owner's CPU first: the arena is bound to and first-touched on its node
+    cpu_set_t unpinned;
+    CPU_ZERO(&unpinned);
+    (void)pthread_getaffinity_np(pthread_self(), sizeof(unpinned), &unpinned);
+    pin_thread(0);
+    if (table_init(rows) < 0) {
+        fprintf(stderr, "Cannot allocate a table of %d rows\n", rows);
+        return 1;
+    }
+
+    // Before the store: the index handing over closes it first
+    store_dir_ = store_dir;
+    int s = -1, ts = -1, us = -1;
+    int took = hot_path ? hot_take(hot_path, &s, &ts, &us) : 0;
+    if (took < 0) return 1;
+
+    if (store_dir) {
+        // The store's threads inherit the mask: keep their work off the owner's CPU
+        if (cpu_ >= 0) (void)pthread_setaffinity_np(pthread_self(), sizeof(unpinned), &unpinned);
+        store_ = lsm_open(store_dir);
+        pin_thread(0);
+        if (!store_ || resident_init() < 0) {
+            fprintf(stderr, "Cannot open the store in %s\n", store_dir);
+            return 1;
+        }
+        printf("Store %s: %llu rows on disk in %d run(s), caching up to %d rows\n", store_dir,
+               (unsigned long long)lsm_disk_rows(store_), lsm_runs(store_), rows);
+    }
 
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
-    addr.sin_family      = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port        = htons((uint16_t)port);
+    if (took) {
+        // Same sockets, same ports: whatever the old index was bound to
+        socklen_t alen = sizeof(addr);
+        getsockname(s, (struct sockaddr*)&addr, &alen);
+        port = ntohs(addr.sin_port);
+        alen = sizeof(addr);
+        if (ts >= 0 && getsockname(ts, (struct sockaddr*)&addr, &alen) == 0) tcp_port = ntohs(addr.sin_port);
+    } else {
+        s = socket(AF_INET, SOCK_DGRAM, 0);
+        if (s < 0) { perror("socket"); return 1; }
 
-    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("bind");
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port        = htons((uint16_t)port);
+
+        if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("bind");
+            close(s);
+            return 1;
+        }
+    }
+
+    if (ts < 0 && tcp_port) ts = listen_tcp(tcp_port);
+    if (us < 0 && unix_path) us = listen_unix(unix_path);
+    int hs = hot_path ? listen_unix(hot_path) : -1;
+    if ((tcp_port && ts < 0) || (unix_path && us < 0) || (hot_path && hs < 0)) {
         close(s);
         return 1;
     }
 
     printf("P2P index now waiting on UDP port %d\n", port);
-    memset(table_, 0, sizeof(table_));
+    if (ts >= 0) printf("Accepting stream clients on TCP port %d\n", tcp_port);
+    if (us >= 0) printf("Accepting stream clients on %s\n", unix_path ? unix_path : "the inherited Unix socket");
+    if (hs >= 0) printf("A new index started with -H %s takes over from this one\n", hot_path);
+    if (busy_us_ >= 0) {
+        // Also let the kernel spin on the device queue when a read does block
+        int bp = BUSY_POLL_US;
+        if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &bp, sizeof(bp)) < 0) perror("SO_BUSY_POLL");
+        printf("Busy polling: spinning %ld us after each request\n", busy_us_);
+    }
+    if (io_threads > 0) {
+        return run_staged(s, io_threads);
+    }
+    uint64_t last = 0;
 
     for (;;) {
-        PDU req;
-        struct sockaddr_in cli;
-        socklen_t clen = sizeof(cli);
-        ssize_t n;
+        struct pollfd pfd[4 + CONN_MAX];
+        int who[4 + CONN_MAX];
+        int np = 0;
 
-        n = recvfrom(s, &req, sizeof(req), 0, (struct sockaddr*)&cli, &clen);
-        if (n < 0) {
-            perror("recvfrom");
+        pfd[np].fd = s;  pfd[np].events = POLLIN; who[np++] = -1;
+        if (ts >= 0) { pfd[np].fd = ts; pfd[np].events = POLLIN; who[np++] = -2; }
+        if (us >= 0) { pfd[np].fd = us; pfd[np].events = POLLIN; who[np++] = -3; }
+        if (hs >= 0) { pfd[np].fd = hs; pfd[np].events = POLLIN; who[np++] = -4; }
+        for (int k = 0; k < CONN_MAX; ++k) {
+            if (!conn_[k]) continue;
+            int backlog = conn_[k]->out_len > conn_[k]->out_off;
+            pfd[np].fd = conn_[k]->fd;
+            pfd[np].events = (short)((conn_[k]->out_len - conn_[k]->out_off < CONN_OUT_HIGH ? POLLIN : 0) |
+                                     (backlog ? POLLOUT : 0));
+            who[np++] = k;
+        }
+        // With a store, wake up now and then to install finished flushes and merges
+        int ready = poll(pfd, (nfds_t)np, busy_spinning(last) ? 0 : store_ ? 1000 : -1);
+        if (ready < 0) {
+            if (errno != EINTR) perror("poll");
             continue;
         }
-        if (n != (ssize_t)sizeof(req)) {
-            fprintf(stderr, "Discarding malformed PDU of length %ld bytes\n", (long)n);
+        if (ready == 0) {
+            if (store_) lsm_maintain(store_);
+            sched_yield(); // Free on a dedicated core; lets a co-located client run otherwise
             continue;
         }
+        if (busy_us_ >= 0) last = now_us();
+
+        for (int p = 0; p < np; ++p) {
+            if (!pfd[p].revents) continue;
+            if (who[p] == -1) {
+                // Everything queued, up to UDP_BURST datagrams, in one call
+                static unsigned char raw[UDP_BURST][REQ_MAX];
+                static Client c[UDP_BURST];
+                struct mmsghdr mh[UDP_BURST];
+                struct iovec iov[UDP_BURST];
+                unsigned char *rp[UDP_BURST];
+                size_t len[UDP_BURST];
 
-        switch (req.type) {
-        case PDU_R: process_register   (s, &cli, clen, &req);  break;
-        case PDU_S: process_search     (s, &cli, clen, &req);  break;
-        case PDU_T: process_deregister (s, &cli, clen, &req);  break;
-        case PDU_O: process_list       (s, &cli, clen);        break;
-        default: {
-            PDU e; reset_pdu(&e); e.type = PDU_E;
-            sendto(s, &e, sizeof(e), 0, (const struct sockaddr*)&cli, clen);
-        } break;
+                memset(mh, 0, sizeof(mh));
+                for (int b = 0; b < UDP_BURST; ++b) {
+                    iov[b].iov_base = raw[b];
+                    iov[b].iov_len  = sizeof(raw[b]);
+                    mh[b].msg_hdr.msg_iov     = &iov[b];
+                    mh[b].msg_hdr.msg_iovlen  = 1;
+                    mh[b].msg_hdr.msg_name    = &c[b].addr;
+                    mh[b].msg_hdr.msg_namelen = sizeof(c[b].addr);
+                }
+                int n = recvmmsg(s, mh, UDP_BURST, MSG_DONTWAIT, NULL);
+                if (n < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("recvmmsg");
+                    continue;
+                }
+                for (int b = 0; b < n; ++b) {
+                    c[b].sock = s;
+                    c[b].alen = mh[b].msg_hdr.msg_namelen;
+                    c[b].conn = NULL;
+                    rp[b]  = raw[b];
+                    len[b] = mh[b].msg_len;
+                }
+                dispatch_batch(c, rp, len, NULL, n);
+            } else if (who[p] == -4) {
+                hot_give(hs, s, ts, us);
+            } else if (who[p] < 0) {
+                conn_accept(pfd[p].fd, who[p] == -3);
+            } else {
+                Conn *cn = conn_[who[p]];
+                int bad = (pfd[p].revents & (POLLERR | POLLNVAL)) != 0;
+                if (!bad && (pfd[p].revents & (POLLIN | POLLHUP))) bad = conn_read(cn) < 0;
+                if (!bad) {
+                    bad = conn_flush(cn) < 0;
+                    if (!bad && cn->in_len > 0) {
+                        // Frames held back while replies were piled up
+                        bad = conn_process(cn) < 0 || conn_flush(cn) < 0;
+                    }
+                }
+                if (bad) conn_close(who[p]);
+            }
         }
+        if (store_) lsm_maintain(store_);
     }
     return 0;
 }
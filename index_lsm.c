@@ -0,0 +1,835 @@
+// Log-structured storage for index registrations (see index_lsm.h)
+//
+// On disk, in the store's directory:
+//   MANIFEST         "next N", then "run N" oldest first, then "wal N" per live log
+//   run-N.sst        header | records sorted by (content, peer) | Bloom bits
+//   wal-N.log        records appended in arrival order
+// The manifest is replaced with rename(), so a crash leaves either the old or
+// the new set of files live; unlisted ones are leftovers.
+#define _GNU_SOURCE        // qsort_r()
+#include "index_lsm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MEM_ROWS       (1 << 18)   // Memtable rows before it is frozen
+#define MEM_BUCKETS    (1 << 19)   // Power of two
+#define FENCE_EVERY    256         // Records per in-memory fence key
+#define BLOOM_BITS     10          // Per record: about 1% false positives
+#define BLOOM_K        7
+#define MERGE_WIDTH    4           // Adjacent runs of one size class merged at once
+#define MERGE_MAX      16          // Most runs in one merge
+#define RUNS_MAX       64          // Beyond this, merge the newest runs regardless
+#define FLUSH_TRIES    3           // Failed flushes a write waits out before it fails
+#define RUN_HDR        64
+#define RUN_MAGIC      "P2PLSM1"
+
+typedef struct {
+    char     magic[8];
+    uint64_t count;
+    uint64_t bloom_bits;
+    uint32_t seq;
+} RunHeader;
+
+typedef struct {
+    uint32_t       seq;
+    uint64_t       count;
+    const lsm_rec *rec;            // Mapped, sorted
+    const uint8_t *bloom;
+    uint64_t       bloom_bits;
+    void          *map;
+    size_t         map_len;
+    char         (*fence)[2 * LSM_NAME_LEN]; // Key of every FENCE_EVERY-th record
+    uint64_t       n_fence;
+} Run;
+
+typedef struct {
+    lsm_rec  *rec;
+    int       n;
+    int      *next;                // Chain of rows with the same content hash
+    int      *bucket;
+    uint32_t  wal_seq;
+} Mem;
+
+// One element of a merge: a sorted array, or an unsorted one read through 'order'
+typedef struct {
+    const lsm_rec *rec;
+    const int     *order;
+    uint64_t       n;
+    uint64_t       pos;
+} Src;
+
+enum { JOB_FLUSH, JOB_MERGE, JOB_KINDS };
+
+// One kind of background work, on its own thread, so a flush never waits
+// behind a long merge. Finished jobs are installed by the owner
+typedef struct {
+    struct lsm      *db;
+    int              kind;
+    pthread_t        thread;
+    int              busy;         // Handed to the thread
+    int              done;         // Finished, waiting for lsm_maintain
+    int              ok;
+    uint32_t         seq;          // Output run
+    int              first;        // Merge: runs[first .. + n)
+    int              n;
+    int              drop;         // Merge includes the oldest run: drop deletions
+    const Run       *in[MERGE_MAX]; // Merge inputs, newest first
+} Job;
+
+struct lsm {
+    char             dir[PATH_MAX - 64]; // Room for the file names below
+    Mem             *mem;
+    Mem             *imm;          // Frozen, being written out
+    FILE            *wal;
+    Run            **runs;         // Oldest first
+    int              n_runs;
+    uint32_t         next_seq;
+
+    Job              job[JOB_KINDS];
+    int              threads;      // Started
+    pthread_mutex_t  mu;
+    pthread_cond_t   cv;
+    int              stop;
+};
+
+static uint64_t name_hash(const char *content) {
+    uint64_t h = 1469598103934665603ull;
+    for (int i = 0; i < LSM_NAME_LEN; ++i) {
+        h = (h ^ (unsigned char)content[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static int key_cmp(const lsm_rec *a, const lsm_rec *b) {
+    int c = memcmp(a->content, b->content, LSM_NAME_LEN);
+    return c ? c : memcmp(a->peer, b->peer, LSM_NAME_LEN);
+}
+
+static void pad_name(char *dst, const char *src) {
+    size_t n = 0;
+    for (; n < LSM_NAME_LEN && src[n]; ++n) dst[n] = src[n];
+    for (; n < LSM_NAME_LEN; ++n) dst[n] = '\0';
+}
+
+static void path_of(const lsm *db, char *out, const char *kind, uint32_t seq) {
+    snprintf(out, PATH_MAX, "%s/%s-%08u.%s", db->dir, kind, seq, kind[0] == 'r' ? "sst" : "log");
+}
+
+// ---- Memtable ----
+
+static Mem *mem_new(uint32_t wal_seq) {
+    Mem *m = calloc(1, sizeof(*m));
+    if (!m) return NULL;
+    m->rec    = malloc(sizeof(*m->rec) * MEM_ROWS);
+    m->next   = malloc(sizeof(*m->next) * MEM_ROWS);
+    m->bucket = malloc(sizeof(*m->bucket) * MEM_BUCKETS);
+    if (!m->rec || !m->next || !m->bucket) {
+        free(m->rec); free(m->next); free(m->bucket); free(m);
+        return NULL;
+    }
+    memset(m->bucket, 0xff, sizeof(*m->bucket) * MEM_BUCKETS);
+    m->wal_seq = wal_seq;
+    return m;
+}
+
+static void mem_free(Mem *m) {
+    if (!m) return;
+    free(m->rec);
+    free(m->next);
+    free(m->bucket);
+    free(m);
+}
+
+// Replace (content, peer) in place or append it. The caller makes sure there is room
+static void mem_put(Mem *m, const lsm_rec *r) {
+    uint32_t b = (uint32_t)name_hash(r->content) & (MEM_BUCKETS - 1);
+    for (int i = m->bucket[b]; i >= 0; i = m->next[i]) {
+        if (key_cmp(&m->rec[i], r) == 0) {
+            m->rec[i] = *r;
+            return;
+        }
+    }
+    m->rec[m->n]  = *r;
+    m->next[m->n] = m->bucket[b];
+    m->bucket[b]  = m->n++;
+}
+
+static int order_cmp(const void *a, const void *b, void *arg) {
+    const lsm_rec *rec = arg;
+    return key_cmp(&rec[*(const int *)a], &rec[*(const int *)b]);
+}
+
+// Rows of m in key order, as indexes into m->rec
+static int *mem_order(const Mem *m) {
+    int *o = malloc(sizeof(*o) * (size_t)(m->n ? m->n : 1));
+    if (!o) return NULL;
+    for (int i = 0; i < m->n; ++i) o[i] = i;
+    qsort_r(o, (size_t)m->n, sizeof(*o), order_cmp, m->rec);
+    return o;
+}
+
+// ---- Runs ----
+
+static int bloom_maybe(const uint8_t *bits, uint64_t nbits, const char *content) {
+    uint64_t h = name_hash(content);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for (uint32_t k = 0; k < BLOOM_K; ++k) {
+        uint64_t bit = ((uint64_t)h1 + (uint64_t)k * h2) % nbits;
+        if (!(bits[bit >> 3] & (1u << (bit & 7)))) return 0;
+    }
+    return 1;
+}
+
+static void bloom_add(uint8_t *bits, uint64_t nbits, const char *content) {
+    uint64_t h = name_hash(content);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for (uint32_t k = 0; k < BLOOM_K; ++k) {
+        uint64_t bit = ((uint64_t)h1 + (uint64_t)k * h2) % nbits;
+        bits[bit >> 3] |= (uint8_t)(1u << (bit & 7));
+    }
+}
+
+static void run_close(Run *r, int unlink_it, const lsm *db) {
+    if (!r) return;
+    if (r->map) munmap(r->map, r->map_len);
+    if (unlink_it) {
+        char path[PATH_MAX];
+        path_of(db, path, "run", r->seq);
+        unlink(path);
+    }
+    free(r->fence);
+    free(r);
+}
+
+static Run *run_open(const lsm *db, uint32_t seq) {
+    char path[PATH_MAX];
+    struct stat st;
+    Run *r = calloc(1, sizeof(*r));
+
+    path_of(db, path, "run", seq);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (!r || fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < RUN_HDR) {
+        if (fd >= 0) close(fd);
+        free(r);
+        return NULL;
+    }
+    r->map_len = (size_t)st.st_size;
+    r->map = mmap(NULL, r->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r->map == MAP_FAILED) {
+        free(r);
+        return NULL;
+    }
+    const RunHeader *h = r->map;
+    if (memcmp(h->magic, RUN_MAGIC, sizeof(RUN_MAGIC)) != 0 ||
+        RUN_HDR + h->count * sizeof(lsm_rec) + (h->bloom_bits + 7) / 8 != r->map_len) {
+        munmap(r->map, r->map_len);
+        free(r);
+        return NULL;
+    }
+    r->seq        = seq;
+    r->count      = h->count;
+    r->rec        = (const lsm_rec *)((const char *)r->map + RUN_HDR);
+    r->bloom_bits = h->bloom_bits;
+    r->bloom      = (const uint8_t *)(r->rec + r->count);
+    // Records are found by binary search: read-ahead would only fetch neighbours
+    (void)madvise(r->map, r->map_len, MADV_RANDOM);
+
+    r->n_fence = (r->count + FENCE_EVERY - 1) / FENCE_EVERY;
+    r->fence   = malloc(sizeof(*r->fence) * (r->n_fence ? r->n_fence : 1));
+    if (!r->fence) {
+        run_close(r, 0, db);
+        return NULL;
+    }
+    for (uint64_t f = 0; f < r->n_fence; ++f) {
+        memcpy(r->fence[f], r->rec[f * FENCE_EVERY].content, 2 * LSM_NAME_LEN);
+    }
+    return r;
+}
+
+// Index of the first record of 'content' in r, or r->count if none
+static uint64_t run_seek(const Run *r, const char *content) {
+    // Last fence below the content, then the block it starts
+    uint64_t lo = 0, hi = r->n_fence;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (memcmp(r->fence[mid], content, LSM_NAME_LEN) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    uint64_t first = lo ? (lo - 1) * FENCE_EVERY : 0;
+    uint64_t last  = lo * FENCE_EVERY < r->count ? lo * FENCE_EVERY : r->count;
+    while (first < last) {
+        uint64_t mid = (first + last) / 2;
+        if (memcmp(r->rec[mid].content, content, LSM_NAME_LEN) < 0) first = mid + 1;
+        else last = mid;
+    }
+    return first;
+}
+
+static const lsm_rec *src_peek(const Src *s) {
+    if (s->pos >= s->n) return NULL;
+    return s->order ? &s->rec[s->order[s->pos]] : &s->rec[s->pos];
+}
+
+// Next key across sources ordered newest first; the newest version wins and
+// the older ones are skipped. Returns NULL when all are exhausted
+static const lsm_rec *merge_next(Src *src, int ns) {
+    const lsm_rec *best = NULL;
+    for (int i = 0; i < ns; ++i) {
+        const lsm_rec *r = src_peek(&src[i]);
+        if (r && (!best || key_cmp(r, best) < 0)) best = r;
+    }
+    if (!best) return NULL;
+    const lsm_rec *win = NULL;
+    for (int i = 0; i < ns; ++i) {
+        const lsm_rec *r = src_peek(&src[i]);
+        if (r && key_cmp(r, best) == 0) {
+            if (!win) win = r;
+            src[i].pos++;
+        }
+    }
+    return win;
+}
+
+// Write the merge of src[0..ns) as run 'seq'. Returns 0 or -1
+static int run_write(const lsm *db, uint32_t seq, Src *src, int ns, int drop_dead) {
+    char path[PATH_MAX], tmp[PATH_MAX];
+    uint64_t upper = 0;
+    for (int i = 0; i < ns; ++i) upper += src[i].n;
+
+    RunHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RUN_MAGIC, sizeof(RUN_MAGIC));
+    h.seq        = seq;
+    h.bloom_bits = ((upper * BLOOM_BITS + 63) / 64) * 64;
+    if (h.bloom_bits == 0) h.bloom_bits = 64;
+    uint8_t *bloom = calloc(1, h.bloom_bits / 8);
+
+    path_of(db, path, "run", seq);
+    snprintf(tmp, sizeof(tmp), "%s/run-%08u.tmp", db->dir, seq);
+    FILE *fp = bloom ? fopen(tmp, "wb") : NULL;
+    if (!fp) {
+        free(bloom);
+        return -1;
+    }
+    static const char zero[RUN_HDR];
+    int ok = fwrite(zero, 1, RUN_HDR, fp) == RUN_HDR;
+    const lsm_rec *r;
+    while (ok && (r = merge_next(src, ns)) != NULL) {
+        if ((h.count & 4095) == 0 && __atomic_load_n(&db->stop, __ATOMIC_RELAXED)) {
+            ok = 0; // Closing: abandon it, nothing lists the output yet
+            break;
+        }
+        if (r->dead && drop_dead) continue;
+        bloom_add(bloom, h.bloom_bits, r->content);
+        ok = fwrite(r, sizeof(*r), 1, fp) == 1;
+        h.count++;
+    }
+    // The Bloom filter was sized for the upper bound; trim it to fit the rows
+    // actually written by rebuilding at the final size
+    if (ok && h.count < upper) {
+        uint64_t bits = ((h.count * BLOOM_BITS + 63) / 64) * 64;
+        if (bits == 0) bits = 64;
+        memset(bloom, 0, bits / 8);
+        ok = fflush(fp) == 0;
+        FILE *rd = ok ? fopen(tmp, "rb") : NULL;
+        lsm_rec rec;
+        if (rd && fseek(rd, RUN_HDR, SEEK_SET) == 0) {
+            while (fread(&rec, sizeof(rec), 1, rd) == 1) bloom_add(bloom, bits, rec.content);
+        } else {
+            ok = 0;
+        }
+        if (rd) fclose(rd);
+        h.bloom_bits = bits;
+    }
+    ok = ok && fwrite(bloom, 1, h.bloom_bits / 8, fp) == h.bloom_bits / 8;
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, fp) == 1;
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+    free(bloom);
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// ---- Background thread ----
+
+static void *lsm_thread(void *arg) {
+    Job *j = arg;
+    lsm *db = j->db;
+
+    pthread_mutex_lock(&db->mu);
+    for (;;) {
+        while (!db->stop && (!j->busy || j->done)) pthread_cond_wait(&db->cv, &db->mu);
+        if (db->stop) break;
+        pthread_mutex_unlock(&db->mu);
+
+        // The inputs are immutable until this job is installed; the owner only
+        // appends to the run list meanwhile, and not while reading db->imm
+        int ok = -1;
+        if (j->kind == JOB_FLUSH) {
+            int *order = mem_order(db->imm);
+            Src s = { db->imm->rec, order, (uint64_t)db->imm->n, 0 };
+            ok = order ? run_write(db, j->seq, &s, 1, 0) : -1;
+            free(order);
+        } else {
+            Src s[MERGE_MAX];
+            memset(s, 0, sizeof(s));
+            for (int i = 0; i < j->n; ++i) {
+                s[i].rec = j->in[i]->rec;
+                s[i].n   = j->in[i]->count;
+            }
+            ok = run_write(db, j->seq, s, j->n, j->drop);
+        }
+
+        pthread_mutex_lock(&db->mu);
+        j->ok   = ok == 0;
+        j->done = 1;
+        pthread_cond_broadcast(&db->cv);
+    }
+    pthread_mutex_unlock(&db->mu);
+    return NULL;
+}
+
+static int write_manifest(lsm *db) {
+    char path[PATH_MAX], tmp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/MANIFEST", db->dir);
+    snprintf(tmp, sizeof(tmp), "%s/MANIFEST.tmp", db->dir);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return -1;
+    fprintf(fp, "next %u\n", db->next_seq);
+    for (int i = 0; i < db->n_runs; ++i) fprintf(fp, "run %u\n", db->runs[i]->seq);
+    if (db->imm) fprintf(fp, "wal %u\n", db->imm->wal_seq);
+    fprintf(fp, "wal %u\n", db->mem->wal_seq);
+    int ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int size_class(uint64_t count) {
+    int c = 0;
+    for (uint64_t n = count / MEM_ROWS; n >= 4; n /= 4) c++;
+    return c;
+}
+
+// Start what the idle threads can do: a flush of the frozen memtable, and a
+// merge of MERGE_WIDTH or more adjacent runs of one size class (or the newest
+// ones when there are too many runs)
+static void schedule(lsm *db) {
+    Job *f = &db->job[JOB_FLUSH], *m = &db->job[JOB_MERGE];
+
+    pthread_mutex_lock(&db->mu);
+    if (!f->busy && db->imm) {
+        f->busy = 1;
+        f->seq  = db->next_seq++;
+    }
+    if (!m->busy) {
+        int first = -1, n = 0;
+        for (int i = db->n_runs - 1; i >= 0 && first < 0; ) {
+            int j = i;
+            while (j > 0 && size_class(db->runs[j - 1]->count) == size_class(db->runs[i]->count)) j--;
+            if (i - j + 1 >= MERGE_WIDTH) {
+                n = i - j + 1 < MERGE_MAX ? i - j + 1 : MERGE_MAX;
+                first = i - n + 1;
+            }
+            i = j - 1;
+        }
+        if (first < 0 && db->n_runs > RUNS_MAX) {
+            first = db->n_runs - MERGE_WIDTH;
+            n = MERGE_WIDTH;
+        }
+        if (first >= 0) {
+            m->busy  = 1;
+            m->first = first;
+            m->n     = n;
+            m->drop  = first == 0;
+            m->seq   = db->next_seq++;
+            for (int i = 0; i < n; ++i) m->in[i] = db->runs[first + n - 1 - i];
+        }
+    }
+    pthread_cond_broadcast(&db->cv);
+    pthread_mutex_unlock(&db->mu);
+}
+
+// Put a finished job's run in place of its inputs
+static void install(lsm *db, Job *j) {
+    Run *out = j->ok ? run_open(db, j->seq) : NULL;
+
+    pthread_mutex_lock(&db->mu);
+    j->busy = 0;
+    j->done = 0;
+    pthread_mutex_unlock(&db->mu);
+
+    if (!out) {
+        // Keep the inputs; the job is scheduled again
+        fprintf(stderr, "lsm: %s failed, will retry\n", j->kind == JOB_FLUSH ? "flush" : "merge");
+        return;
+    }
+    if (j->kind == JOB_FLUSH) {
+        Run **runs = realloc(db->runs, sizeof(*runs) * (size_t)(db->n_runs + 1));
+        if (!runs) {
+            run_close(out, 1, db);
+            return;
+        }
+        db->runs = runs;
+        db->runs[db->n_runs++] = out;
+        char path[PATH_MAX];
+        path_of(db, path, "wal", db->imm->wal_seq);
+        Mem *imm = db->imm;
+        db->imm = NULL;
+        if (write_manifest(db) < 0) {
+            // The manifest on disk still names the log: keep it and flush again
+            db->imm = imm;
+            run_close(db->runs[--db->n_runs], 1, db);
+            fprintf(stderr, "lsm: cannot write the manifest, will retry the flush\n");
+            return;
+        }
+        unlink(path);
+        mem_free(imm);
+    } else {
+        // Flushes since only appended, so the inputs are where they were
+        Run *old[MERGE_MAX];
+        int n = j->n, first = j->first;
+        memcpy(old, db->runs + first, sizeof(*old) * (size_t)n);
+        db->runs[first] = out;
+        memmove(db->runs + first + 1, db->runs + first + n,
+                sizeof(*db->runs) * (size_t)(db->n_runs - first - n));
+        db->n_runs -= n - 1;
+        if (write_manifest(db) < 0) {
+            // The manifest on disk still names the inputs: put them back
+            memmove(db->runs + first + n, db->runs + first + 1,
+                    sizeof(*db->runs) * (size_t)(db->n_runs - first - 1));
+            memcpy(db->runs + first, old, sizeof(*old) * (size_t)n);
+            db->n_runs += n - 1;
+            run_close(out, 1, db);
+            fprintf(stderr, "lsm: cannot write the manifest, will retry the merge\n");
+            return;
+        }
+        for (int i = 0; i < n; ++i) run_close(old[i], 1, db);
+    }
+}
+
+void lsm_maintain(lsm *db) {
+    if (db->wal) fflush(db->wal);
+    for (int k = 0; k < JOB_KINDS; ++k) {
+        pthread_mutex_lock(&db->mu);
+        int done = db->job[k].done;
+        pthread_mutex_unlock(&db->mu);
+        if (done) install(db, &db->job[k]);
+    }
+    schedule(db);
+}
+
+// Wait for a running job and install it
+static void wait_job(lsm *db, Job *j) {
+    pthread_mutex_lock(&db->mu);
+    while (j->busy && !j->done) pthread_cond_wait(&db->cv, &db->mu);
+    int done = j->done;
+    pthread_mutex_unlock(&db->mu);
+    if (done) install(db, j);
+}
+
+static FILE *wal_open(lsm *db, uint32_t seq) {
+    char path[PATH_MAX];
+    path_of(db, path, "wal", seq);
+    return fopen(path, "wb");
+}
+
+// The memtable is full: freeze it and start a fresh one with its own log.
+// Stalls while the previous frozen memtable is still being written (never for
+// a merge), and gives up after FLUSH_TRIES failed attempts. Nothing changes
+// when the manifest cannot list the new log; the next write tries again
+static int freeze(lsm *db) {
+    for (int tries = 0; db->imm; ++tries) {
+        if (tries == FLUSH_TRIES) return -1;
+        schedule(db);
+        wait_job(db, &db->job[JOB_FLUSH]);
+    }
+    uint32_t seq = db->next_seq++;
+    Mem *m = mem_new(seq);
+    FILE *wal = m ? wal_open(db, seq) : NULL;
+    if (!wal) {
+        mem_free(m);
+        return -1;
+    }
+    db->imm = db->mem;
+    db->mem = m;
+    if (write_manifest(db) < 0) {
+        // A restart would not replay the new log: keep writing to the old one
+        char path[PATH_MAX];
+        db->mem = db->imm;
+        db->imm = NULL;
+        fclose(wal);
+        path_of(db, path, "wal", seq);
+        unlink(path);
+        mem_free(m);
+        return -1;
+    }
+    if (db->wal) fclose(db->wal);
+    db->wal = wal;
+    schedule(db);
+    return 0;
+}
+
+static int apply(lsm *db, const lsm_rec *r) {
+    if (db->mem->n == MEM_ROWS && freeze(db) < 0) return -1;
+    if (fwrite(r, sizeof(*r), 1, db->wal) != 1) return -1;
+    mem_put(db->mem, r);
+    return 0;
+}
+
+int lsm_put(lsm *db, const lsm_rec *rec) {
+    lsm_rec r = *rec;
+    r.dead = 0;
+    return apply(db, &r);
+}
+
+int lsm_del(lsm *db, const char *content, const char *peer) {
+    lsm_rec r;
+    memset(&r, 0, sizeof(r));
+    pad_name(r.content, content);
+    pad_name(r.peer, peer);
+    r.dead = 1;
+    return apply(db, &r);
+}
+
+// The version of key in m, or NULL
+static const lsm_rec *mem_find(const Mem *m, const lsm_rec *key) {
+    uint32_t b = (uint32_t)name_hash(key->content) & (MEM_BUCKETS - 1);
+    for (int i = m->bucket[b]; i >= 0; i = m->next[i]) {
+        if (key_cmp(&m->rec[i], key) == 0) return &m->rec[i];
+    }
+    return NULL;
+}
+
+// The version of key in r, or NULL
+static const lsm_rec *run_find(const Run *r, const lsm_rec *key) {
+    if (!bloom_maybe(r->bloom, r->bloom_bits, key->content)) return NULL;
+    uint64_t lo = run_seek(r, key->content), hi = r->count;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (key_cmp(&r->rec[mid], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < r->count && key_cmp(&r->rec[lo], key) == 0 ? &r->rec[lo] : NULL;
+}
+
+int lsm_get(lsm *db, const char *content, const char *peer, lsm_rec *out) {
+    const lsm_rec *r;
+    lsm_rec key;
+
+    pad_name(key.content, content);
+    pad_name(key.peer, peer);
+    r = mem_find(db->mem, &key);
+    if (!r && db->imm) r = mem_find(db->imm, &key);
+    for (int i = db->n_runs - 1; !r && i >= 0; --i) r = run_find(db->runs[i], &key);
+    if (!r || r->dead) return 0;
+    *out = *r;
+    return 1;
+}
+
+// Rows of 'content' in m in key order, as indexes into m->rec, as a merge
+// source in *s (empty if none). Returns 0 or -1 without memory
+static int mem_match(const Mem *m, const char *content, Src *s) {
+    uint32_t b = (uint32_t)name_hash(content) & (MEM_BUCKETS - 1);
+    uint64_t n = 0;
+    int *o;
+
+    for (int i = m->bucket[b]; i >= 0; i = m->next[i]) {
+        if (memcmp(m->rec[i].content, content, LSM_NAME_LEN) == 0) n++;
+    }
+    *s = (Src){ m->rec, NULL, 0, 0 };
+    if (n == 0) return 0;
+    if ((o = malloc(sizeof(*o) * n)) == NULL) return -1;
+    uint64_t k = 0;
+    for (int i = m->bucket[b]; i >= 0; i = m->next[i]) {
+        if (memcmp(m->rec[i].content, content, LSM_NAME_LEN) == 0) o[k++] = i;
+    }
+    qsort_r(o, (size_t)k, sizeof(*o), order_cmp, m->rec);
+    s->order = o;
+    s->n     = k;
+    return 0;
+}
+
+// The same merge as lsm_each, over the rows of one content in each source
+int lsm_scan(lsm *db, const char *name, lsm_rec *out, int max) {
+    char content[LSM_NAME_LEN];
+    Src *s = calloc((size_t)db->n_runs + 2, sizeof(*s));
+    int ns = 2, n = 0;
+
+    pad_name(content, name);
+    // Without the memtables' rows older versions would show: find nothing
+    if (!s || mem_match(db->mem, content, &s[0]) < 0 ||
+        (db->imm && mem_match(db->imm, content, &s[1]) < 0)) {
+        ns = 0;
+    }
+    for (int i = db->n_runs - 1; ns > 0 && i >= 0; --i) {
+        const Run *r = db->runs[i];
+        if (!bloom_maybe(r->bloom, r->bloom_bits, content)) continue;
+        uint64_t first = run_seek(r, content), last = first;
+        while (last < r->count && memcmp(r->rec[last].content, content, LSM_NAME_LEN) == 0) last++;
+        if (last > first) s[ns++] = (Src){ r->rec + first, NULL, last - first, 0 };
+    }
+    const lsm_rec *r;
+    while (n < max && (r = merge_next(s, ns)) != NULL) {
+        if (!r->dead) out[n++] = *r;
+    }
+    if (s) {
+        free((void *)s[0].order);
+        free((void *)s[1].order);
+    }
+    free(s);
+    return n;
+}
+
+void lsm_each(lsm *db, int (*cb)(void *arg, const lsm_rec *rec), void *arg) {
+    Src *s = calloc((size_t)db->n_runs + 2, sizeof(*s));
+    int *om = mem_order(db->mem);
+    int *oi = db->imm ? mem_order(db->imm) : NULL;
+    int ns = 0;
+
+    if (s && om && (oi || !db->imm)) {
+        s[ns++] = (Src){ db->mem->rec, om, (uint64_t)db->mem->n, 0 };
+        if (db->imm) s[ns++] = (Src){ db->imm->rec, oi, (uint64_t)db->imm->n, 0 };
+        for (int i = db->n_runs - 1; i >= 0; --i) s[ns++] = (Src){ db->runs[i]->rec, NULL, db->runs[i]->count, 0 };
+        const lsm_rec *r;
+        while ((r = merge_next(s, ns)) != NULL) {
+            if (!r->dead && cb(arg, r)) break;
+        }
+    }
+    free(s);
+    free(om);
+    free(oi);
+}
+
+// Replay one log into the store (which logs it again into the current log)
+static void replay(lsm *db, uint32_t seq) {
+    char path[PATH_MAX];
+    lsm_rec r;
+    path_of(db, path, "wal", seq);
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return;
+    while (fread(&r, sizeof(r), 1, fp) == 1) {
+        if (apply(db, &r) < 0) break;
+    }
+    fclose(fp);
+}
+
+lsm *lsm_open(const char *dir) {
+    lsm *db = calloc(1, sizeof(*db));
+    uint32_t wals[8];
+    int n_wal = 0;
+
+    if (!db || strlen(dir) >= sizeof(db->dir)) {
+        free(db);
+        return NULL;
+    }
+    strcpy(db->dir, dir);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        free(db);
+        return NULL;
+    }
+    pthread_mutex_init(&db->mu, NULL);
+    pthread_cond_init(&db->cv, NULL);
+    for (int k = 0; k < JOB_KINDS; ++k) {
+        db->job[k].db   = db;
+        db->job[k].kind = k;
+    }
+
+    char path[PATH_MAX], line[64];
+    snprintf(path, sizeof(path), "%s/MANIFEST", dir);
+    FILE *fp = fopen(path, "r");
+    unsigned v;
+    while (fp && fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "next %u", &v) == 1) {
+            db->next_seq = v;
+        } else if (sscanf(line, "run %u", &v) == 1) {
+            Run *r = run_open(db, v);
+            Run **runs = r ? realloc(db->runs, sizeof(*runs) * (size_t)(db->n_runs + 1)) : NULL;
+            if (!runs) {
+                fprintf(stderr, "lsm: cannot open run %u\n", v);
+                run_close(r, 0, db);
+                fclose(fp);
+                lsm_close(db);
+                return NULL;
+            }
+            db->runs = runs;
+            db->runs[db->n_runs++] = r;
+        } else if (sscanf(line, "wal %u", &v) == 1 && n_wal < 8) {
+            wals[n_wal++] = v;
+        }
+    }
+    if (fp) fclose(fp);
+
+    uint32_t seq = db->next_seq++;
+    db->mem = mem_new(seq);
+    db->wal = db->mem ? wal_open(db, seq) : NULL;
+    while (db->wal && db->threads < JOB_KINDS &&
+           pthread_create(&db->job[db->threads].thread, NULL, lsm_thread, &db->job[db->threads]) == 0) {
+        db->threads++;
+    }
+    if (db->threads < JOB_KINDS) {
+        lsm_close(db);
+        return NULL;
+    }
+
+    // Logs of the last run: their rows are logged again as they are replayed,
+    // so the old logs can go once the manifest names the new one
+    for (int i = 0; i < n_wal; ++i) replay(db, wals[i]);
+    fflush(db->wal);
+    if (write_manifest(db) == 0) {
+        for (int i = 0; i < n_wal; ++i) {
+            path_of(db, path, "wal", wals[i]);
+            unlink(path);
+        }
+    }
+    schedule(db);
+    return db;
+}
+
+void lsm_close(lsm *db) {
+    if (!db) return;
+    // Running jobs are abandoned rather than waited for: a merge can take
+    // minutes, and the manifest lists only installed runs. Finished ones count
+    pthread_mutex_lock(&db->mu);
+    __atomic_store_n(&db->stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&db->cv);
+    pthread_mutex_unlock(&db->mu);
+    for (int k = 0; k < db->threads; ++k) pthread_join(db->job[k].thread, NULL);
+    for (int k = 0; k < db->threads; ++k) {
+        if (db->job[k].done && db->job[k].ok) install(db, &db->job[k]);
+    }
+    if (db->wal) fclose(db->wal);
+    for (int i = 0; i < db->n_runs; ++i) run_close(db->runs[i], 0, db);
+    free(db->runs);
+    mem_free(db->mem);
+    mem_free(db->imm);
+    pthread_mutex_destroy(&db->mu);
+    pthread_cond_destroy(&db->cv);
+    free(db);
+}
+
+uint64_t lsm_disk_rows(const lsm *db) {
+    uint64_t n = 0;
+    for (int i = 0; i < db->n_runs; ++i) n += db->runs[i]->count;
+    return n;
+}
+
+int lsm_runs(const lsm *db) {
+    return db->n_runs;
+}
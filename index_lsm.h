@@ -0,0 +1,61 @@
+// Log-structured storage for index registrations that do not fit in memory
+//
+// Registrations are keyed by (content, peer). Writes go to a write-ahead log
+// and an in-memory memtable; a full memtable is frozen and written out by a
+// background thread as an immutable sorted run. Each run keeps a Bloom filter
+// on the content name and fence keys in memory and is read through mmap, so a
+// lookup that misses a run costs a few hash probes and one that hits it a
+// binary search over mapped pages. A second thread merges runs of similar
+// size, newest first wins, dropping deletions once nothing older can hold the
+// key, so a flush never waits for a merge. All calls are made from one thread;
+// only flushing and merging run beside it.
+#ifndef INDEX_LSM_H
+#define INDEX_LSM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LSM_NAME_LEN  10
+#define LSM_ADDRS     4
+
+// One registration as stored: names zero padded, addresses IPv4
+typedef struct __attribute__((packed)) {
+    char     content[LSM_NAME_LEN];
+    char     peer[LSM_NAME_LEN];
+    uint32_t ip[LSM_ADDRS];           // Network order; ip[0] is the primary one
+    uint16_t port;
+    uint8_t  n_ip;
+    uint8_t  dead;                    // Deletion marker
+    uint32_t use_count;
+} lsm_rec;
+
+typedef struct lsm lsm;
+
+// Open (or create) the store in 'dir' and replay its log. NULL on failure
+lsm *lsm_open(const char *dir);
+void lsm_close(lsm *db);
+
+// Insert or replace rec's (content, peer)
+int  lsm_put(lsm *db, const lsm_rec *rec);
+// Delete (content, peer)
+int  lsm_del(lsm *db, const char *content, const char *peer);
+
+// Newest version of (content, peer) into *out. Returns 1 if it is live, else 0
+int  lsm_get(lsm *db, const char *content, const char *peer, lsm_rec *out);
+
+// Every live registration of 'content', newest version of each peer, at most
+// max of them. Returns how many
+int  lsm_scan(lsm *db, const char *content, lsm_rec *out, int max);
+
+// Call every live registration in key order; stop early if cb returns nonzero
+void lsm_each(lsm *db, int (*cb)(void *arg, const lsm_rec *rec), void *arg);
+
+// Push the log to the kernel and install finished flushes and merges. Call
+// this between batches of requests
+void lsm_maintain(lsm *db);
+
+// Counters for the startup line
+uint64_t lsm_disk_rows(const lsm *db);
+int      lsm_runs(const lsm *db);
+
+#endif
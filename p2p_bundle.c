@@ -0,0 +1,376 @@
+// Content bundles: a shared directory travels as one item over one connection
+//
+// A 'D' request for a directory is answered with 'K' instead of 'C', followed by
+// every file of the tree back to back:
+//   entry: kind (1) | path length (2) | size (8) | relative path | size bytes
+//   kind:  'f' regular file, 'd' directory (so empty ones survive), 0 = end
+// The provider walks the tree once, then keeps the next BUNDLE_AHEAD files
+// open with POSIX_FADV_WILLNEED so the kernel reads them while earlier ones
+// are on the wire, and packs many small files into each socket write. The
+// receiver recreates the tree below its target directory.
+#include "p2p_client.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BUNDLE_AHEAD     16     // Files opened and prefetched ahead of the sender
+#define BUNDLE_PATH_MAX  1024   // Longer paths are skipped
+#define BUNDLE_HDR       11     // kind + path length + size
+
+typedef struct {
+    char     *path;     // Relative to the bundle root
+    uint64_t  size;
+    char      kind;     // 'f' or 'd'
+    int       fd;       // Opened ahead, -1 otherwise
+} BundleEntry;
+
+struct p2p_bundle {
+    int          root;          // Directory fd of the bundle root
+    BundleEntry *e;
+    int          n;
+    int          cap;
+    int          cur;           // Entry being sent
+    int          ahead;         // Entries [cur, ahead) are open
+    uint64_t     left;          // Data bytes of entry cur still to send
+    uint64_t     data_left;     // Data bytes of the whole bundle still to send
+    int          in_data;       // Header of entry cur already sent
+    int          ended;         // End marker sent
+};
+
+static int bundle_add(p2p_bundle *b, const char *path, char kind, uint64_t size) {
+    if (b->n == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 256;
+        BundleEntry *e = realloc(b->e, sizeof(*e) * (size_t)cap);
+        if (!e) {
+            return -1;
+        }
+        b->e   = e;
+        b->cap = cap;
+    }
+    b->e[b->n].path = strdup(path);
+    if (!b->e[b->n].path) {
+        return -1;
+    }
+    b->e[b->n].kind = kind;
+    b->e[b->n].size = size;
+    b->e[b->n].fd   = -1;
+    b->n++;
+    return 0;
+}
+
+// Collect the tree below 'rel' (relative to the root); symlinks and special
+// files are not part of a bundle
+static int bundle_walk(p2p_bundle *b, const char *rel) {
+    struct dirent *d;
+    DIR *dir;
+    int dfd;
+    int rc = 0;
+
+    dfd = rel[0] ? openat(b->root, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)
+                 : dup(b->root);
+    if (dfd < 0) {
+        return -1;
+    }
+    dir = fdopendir(dfd);
+    if (!dir) {
+        close(dfd);
+        return -1;
+    }
+    while (rc == 0 && (d = readdir(dir)) != NULL) {
+        char path[BUNDLE_PATH_MAX];
+        struct stat st;
+        int len;
+
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+            continue;
+        }
+        len = rel[0] ? snprintf(path, sizeof(path), "%s/%s", rel, d->d_name)
+                     : snprintf(path, sizeof(path), "%s", d->d_name);
+        if (len < 0 || (size_t)len >= sizeof(path)) {
+            continue;
+        }
+        if (fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+        if (S_ISREG(st.st_mode)) {
+            rc = bundle_add(b, path, 'f', (uint64_t)st.st_size);
+            b->data_left += (uint64_t)st.st_size;
+        } else if (S_ISDIR(st.st_mode)) {
+            rc = bundle_add(b, path, 'd', 0);
+            if (rc == 0) {
+                rc = bundle_walk(b, path);
+            }
+        }
+    }
+    closedir(dir);
+    return rc;
+}
+
+p2p_bundle *p2p_bundle_open(int dir_fd) {
+    p2p_bundle *b = calloc(1, sizeof(*b));
+
+    if (!b) {
+        return NULL;
+    }
+    b->root = dup(dir_fd);
+    if (b->root < 0 || bundle_walk(b, "") < 0) {
+        p2p_bundle_close(b);
+        return NULL;
+    }
+    return b;
+}
+
+// Keep the next BUNDLE_AHEAD files open and ask the kernel to start reading them
+static void bundle_prefetch(p2p_bundle *b) {
+    if (b->ahead < b->cur) {
+        b->ahead = b->cur;
+    }
+    while (b->ahead < b->n && b->ahead < b->cur + BUNDLE_AHEAD) {
+        BundleEntry *e = &b->e[b->ahead++];
+        if (e->kind != 'f') {
+            continue;
+        }
+        e->fd = openat(b->root, e->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (e->fd >= 0 && e->size > 0) {
+            (void)posix_fadvise(e->fd, 0, (off_t)e->size, POSIX_FADV_WILLNEED);
+        }
+    }
+}
+
+long p2p_bundle_read(p2p_bundle *b, char *buf, size_t cap) {
+    size_t pos = 0;
+
+    while (!b->ended) {
+        BundleEntry *e;
+
+        if (b->cur == b->n) {
+            // End marker: kind 0 with an empty path
+            if (cap - pos < BUNDLE_HDR) break;
+            memset(buf + pos, 0, BUNDLE_HDR);
+            pos += BUNDLE_HDR;
+            b->ended = 1;
+            break;
+        }
+        e = &b->e[b->cur];
+
+        if (!b->in_data) {
+            size_t plen = strlen(e->path);
+            if (cap - pos < BUNDLE_HDR + plen) break;
+            bundle_prefetch(b);
+            buf[pos] = e->kind;
+            buf[pos + 1] = (char)(plen >> 8);
+            buf[pos + 2] = (char)(plen & 0xff);
+            p2p_put_be64((unsigned char *)buf + pos + 3, e->size);
+            memcpy(buf + pos + BUNDLE_HDR, e->path, plen);
+            pos += BUNDLE_HDR + plen;
+            b->left    = e->kind == 'f' ? e->size : 0;
+            b->in_data = 1;
+        }
+
+        while (b->left > 0 && pos < cap) {
+            size_t want = b->left < cap - pos ? (size_t)b->left : cap - pos;
+            ssize_t n = e->fd >= 0 ? read(e->fd, buf + pos, want) : 0;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            if (n == 0) {
+                // Vanished or shrank since the walk: keep the framing, send zeros
+                memset(buf + pos, 0, want);
+                n = (ssize_t)want;
+            }
+            pos          += (size_t)n;
+            b->left      -= (uint64_t)n;
+            b->data_left -= (uint64_t)n;
+        }
+        if (b->left > 0) {
+            break; // Buffer full mid-file
+        }
+
+        if (e->fd >= 0) {
+            close(e->fd);
+            e->fd = -1;
+        }
+        b->in_data = 0;
+        b->cur++;
+    }
+    return (long)pos;
+}
+
+uint64_t p2p_bundle_left(const p2p_bundle *b) {
+    return b->data_left;
+}
+
+void p2p_bundle_close(p2p_bundle *b) {
+    int i;
+
+    if (!b) {
+        return;
+    }
+    for (i = 0; i < b->n; ++i) {
+        if (b->e[i].fd >= 0) close(b->e[i].fd);
+        free(b->e[i].path);
+    }
+    free(b->e);
+    if (b->root >= 0) close(b->root);
+    free(b);
+}
+
+struct p2p_unbundler {
+    int           root;                         // Target directory fd
+    unsigned char hdr[BUNDLE_HDR];
+    size_t        hdr_got;
+    char          path[BUNDLE_PATH_MAX];
+    size_t        path_len;
+    size_t        path_got;
+    int           fd;                           // File being written, -1 if none
+    uint64_t      left;                         // Bytes of that file still to come
+    int           ended;
+    int           failed;
+    uint64_t      files;
+};
+
+p2p_unbundler *p2p_unbundle_open(const char *dir) {
+    p2p_unbundler *u;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return NULL;
+    }
+    u = calloc(1, sizeof(*u));
+    if (!u) {
+        return NULL;
+    }
+    u->fd   = -1;
+    u->root = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (u->root < 0) {
+        free(u);
+        return NULL;
+    }
+    return u;
+}
+
+// Reject anything that could land outside the target: absolute paths, "..",
+// empty components
+static int path_is_safe(const char *p) {
+    const char *c = p;
+
+    if (*p == '\0' || *p == '/') {
+        return 0;
+    }
+    while (*c) {
+        const char *slash = strchr(c, '/');
+        size_t len = slash ? (size_t)(slash - c) : strlen(c);
+        if (len == 0 || (len == 1 && c[0] == '.') || (len == 2 && c[0] == '.' && c[1] == '.')) {
+            return 0;
+        }
+        c += len;
+        if (*c == '/') c++;
+    }
+    return 1;
+}
+
+// A complete entry header and path arrived: create the directory or file
+static int unbundle_entry(p2p_unbundler *u) {
+    char kind = (char)u->hdr[0];
+    uint64_t size = p2p_get_be64(u->hdr + 3);
+
+    u->path[u->path_len] = '\0';
+    if (kind == 0) {
+        u->ended = 1;
+        return 0;
+    }
+    if (!path_is_safe(u->path) || (kind != 'f' && kind != 'd')) {
+        return -1;
+    }
+    if (kind == 'd') {
+        // The sender lists parents before their contents, so one mkdir suffices
+        return mkdirat(u->root, u->path, 0755) < 0 && errno != EEXIST ? -1 : 0;
+    }
+    u->fd = openat(u->root, u->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (u->fd < 0) {
+        return -1;
+    }
+    u->left = size;
+    u->files++;
+    if (size == 0) {
+        close(u->fd);
+        u->fd = -1;
+    }
+    return 0;
+}
+
+int p2p_unbundle_cb(void *arg, const char *data, size_t len) {
+    p2p_unbundler *u = (p2p_unbundler *)arg;
+
+    while (len > 0 && !u->failed) {
+        if (u->ended) {
+            u->failed = 1; // Bytes after the end marker
+            break;
+        }
+        if (u->fd >= 0) {
+            size_t take = u->left < len ? (size_t)u->left : len;
+            ssize_t n = write(u->fd, data, take);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                u->failed = 1;
+                break;
+            }
+            data    += n;
+            len     -= (size_t)n;
+            u->left -= (uint64_t)n;
+            if (u->left == 0) {
+                close(u->fd);
+                u->fd = -1;
+            }
+            continue;
+        }
+        if (u->hdr_got < BUNDLE_HDR) {
+            size_t take = BUNDLE_HDR - u->hdr_got < len ? BUNDLE_HDR - u->hdr_got : len;
+            memcpy(u->hdr + u->hdr_got, data, take);
+            u->hdr_got += take;
+            data += take;
+            len  -= take;
+            if (u->hdr_got < BUNDLE_HDR) break;
+            u->path_len = ((size_t)u->hdr[1] << 8) | u->hdr[2];
+            u->path_got = 0;
+            if (u->path_len >= BUNDLE_PATH_MAX) {
+                u->failed = 1;
+                break;
+            }
+        }
+        if (u->path_got < u->path_len) {
+            size_t take = u->path_len - u->path_got < len ? u->path_len - u->path_got : len;
+            memcpy(u->path + u->path_got, data, take);
+            u->path_got += take;
+            data += take;
+            len  -= take;
+            if (u->path_got < u->path_len) break;
+        }
+        if (unbundle_entry(u) < 0) {
+            u->failed = 1;
+            break;
+        }
+        u->hdr_got = 0;
+    }
+    return u->failed ? -1 : 0;
+}
+
+int p2p_unbundle_close(p2p_unbundler *u, uint64_t *files) {
+    int ok;
+
+    if (!u) {
+        return -1;
+    }
+    ok = u->ended && !u->failed && u->fd < 0;
+    if (files) *files = u->files;
+    if (u->fd >= 0) close(u->fd);
+    close(u->root);
+    free(u);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,1816 @@
+// Embeddable P2P client: index lookups over UDP (or a stream) and non-blocking downloads over TCP
+#define _GNU_SOURCE        // O_DIRECT, sync_file_range()
+#include "p2p_client.h"
+
+#include <arpa/inet.h>     // inet_aton(), htons(), ntohs()
+#include <errno.h>
+#include <fcntl.h>         // fcntl(), O_NONBLOCK
+#include <netinet/tcp.h>   // TCP_NODELAY for index streams
+#include <poll.h>          // poll(), POLLIN, POLLOUT
+#include <pthread.h>       // disk stage of pipelined transfers
+#include <sched.h>         // sched_yield()
+#include <stdatomic.h>     // lock-free ring indices
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>   // wakes an event loop waiting on a reader pipeline
+#include <sys/stat.h>      // file modes for p2p_writer_open()
+#include <sys/un.h>        // Unix-domain index streams
+#include <time.h>          // nanosleep() backoff
+#include <unistd.h>
+
+#define WRITER_ALIGN   4096              // O_DIRECT offset/length/buffer alignment
+#define WRITER_BUFSZ   (1u << 20)        // One aligned 1 MiB write per flush
+#define WRITER_WINDOW  (8ull << 20)      // Write-behind window for BEHIND mode
+
+#define PIPE_SLOTS     16                // Ring depth (power of two)
+#define PIPE_SLOTSZ    (256u << 10)      // Bytes per ring buffer
+#define FETCH_READ     (64u << 10)       // Initial read size, grown from TCP_INFO
+#define FETCH_SAMPLE_US 200000           // TCP_INFO snapshot interval
+
+// Stages of one download connection
+enum fetch_state {
+    FETCH_CONNECTING,   // Non-blocking connect() in progress
+    FETCH_SENDING,      // Writing 'D' + content name
+    FETCH_HEADER,       // Waiting for the 'C' / 'K' / 'E' reply byte
+    FETCH_BODY,         // Streaming content until the provider closes
+    FETCH_FINISHED      // Socket closed, result recorded
+};
+
+struct p2p_fetch {
+    int              fd;                        // TCP socket to provider (-1 once closed)
+    enum fetch_state state;
+    int              result;                    // Final P2P_* code once FETCH_FINISHED
+    char             req[1 + CONTENT_NAME_LEN]; // 'D' + zero-padded content name
+    size_t           req_sent;                  // Request bytes already written
+    char            *buf;                       // Caller buffer (when no callback)
+    size_t           cap;
+    p2p_data_cb      cb;                        // Caller callback (preferred over buf)
+    void            *arg;
+    uint64_t         total;                     // Content bytes delivered
+    int              bundle;                    // Reply was 'K': a bundle stream
+    char            *rbuf;                      // Receive buffer
+    size_t           rsize;                     // Its size, tuned to the path's BDP
+
+    // Telemetry: TCP_INFO snapshots and time spent in the callback
+    p2p_tcp_info     tcp;
+    int              sampled;                   // tcp holds a snapshot
+    uint64_t         body_us;                   // Clock when the body started
+    uint64_t         sample_us;                 // Clock of the last snapshot
+    uint64_t         sample_rx;                 // 'received' at the last snapshot
+    uint64_t         end_us;                    // Clock of the final snapshot
+    uint64_t         cb_us;                     // Time spent delivering data
+
+    // Coalescing (p2p_fetch_join): a leader owns the connection and fans every
+    // chunk out to its followers; a follower has no socket of its own
+    p2p_fetch       *leader;                    // Follower: the fetch it rides on
+    p2p_fetch       *followers;                 // Leader: attached fetches
+    p2p_fetch       *next_follower;
+    p2p_fetch       *next_inflight;             // Registry of joinable leaders
+    int              joinable;                  // Still in the registry
+    char            *replay;                    // Bytes received so far, while joinable
+    uint64_t         received;                  // Bytes read from the connection
+    int              detached;                  // Owner is done with it; runs for followers
+    int              own_result;                // What the owner was told when detaching
+    int              released;                  // Owner called p2p_fetch_free()
+};
+
+static p2p_fetch *inflight_;                    // Joinable leaders (single-threaded use)
+
+// Copy at most 'limit' chars from src to dst, zero-pad remainder
+// Ensures fixed-length fields in PDUs are properly formatted
+void fill_field_padded(char *dst, size_t dsz, const char *src, size_t limit) {
+    size_t n = 0;
+    // Copy characters up to limit or null terminator
+    while (n < limit && src[n] != '\0') {
+        dst[n] = src[n];
+        n++;
+    }
+    // Zero-pad the rest of the destination buffer
+    while (n < dsz) {
+        dst[n] = '\0';
+        n++;
+    }
+}
+
+// 64-bit sizes and offsets travel big endian on the TCP side
+void p2p_put_be64(unsigned char *p, uint64_t v) {
+    int i;
+    for (i = 7; i >= 0; --i) {
+        p[i] = (unsigned char)(v & 0xff);
+        v >>= 8;
+    }
+}
+
+uint64_t p2p_get_be64(const unsigned char *p) {
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < 8; ++i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+const char *p2p_strerror(int code) {
+    switch (code) {
+    case P2P_OK:           return "success";
+    case P2P_AGAIN:        return "in progress";
+    case P2P_DONE:         return "complete";
+    case P2P_ERR_IO:       return "socket error";
+    case P2P_ERR_TIMEOUT:  return "no reply from index";
+    case P2P_ERR_NOTFOUND: return "content not found";
+    case P2P_ERR_PROTO:    return "unexpected reply";
+    case P2P_ERR_FULL:     return "buffer too small";
+    case P2P_ERR_ABORTED:  return "aborted by callback";
+    case P2P_ERR_NOTLOCAL: return "provider not on this host";
+    case P2P_ERR_BUNDLE:   return "content is a bundle";
+    default:               return "unknown error";
+    }
+}
+
+int p2p_index_open(p2p_index *ix, const char *ip, uint16_t port) {
+    memset(&ix->addr, 0, sizeof(ix->addr));
+    ix->addr.sin_family = AF_INET;
+    ix->addr.sin_port   = htons(port);
+    if (inet_aton(ip, &ix->addr.sin_addr) == 0) {
+        ix->fd = -1;
+        errno = EINVAL;
+        return P2P_ERR_IO;
+    }
+
+    ix->token       = 0;
+    ix->no_sessions = 0;
+    ix->hello_after = 0;
+    ix->stream      = 0;
+    ix->rbuf = ix->wbuf = NULL;
+    ix->rlen = ix->wlen = 0;
+    ix->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ix->fd < 0) {
+        return P2P_ERR_IO;
+    }
+    return P2P_OK;
+}
+
+// Common part of the stream connects: buffers and state on a connected fd
+static int index_stream_setup(p2p_index *ix, int fd) {
+    ix->token       = 0;
+    ix->no_sessions = 0;
+    ix->hello_after = 0;
+    ix->stream      = 1;
+    ix->rlen = ix->wlen = 0;
+    ix->rbuf = malloc(P2P_STREAM_BUF);
+    ix->wbuf = malloc(P2P_STREAM_BUF);
+    ix->fd   = fd;
+    if (!ix->rbuf || !ix->wbuf) {
+        p2p_index_close(ix);
+        errno = ENOMEM;
+        return P2P_ERR_IO;
+    }
+    return P2P_OK;
+}
+
+int p2p_index_connect(p2p_index *ix, const char *ip, uint16_t port) {
+    int one = 1;
+    int fd;
+
+    memset(&ix->addr, 0, sizeof(ix->addr));
+    ix->addr.sin_family = AF_INET;
+    ix->addr.sin_port   = htons(port);
+    ix->rbuf = ix->wbuf = NULL;
+    ix->fd = -1;
+    if (inet_aton(ip, &ix->addr.sin_addr) == 0) {
+        errno = EINVAL;
+        return P2P_ERR_IO;
+    }
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return P2P_ERR_IO;
+    }
+    if (connect(fd, (struct sockaddr *)&ix->addr, sizeof(ix->addr)) < 0) {
+        close(fd);
+        return P2P_ERR_IO;
+    }
+    // Requests are batched in wbuf already; don't let Nagle hold the last one
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return index_stream_setup(ix, fd);
+}
+
+int p2p_index_connect_unix(p2p_index *ix, const char *path) {
+    struct sockaddr_un ua;
+    int fd;
+
+    memset(&ix->addr, 0, sizeof(ix->addr));
+    ix->rbuf = ix->wbuf = NULL;
+    ix->fd = -1;
+    if (strlen(path) >= sizeof(ua.sun_path)) {
+        errno = ENAMETOOLONG;
+        return P2P_ERR_IO;
+    }
+    memset(&ua, 0, sizeof(ua));
+    ua.sun_family = AF_UNIX;
+    strcpy(ua.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return P2P_ERR_IO;
+    }
+    if (connect(fd, (struct sockaddr *)&ua, sizeof(ua)) < 0) {
+        close(fd);
+        return P2P_ERR_IO;
+    }
+    return index_stream_setup(ix, fd);
+}
+
+void p2p_index_close(p2p_index *ix) {
+    if (ix->fd >= 0) {
+        close(ix->fd);
+    }
+    ix->fd = -1;
+    if (ix->stream) {
+        free(ix->rbuf);
+        free(ix->wbuf);
+        ix->rbuf = ix->wbuf = NULL;
+    }
+}
+
+// Write out the frames queued on a stream
+static int index_flush(p2p_index *ix) {
+    size_t off = 0;
+
+    while (off < ix->wlen) {
+        ssize_t n = send(ix->fd, ix->wbuf + off, ix->wlen - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return P2P_ERR_IO;
+        }
+        off += (size_t)n;
+    }
+    ix->wlen = 0;
+    return P2P_OK;
+}
+
+// Send one request: a datagram, or on a stream a frame of length (2, big
+// endian) + the same bytes. Stream frames are only queued; the next receive
+// writes everything queued at once, so a run of sends costs one write
+static int index_send(p2p_index *ix, const void *buf, size_t len) {
+    if (!ix->stream) {
+        ssize_t n = sendto(ix->fd, buf, len, 0, (struct sockaddr *)&ix->addr, sizeof(ix->addr));
+        return n == (ssize_t)len ? P2P_OK : P2P_ERR_IO;
+    }
+    if (ix->fd < 0) {
+        return P2P_ERR_IO;
+    }
+    if (ix->wlen + 2 + len > P2P_STREAM_BUF && index_flush(ix) != P2P_OK) {
+        return P2P_ERR_IO;
+    }
+    ix->wbuf[ix->wlen]     = (unsigned char)(len >> 8);
+    ix->wbuf[ix->wlen + 1] = (unsigned char)len;
+    memcpy(ix->wbuf + ix->wlen + 2, buf, len);
+    ix->wlen += 2 + len;
+    return P2P_OK;
+}
+
+// Receive one reply, waiting up to 2 seconds. Returns its length (cut to cap)
+// or an error code
+static int index_recv(p2p_index *ix, void *buf, size_t cap) {
+    struct pollfd pfd;
+    ssize_t n;
+
+    if (ix->stream && (ix->fd < 0 || index_flush(ix) != P2P_OK)) {
+        return P2P_ERR_IO;
+    }
+    for (;;) {
+        if (ix->stream && ix->rlen >= 2) {
+            size_t flen = ((size_t)ix->rbuf[0] << 8) | ix->rbuf[1];
+            if (ix->rlen >= 2 + flen) {
+                memcpy(buf, ix->rbuf + 2, flen < cap ? flen : cap);
+                memmove(ix->rbuf, ix->rbuf + 2 + flen, ix->rlen - 2 - flen);
+                ix->rlen -= 2 + flen;
+                return (int)(flen < cap ? flen : cap);
+            }
+        }
+
+        pfd.fd     = ix->fd;
+        pfd.events = POLLIN;
+        n = poll(&pfd, 1, 2000);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return P2P_ERR_IO;
+        }
+        if (n == 0) {
+            if (ix->stream) {
+                // A late reply would answer the next request: drop the stream
+                close(ix->fd);
+                ix->fd = -1;
+            }
+            return P2P_ERR_TIMEOUT;
+        }
+        if (!ix->stream) {
+            n = recvfrom(ix->fd, buf, cap, 0, NULL, NULL);
+            return n < 0 ? P2P_ERR_IO : (int)n;
+        }
+        n = recv(ix->fd, ix->rbuf + ix->rlen, P2P_STREAM_BUF - ix->rlen, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            close(ix->fd);
+            ix->fd = -1;
+            return P2P_ERR_IO;
+        }
+        ix->rlen += (size_t)n;
+    }
+}
+
+// Send one request and wait for one reply. Returns the reply length or an error code
+static int index_exchange(p2p_index *ix, const void *out, size_t olen, void *in, size_t cap) {
+    int rc = index_send(ix, out, olen);
+
+    if (rc != P2P_OK) {
+        return rc;
+    }
+    return index_recv(ix, in, cap);
+}
+
+// Send a PDU to index server and wait for one reply PDU
+int p2p_index_request(p2p_index *ix, const PDU *out, PDU *in) {
+    int n = index_exchange(ix, out, sizeof(*out), in, sizeof(*in));
+
+    if (n < 0) {
+        return n;
+    }
+    if (n != (int)sizeof(*in)) {
+        return P2P_ERR_PROTO;
+    }
+    return P2P_OK;
+}
+
+int p2p_index_pipeline(p2p_index *ix, const PDU *reqs, int n, PDU *replies) {
+    int i;
+
+    if (!ix->stream) {
+        // Datagrams may be lost or reordered: one exchange at a time
+        for (i = 0; i < n; ++i) {
+            int rc = p2p_index_request(ix, &reqs[i], &replies[i]);
+            if (rc != P2P_OK) {
+                return rc;
+            }
+        }
+        return P2P_OK;
+    }
+    for (i = 0; i < n; ++i) {
+        if (index_send(ix, &reqs[i], sizeof(reqs[i])) != P2P_OK) {
+            return P2P_ERR_IO;
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        int len = index_recv(ix, &replies[i], sizeof(replies[i]));
+        if (len < 0) {
+            return len;
+        }
+        if (len != (int)sizeof(replies[i])) {
+            return P2P_ERR_PROTO;
+        }
+    }
+    return P2P_OK;
+}
+
+int p2p_resolve(p2p_index *ix, const char *peer, const char *content, PDU *provider) {
+    PDU sreq;
+    int rc;
+
+    memset(&sreq, 0, sizeof(sreq));
+    sreq.type = PDU_S;
+    fill_field_padded(sreq.peer,    sizeof(sreq.peer),    peer,    PEER_NAME_LEN);
+    fill_field_padded(sreq.content, sizeof(sreq.content), content, CONTENT_NAME_LEN);
+
+    rc = p2p_index_request(ix, &sreq, provider);
+    if (rc != P2P_OK) {
+        return rc;
+    }
+    if (provider->type == PDU_E) {
+        return P2P_ERR_NOTFOUND;
+    }
+    if (provider->type != PDU_S) {
+        return P2P_ERR_PROTO;
+    }
+    return P2P_OK;
+}
+
+// Send 'req' and collect the rows of a multi-datagram answer: rows of type
+// req->type, ended by one with an empty address. Returns the number of rows
+// kept (at most max), or P2P_ERR_NOTFOUND when the index answered 'E'
+static int index_collect_rows(p2p_index *ix, const PDU *req, PDU *rows, int max) {
+    PDU row;
+    int n;
+    int count = 0;
+
+    n = index_send(ix, req, sizeof(*req));
+    if (n != P2P_OK) {
+        return n;
+    }
+
+    for (;;) {
+        n = index_recv(ix, &row, sizeof(row));
+        if (n < 0) {
+            return n;
+        }
+        if (n != (int)sizeof(row)) {
+            return P2P_ERR_PROTO;
+        }
+        if (row.type == PDU_E && count == 0) {
+            return P2P_ERR_NOTFOUND;
+        }
+        if (row.type != req->type) {
+            return P2P_ERR_PROTO;
+        }
+        if (row.ip[0] == '\0') {
+            return count > 0 ? count : P2P_ERR_PROTO;
+        }
+        if (count < max) {
+            rows[count++] = row;
+        }
+    }
+}
+
+int p2p_resolve_all(p2p_index *ix, const char *peer, const char *content,
+                    PDU *addrs, int max) {
+    PDU w;
+    int rc;
+
+    memset(&w, 0, sizeof(w));
+    w.type = PDU_W;
+    fill_field_padded(w.peer,    sizeof(w.peer),    peer,    PEER_NAME_LEN);
+    fill_field_padded(w.content, sizeof(w.content), content, CONTENT_NAME_LEN);
+
+    // One 'W' row per address, then a 'W' row with an empty address
+    rc = index_collect_rows(ix, &w, addrs, max);
+    if (rc == P2P_ERR_NOTFOUND) {
+        // Not found, or an index that predates 'W': a plain lookup tells which
+        rc = p2p_resolve(ix, peer, content, &addrs[0]);
+        return rc == P2P_OK ? 1 : rc;
+    }
+    return rc;
+}
+
+int p2p_resolve_providers(p2p_index *ix, const char *peer, const char *content,
+                          PDU *providers, int max) {
+    PDU p;
+    int rc;
+
+    memset(&p, 0, sizeof(p));
+    p.type = PDU_P;
+    fill_field_padded(p.peer,    sizeof(p.peer),    peer,    PEER_NAME_LEN);
+    fill_field_padded(p.content, sizeof(p.content), content, CONTENT_NAME_LEN);
+
+    // One 'P' row per provider, least used first, then one with an empty address
+    rc = index_collect_rows(ix, &p, providers, max);
+    if (rc == P2P_ERR_NOTFOUND) {
+        // Not found, or an index without 'P': settle for the one 'S' names
+        rc = p2p_resolve(ix, peer, content, &providers[0]);
+        return rc == P2P_OK ? 1 : rc;
+    }
+    return rc;
+}
+
+#define MULTI_HDR  5    // 'N' + id (2) + count (2)
+#define MULTI_REC  17   // found (1) + peer (10) + IPv4 (4) + port (2)
+#define MULTI_TRIES 3   // Sends of each batch before giving up
+
+// Send batch b of a multi-search
+static int multi_send(p2p_index *ix, const char *const *names, int n, int b) {
+    unsigned char req[MULTI_HDR + P2P_MULTI_MAX * CONTENT_NAME_LEN];
+    int first = b * P2P_MULTI_MAX;
+    int count = n - first < P2P_MULTI_MAX ? n - first : P2P_MULTI_MAX;
+    size_t len = MULTI_HDR + (size_t)count * CONTENT_NAME_LEN;
+    int k;
+
+    req[0] = PDU_N;
+    req[1] = (unsigned char)(b >> 8);
+    req[2] = (unsigned char)b;
+    req[3] = (unsigned char)(count >> 8);
+    req[4] = (unsigned char)count;
+    for (k = 0; k < count; ++k) {
+        fill_field_padded((char *)req + MULTI_HDR + k * CONTENT_NAME_LEN, CONTENT_NAME_LEN,
+                          names[first + k], CONTENT_NAME_LEN);
+    }
+    return index_send(ix, req, len);
+}
+
+// Unpack one multi-search reply into results. Returns how many were found,
+// or -1 if the datagram does not answer a pending batch
+static int multi_unpack(const unsigned char *rep, ssize_t len, const char *const *names,
+                        int n, char *pending, int nb, PDU *results) {
+    int b;
+    int count;
+    int found = 0;
+    int k;
+
+    if (len < MULTI_HDR || rep[0] != PDU_N) {
+        return -1;
+    }
+    b     = (rep[1] << 8) | rep[2];
+    count = (rep[3] << 8) | rep[4];
+    if (b >= nb || !pending[b] ||
+        count != (n - b * P2P_MULTI_MAX < P2P_MULTI_MAX ? n - b * P2P_MULTI_MAX : P2P_MULTI_MAX) ||
+        len != (ssize_t)(MULTI_HDR + count * MULTI_REC)) {
+        return -1; // Stale or foreign datagram
+    }
+    pending[b] = 0;
+    for (k = 0; k < count; ++k) {
+        const unsigned char *rec = rep + MULTI_HDR + k * MULTI_REC;
+        PDU *r = &results[b * P2P_MULTI_MAX + k];
+        struct in_addr a;
+
+        memset(r, 0, sizeof(*r));
+        fill_field_padded(r->content, sizeof(r->content), names[b * P2P_MULTI_MAX + k], CONTENT_NAME_LEN);
+        if (!rec[0]) {
+            r->type = PDU_E;
+            continue;
+        }
+        r->type = PDU_S;
+        memcpy(r->peer, rec + 1, PEER_NAME_LEN);
+        memcpy(&a.s_addr, rec + 11, 4);
+        (void)inet_ntop(AF_INET, &a, r->ip, sizeof(r->ip));
+        memcpy(&r->port_net, rec + 15, 2);
+        found++;
+    }
+    return found;
+}
+
+int p2p_resolve_many(p2p_index *ix, const char *const *names, int n, PDU *results) {
+    unsigned char rep[MULTI_HDR + P2P_MULTI_MAX * MULTI_REC];
+    int nb = (n + P2P_MULTI_MAX - 1) / P2P_MULTI_MAX;
+    int left = nb;
+    int found = 0;
+    int answered = 0;
+    int unknown = 0;
+    int tries;
+    char *pending;
+    int b;
+
+    if (n <= 0) {
+        return 0;
+    }
+    if (nb > 0xffff) {
+        return P2P_ERR_PROTO; // Batch ids are 16 bits
+    }
+    pending = malloc((size_t)nb);
+    if (!pending) {
+        return P2P_ERR_IO;
+    }
+    memset(pending, 1, (size_t)nb);
+
+    for (tries = 0; tries < MULTI_TRIES && left > 0; ++tries) {
+        // (Re)send every unanswered batch back to back, then collect replies
+        for (b = 0; b < nb; ++b) {
+            if (pending[b] && multi_send(ix, names, n, b) != P2P_OK) {
+                free(pending);
+                return P2P_ERR_IO;
+            }
+        }
+        while (left > 0) {
+            int len;
+            int got;
+
+            len = index_recv(ix, rep, sizeof(rep));
+            if (len == P2P_ERR_TIMEOUT && !ix->stream) {
+                break; // Lost datagrams: resend what is missing
+            }
+            if (len < 0) {
+                free(pending);
+                return len;
+            }
+            if (len == (ssize_t)sizeof(PDU) && rep[0] == PDU_E && !answered) {
+                // An index without 'N' answers each batch with one 'E': take
+                // them all, or they would be mistaken for 'S' replies later
+                if (++unknown == nb) {
+                    tries = MULTI_TRIES;
+                    break;
+                }
+                continue;
+            }
+            got = multi_unpack(rep, len, names, n, pending, nb, results);
+            if (got >= 0) {
+                found += got;
+                answered = 1;
+                left--;
+            }
+        }
+        if (!answered) {
+            break; // Silence, not loss: most likely an index without 'N'
+        }
+    }
+    free(pending);
+    if (left == 0) {
+        return found;
+    }
+    if (answered) {
+        return P2P_ERR_TIMEOUT;
+    }
+
+    // Nothing came back in the packed form: one 'S' per name
+    found = 0;
+    for (b = 0; b < n; ++b) {
+        int rc = p2p_resolve(ix, "", names[b], &results[b]);
+        if (rc == P2P_OK) {
+            found++;
+        } else if (rc == P2P_ERR_NOTFOUND) {
+            memset(&results[b], 0, sizeof(results[b]));
+            results[b].type = PDU_E;
+            fill_field_padded(results[b].content, sizeof(results[b].content), names[b], CONTENT_NAME_LEN);
+        } else {
+            return rc;
+        }
+    }
+    return found;
+}
+
+int p2p_index_hello(p2p_index *ix, const char *peer, const char *ip) {
+    PDU h;
+    unsigned char ans[sizeof(PDU)];
+    int n;
+
+    memset(&h, 0, sizeof(h));
+    h.type = PDU_H;
+    fill_field_padded(h.peer, sizeof(h.peer), peer, PEER_NAME_LEN);
+    fill_field_padded(h.ip,   sizeof(h.ip),   ip,   IP_STRLEN - 1);
+
+    ix->token = 0;
+    n = index_exchange(ix, &h, sizeof(h), ans, sizeof(ans));
+    if (n < 0) {
+        return n;
+    }
+    if (ans[0] == PDU_E) {
+        ix->no_sessions = 1; // Old index: unknown type
+        return P2P_ERR_NOTFOUND;
+    }
+    if (n == 1 && ans[0] == PDU_H) {
+        ix->hello_after = time(NULL) + P2P_HELLO_BACKOFF_S; // No session free now
+        return P2P_AGAIN;
+    }
+    if (n != 5 || ans[0] != PDU_H) {
+        return P2P_ERR_PROTO;
+    }
+    ix->token = ((uint32_t)ans[1] << 24) | ((uint32_t)ans[2] << 16) |
+                ((uint32_t)ans[3] << 8)  | ans[4];
+    fill_field_padded(ix->sess_peer, sizeof(ix->sess_peer), peer, PEER_NAME_LEN);
+    fill_field_padded(ix->sess_ip,   sizeof(ix->sess_ip),   ip,   IP_STRLEN - 1);
+    return P2P_OK;
+}
+
+// Send a compact request (type, token, then 'body') if a session for 'peer'
+// is open. Returns P2P_AGAIN when the caller should use the full PDU instead
+static int index_compact(p2p_index *ix, char type, const char *peer,
+                         const unsigned char *body, size_t blen) {
+    unsigned char out[32];
+    unsigned char ans[sizeof(PDU)];
+    char name[PEER_NAME_LEN + 1];
+    int n;
+
+    fill_field_padded(name, sizeof(name), peer, PEER_NAME_LEN);
+    if (ix->token == 0 || strcmp(name, ix->sess_peer) != 0) {
+        return P2P_AGAIN;
+    }
+    out[0] = (unsigned char)type;
+    out[1] = (unsigned char)(ix->token >> 24);
+    out[2] = (unsigned char)(ix->token >> 16);
+    out[3] = (unsigned char)(ix->token >> 8);
+    out[4] = (unsigned char)ix->token;
+    memcpy(out + 5, body, blen);
+
+    n = index_exchange(ix, out, 5 + blen, ans, sizeof(ans));
+    if (n < 0) {
+        return n;
+    }
+    if (n != 1) {
+        return P2P_ERR_PROTO;
+    }
+    if (ans[0] == PDU_H) {
+        ix->token = 0; // Index forgot the session (restart): go the long way
+        return P2P_AGAIN;
+    }
+    if (ans[0] == PDU_A) return P2P_OK;
+    if (ans[0] == PDU_E) return P2P_ERR_NOTFOUND;
+    return P2P_ERR_PROTO;
+}
+
+int p2p_index_register(p2p_index *ix, const char *peer, const char *content,
+                       const char *ip, uint16_t port) {
+    unsigned char body[2 + CONTENT_NAME_LEN];
+    char name[PEER_NAME_LEN + 1];
+    char addr[IP_STRLEN];
+    PDU r;
+    PDU ans;
+    int rc;
+
+    // The session stands for the peer and its primary address: open one, or
+    // a new one when either changed
+    fill_field_padded(name, sizeof(name), peer, PEER_NAME_LEN);
+    fill_field_padded(addr, sizeof(addr), ip,   IP_STRLEN - 1);
+    if (!ix->no_sessions && time(NULL) >= ix->hello_after &&
+        (ix->token == 0 || strcmp(name, ix->sess_peer) != 0 || strcmp(addr, ix->sess_ip) != 0)) {
+        (void)p2p_index_hello(ix, peer, ip);
+    }
+    body[0] = (unsigned char)(port >> 8);
+    body[1] = (unsigned char)port;
+    fill_field_padded((char *)body + 2, CONTENT_NAME_LEN, content, CONTENT_NAME_LEN);
+    if (ix->token && strcmp(addr, ix->sess_ip) == 0) {
+        rc = index_compact(ix, PDU_r, peer, body, sizeof(body));
+        if (rc != P2P_AGAIN) {
+            return rc;
+        }
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.type = PDU_R;
+    fill_field_padded(r.peer,    sizeof(r.peer),    peer,    PEER_NAME_LEN);
+    fill_field_padded(r.content, sizeof(r.content), content, CONTENT_NAME_LEN);
+    fill_field_padded(r.ip,      sizeof(r.ip),      ip,      IP_STRLEN - 1);
+    r.port_net = htons(port);
+
+    rc = p2p_index_request(ix, &r, &ans);
+    if (rc != P2P_OK) {
+        return rc;
+    }
+    if (ans.type == PDU_A) return P2P_OK;
+    if (ans.type == PDU_E) return P2P_ERR_NOTFOUND;
+    return P2P_ERR_PROTO;
+}
+
+int p2p_index_deregister(p2p_index *ix, const char *peer, const char *content) {
+    unsigned char body[CONTENT_NAME_LEN];
+    PDU t;
+    PDU ans;
+    int rc;
+
+    fill_field_padded((char *)body, sizeof(body), content, CONTENT_NAME_LEN);
+    rc = index_compact(ix, PDU_t, peer, body, sizeof(body));
+    if (rc != P2P_AGAIN) {
+        return rc;
+    }
+
+    memset(&t, 0, sizeof(t));
+    t.type = PDU_T;
+    fill_field_padded(t.peer,    sizeof(t.peer),    peer,    PEER_NAME_LEN);
+    fill_field_padded(t.content, sizeof(t.content), content, CONTENT_NAME_LEN);
+
+    rc = p2p_index_request(ix, &t, &ans);
+    if (rc != P2P_OK) {
+        return rc;
+    }
+    if (ans.type == PDU_A) return P2P_OK;
+    if (ans.type == PDU_E) return P2P_ERR_NOTFOUND;
+    return P2P_ERR_PROTO;
+}
+
+int p2p_index_add_address(p2p_index *ix, const char *peer, const char *content,
+                          const char *ip) {
+    unsigned char body[CONTENT_NAME_LEN + 4];
+    struct in_addr a;
+    PDU x;
+    PDU ans;
+    int rc;
+
+    fill_field_padded((char *)body, CONTENT_NAME_LEN, content, CONTENT_NAME_LEN);
+    if (inet_aton(ip, &a)) {
+        memcpy(body + CONTENT_NAME_LEN, &a.s_addr, 4);
+        rc = index_compact(ix, PDU_x, peer, body, sizeof(body));
+        if (rc != P2P_AGAIN) {
+            return rc;
+        }
+    }
+
+    memset(&x, 0, sizeof(x));
+    x.type = PDU_X;
+    fill_field_padded(x.peer,    sizeof(x.peer),    peer,    PEER_NAME_LEN);
+    fill_field_padded(x.content, sizeof(x.content), content, CONTENT_NAME_LEN);
+    fill_field_padded(x.ip,      sizeof(x.ip),      ip,      IP_STRLEN - 1);
+
+    rc = p2p_index_request(ix, &x, &ans);
+    if (rc != P2P_OK) {
+        return rc;
+    }
+    if (ans.type == PDU_A) return P2P_OK;
+    if (ans.type == PDU_E) return P2P_ERR_NOTFOUND;
+    return P2P_ERR_PROTO;
+}
+
+static uint64_t race_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static uint64_t mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+// Begin a non-blocking connect; returns the socket (1 in *done if already
+// connected) or -1 with errno set
+static int race_start(const PDU *addr, int *done) {
+    struct sockaddr_in a;
+    int fd;
+    int flags;
+
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port   = addr->port_net; // Already in network byte order
+    if (inet_aton(addr->ip, &a.sin_addr) == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    *done = connect(fd, (struct sockaddr *)&a, sizeof(a)) == 0;
+    if (!*done && errno != EINPROGRESS) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+int p2p_connect_race(const PDU *addrs, int n, int stagger_ms, int timeout_ms, int *winner) {
+    int fds[P2P_MAX_ADDRS];
+    struct pollfd pfd[P2P_MAX_ADDRS];
+    int map[P2P_MAX_ADDRS];
+    uint64_t deadline = race_now_ms() + (uint64_t)timeout_ms;
+    uint64_t next_start = 0;
+    int started = 0;
+    int won = -1;
+    int last_err = ETIMEDOUT;
+    int i;
+
+    if (n > P2P_MAX_ADDRS) n = P2P_MAX_ADDRS;
+    for (i = 0; i < n; ++i) {
+        fds[i] = -1;
+    }
+
+    while (won < 0) {
+        uint64_t now = race_now_ms();
+        int live = 0;
+        int wait;
+
+        // Next attempt: on schedule, or at once when nothing is left in flight
+        for (i = 0; i < started; ++i) {
+            if (fds[i] >= 0) live++;
+        }
+        if (started < n && (now >= next_start || live == 0)) {
+            int done = 0;
+            fds[started] = race_start(&addrs[started], &done);
+            if (fds[started] < 0) {
+                last_err = errno;
+            } else if (done) {
+                won = started;
+            }
+            started++;
+            next_start = now + (uint64_t)stagger_ms;
+            continue;
+        }
+        if (live == 0 || now >= deadline) {
+            break; // Every address failed, or out of time
+        }
+
+        live = 0;
+        for (i = 0; i < started; ++i) {
+            if (fds[i] < 0) continue;
+            pfd[live].fd      = fds[i];
+            pfd[live].events  = POLLOUT;
+            pfd[live].revents = 0;
+            map[live++] = i;
+        }
+        wait = (int)(deadline - now);
+        if (started < n && next_start - now < (uint64_t)wait) {
+            wait = (int)(next_start - now);
+        }
+        if (poll(pfd, (nfds_t)live, wait) < 0 && errno != EINTR) {
+            last_err = errno;
+            break;
+        }
+
+        for (i = 0; i < live && won < 0; ++i) {
+            int err = 0;
+            socklen_t len = (socklen_t)sizeof(err);
+            if (!pfd[i].revents) continue;
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                won = map[i];
+            } else {
+                last_err = err ? err : errno;
+                close(fds[map[i]]);
+                fds[map[i]] = -1;
+                next_start = 0; // A path failed: don't wait to try the next one
+            }
+        }
+    }
+
+    // Keep the winner, drop the attempts that lost the race
+    for (i = 0; i < started; ++i) {
+        if (i != won && fds[i] >= 0) close(fds[i]);
+    }
+    if (won < 0) {
+        errno = last_err;
+        return -1;
+    }
+    if (winner) *winner = won;
+    return fds[won];
+}
+
+// Take a leader out of the join registry and drop its replay copy
+static void inflight_remove(p2p_fetch *f) {
+    p2p_fetch **pp;
+
+    if (!f->joinable) {
+        return;
+    }
+    for (pp = &inflight_; *pp; pp = &(*pp)->next_inflight) {
+        if (*pp == f) {
+            *pp = f->next_inflight;
+            break;
+        }
+    }
+    f->joinable = 0;
+    free(f->replay);
+    f->replay = NULL;
+}
+
+// Detach a follower from its leader's fan-out list
+static void follower_unlink(p2p_fetch *f) {
+    p2p_fetch **pp;
+
+    if (!f->leader) {
+        return;
+    }
+    for (pp = &f->leader->followers; *pp; pp = &(*pp)->next_follower) {
+        if (*pp == f) {
+            *pp = f->next_follower;
+            break;
+        }
+    }
+    f->leader = NULL;
+}
+
+// Record the final result and release the socket; returns the result
+// A leader's followers finish with the same result
+static void fetch_release(p2p_fetch *f);
+
+static int fetch_finish(p2p_fetch *f, int result) {
+    p2p_fetch *l = f->leader;
+    p2p_fetch *fl;
+
+    if (f->fd >= 0) {
+        if (f->state == FETCH_BODY && p2p_tcp_sample(f->fd, &f->tcp) == 0) {
+            f->sampled = 1; // Final snapshot: what the whole transfer saw
+            f->end_us  = mono_us();
+        }
+        close(f->fd);
+        f->fd = -1;
+    }
+    f->state  = FETCH_FINISHED;
+    f->result = result;
+    free(f->rbuf);
+    f->rbuf = NULL;
+
+    follower_unlink(f);
+    if (l && l->released && !l->followers) {
+        fetch_release(l); // This follower was the last reason to keep it open
+    }
+    inflight_remove(f);
+    while ((fl = f->followers) != NULL) {
+        f->followers = fl->next_follower;
+        fl->leader   = NULL;
+        fl->state    = FETCH_FINISHED;
+        fl->result   = result;
+    }
+    return result;
+}
+
+// Hand one received chunk to one fetch's callback or caller buffer
+static int fetch_deliver_one(p2p_fetch *f, const char *data, size_t len) {
+    if (f->cb) {
+        if (f->cb(f->arg, data, len) != 0) {
+            return P2P_ERR_ABORTED;
+        }
+    } else {
+        if (len > f->cap - f->total) {
+            return P2P_ERR_FULL;
+        }
+        memcpy(f->buf + f->total, data, len);
+    }
+    f->total += len;
+    return P2P_OK;
+}
+
+// Deliver a chunk read from the connection to the owner and every follower.
+// A failing follower just drops out; a failing owner detaches and leaves the
+// connection running while anyone is still attached
+static int fetch_deliver(p2p_fetch *f, const char *data, size_t len) {
+    p2p_fetch **pp;
+    int rc;
+
+    if (!f->detached) {
+        rc = fetch_deliver_one(f, data, len);
+        if (rc != P2P_OK) {
+            if (!f->followers) {
+                return rc;
+            }
+            f->detached   = 1;
+            f->own_result = rc;
+        }
+    }
+
+    // Keep a copy for late joiners until the transfer outgrows the replay limit
+    if (f->joinable) {
+        if (f->received + len > P2P_JOIN_REPLAY) {
+            inflight_remove(f);
+        } else {
+            if (!f->replay && (f->replay = malloc(P2P_JOIN_REPLAY)) == NULL) {
+                inflight_remove(f);
+            } else {
+                memcpy(f->replay + f->received, data, len);
+            }
+        }
+    }
+    f->received += len;
+
+    pp = &f->followers;
+    while (*pp) {
+        p2p_fetch *fl = *pp;
+        rc = fetch_deliver_one(fl, data, len);
+        if (rc != P2P_OK) {
+            *pp = fl->next_follower;
+            fl->leader = NULL;
+            fl->state  = FETCH_FINISHED;
+            fl->result = rc;
+            continue;
+        }
+        pp = &fl->next_follower;
+    }
+
+    if (f->detached && !f->followers) {
+        return f->own_result; // Nobody left to receive: end the connection
+    }
+    return P2P_OK;
+}
+
+static p2p_fetch *fetch_alloc(const char *content, char *buf, size_t cap,
+                              p2p_data_cb cb, void *arg) {
+    p2p_fetch *f = calloc(1, sizeof(*f));
+    if (!f) {
+        return NULL;
+    }
+    f->buf = buf;
+    f->cap = cap;
+    f->cb  = cb;
+    f->arg = arg;
+    f->req[0] = PDU_D;
+    fill_field_padded(f->req + 1, CONTENT_NAME_LEN, content, CONTENT_NAME_LEN);
+    return f;
+}
+
+p2p_fetch *p2p_fetch_start_fd(int fd, const char *content,
+                              char *buf, size_t cap, p2p_data_cb cb, void *arg) {
+    p2p_fetch *f = fetch_alloc(content, buf, cap, cb, arg);
+    if (!f) {
+        return NULL;
+    }
+    f->fd    = fd;
+    f->state = FETCH_SENDING;
+    return f;
+}
+
+p2p_fetch *p2p_fetch_start(const PDU *provider, const char *content,
+                           char *buf, size_t cap, p2p_data_cb cb, void *arg) {
+    struct sockaddr_in a;
+    p2p_fetch *f;
+    int flags;
+
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port   = provider->port_net; // Already in network byte order
+    if (inet_aton(provider->ip, &a.sin_addr) == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    f = fetch_alloc(content, buf, cap, cb, arg);
+    if (!f) {
+        return NULL;
+    }
+
+    f->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (f->fd < 0) {
+        free(f);
+        return NULL;
+    }
+    flags = fcntl(f->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(f->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(f->fd);
+        free(f);
+        return NULL;
+    }
+
+    // Connect completes later; p2p_fetch_step() picks it up once writable
+    if (connect(f->fd, (struct sockaddr *)&a, sizeof(a)) == 0) {
+        f->state = FETCH_SENDING;
+    } else if (errno == EINPROGRESS) {
+        f->state = FETCH_CONNECTING;
+    } else {
+        int saved = errno;
+        close(f->fd);
+        free(f);
+        errno = saved;
+        return NULL;
+    }
+    return f;
+}
+
+p2p_fetch *p2p_fetch_join(const PDU *provider, const char *content,
+                          char *buf, size_t cap, p2p_data_cb cb, void *arg) {
+    char key[CONTENT_NAME_LEN];
+    p2p_fetch *l;
+    p2p_fetch *f;
+    int rc;
+
+    fill_field_padded(key, sizeof(key), content, CONTENT_NAME_LEN);
+    for (l = inflight_; l; l = l->next_inflight) {
+        if (memcmp(l->req + 1, key, CONTENT_NAME_LEN) == 0) {
+            break;
+        }
+    }
+
+    if (!l) {
+        // First requester: an ordinary fetch that others may attach to
+        f = p2p_fetch_start(provider, content, buf, cap, cb, arg);
+        if (f) {
+            f->joinable      = 1;
+            f->next_inflight = inflight_;
+            inflight_        = f;
+        }
+        return f;
+    }
+
+    f = fetch_alloc(content, buf, cap, cb, arg);
+    if (!f) {
+        return NULL;
+    }
+    f->fd    = -1;
+    f->state = l->state;
+
+    // Catch up on what the running transfer already received, then ride along
+    rc = l->received > 0 ? fetch_deliver_one(f, l->replay, (size_t)l->received) : P2P_OK;
+    if (rc != P2P_OK) {
+        f->state  = FETCH_FINISHED;
+        f->result = rc;
+        return f;
+    }
+    f->leader        = l;
+    f->next_follower = l->followers;
+    l->followers     = f;
+    return f;
+}
+
+int p2p_fetch_joined(const p2p_fetch *f) {
+    return f->leader != NULL;
+}
+
+int p2p_fetch_fd(const p2p_fetch *f) {
+    if (f->leader) {
+        return f->leader->fd;
+    }
+    return f->fd;
+}
+
+short p2p_fetch_events(const p2p_fetch *f) {
+    if (f->leader) {
+        f = f->leader;
+    }
+    if (f->state == FETCH_CONNECTING || f->state == FETCH_SENDING) {
+        return POLLOUT;
+    }
+    return POLLIN;
+}
+
+// Snapshot TCP_INFO and grow the socket buffer and read size to the BDP
+static void fetch_sample(p2p_fetch *f, uint64_t now) {
+    uint64_t rate;
+    size_t want;
+
+    if (p2p_tcp_sample(f->fd, &f->tcp) < 0) {
+        return;
+    }
+    f->sampled = 1;
+    f->end_us  = now;
+    rate = (f->received - f->sample_rx) * 1000000u / (now - f->sample_us + 1);
+    f->sample_us = now;
+    f->sample_rx = f->received;
+    want = p2p_tcp_tune(f->fd, &f->tcp, rate, 0);
+    if (want > f->rsize) {
+        char *nb = realloc(f->rbuf, want);
+        if (nb) {
+            f->rbuf  = nb;
+            f->rsize = want;
+        }
+    }
+}
+
+// Drive the connection itself (leader or plain fetch)
+static int fetch_step_conn(p2p_fetch *f) {
+    ssize_t n;
+    int rc;
+
+    if (f->state == FETCH_FINISHED) {
+        return f->result;
+    }
+    if (!f->rbuf) {
+        f->rsize = FETCH_READ;
+        f->rbuf  = malloc(f->rsize);
+        if (!f->rbuf) {
+            return fetch_finish(f, P2P_ERR_IO);
+        }
+    }
+
+    // Stage 1: connection result
+    if (f->state == FETCH_CONNECTING) {
+        int err = 0;
+        socklen_t len = (socklen_t)sizeof(err);
+        if (getsockopt(f->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            return fetch_finish(f, P2P_ERR_IO);
+        }
+        if (err == EINPROGRESS || err == EALREADY) {
+            return P2P_AGAIN;
+        }
+        if (err != 0) {
+            errno = err;
+            return fetch_finish(f, P2P_ERR_IO);
+        }
+        f->state = FETCH_SENDING;
+    }
+
+    // Stage 2: request 'D' + content name
+    while (f->state == FETCH_SENDING) {
+        n = write(f->fd, f->req + f->req_sent, sizeof(f->req) - f->req_sent);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return P2P_AGAIN;
+            return fetch_finish(f, P2P_ERR_IO);
+        }
+        f->req_sent += (size_t)n;
+        if (f->req_sent == sizeof(f->req)) {
+            f->state = FETCH_HEADER;
+        }
+    }
+
+    // Stage 3: reply header, then stage 4: body until the provider closes
+    for (;;) {
+        n = read(f->fd, f->rbuf, f->state == FETCH_HEADER ? 1 : f->rsize);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return P2P_AGAIN;
+            return fetch_finish(f, P2P_ERR_IO);
+        }
+        if (f->state == FETCH_HEADER) {
+            if (n == 0)              return fetch_finish(f, P2P_ERR_PROTO);
+            if (f->rbuf[0] == PDU_E) return fetch_finish(f, P2P_ERR_NOTFOUND);
+            if (f->rbuf[0] != PDU_C && f->rbuf[0] != PDU_K) return fetch_finish(f, P2P_ERR_PROTO);
+            f->bundle  = f->rbuf[0] == PDU_K;
+            f->state   = FETCH_BODY;
+            f->body_us = f->sample_us = mono_us();
+            continue;
+        }
+        if (n == 0) {
+            return fetch_finish(f, P2P_DONE); // Provider closes after the last byte
+        }
+        {
+            uint64_t t0 = mono_us();
+            uint64_t t1;
+            rc = fetch_deliver(f, f->rbuf, (size_t)n);
+            t1 = mono_us();
+            f->cb_us += t1 - t0;
+            if (rc != P2P_OK) {
+                return fetch_finish(f, rc);
+            }
+            if (t1 - f->sample_us >= FETCH_SAMPLE_US) {
+                fetch_sample(f, t1);
+            }
+        }
+    }
+}
+
+// Free a fetch whose owner and followers are all gone
+static void fetch_release(p2p_fetch *f) {
+    if (f->fd >= 0) {
+        close(f->fd);
+    }
+    inflight_remove(f);
+    free(f->rbuf);
+    free(f);
+}
+
+int p2p_fetch_step(p2p_fetch *f) {
+    p2p_fetch *l = f->leader;
+    int rc;
+
+    if (l) {
+        // Follower: progress comes from the leader's connection
+        (void)fetch_step_conn(l);
+        if (l->released && !l->followers && l->state == FETCH_FINISHED) {
+            fetch_release(l);
+        }
+        return f->state == FETCH_FINISHED ? f->result : P2P_AGAIN;
+    }
+    if (f->detached) {
+        return f->own_result;
+    }
+    rc = fetch_step_conn(f);
+    if (f->detached) {
+        return f->own_result; // Owner's sink failed; followers keep the connection
+    }
+    return rc;
+}
+
+int p2p_fetch_run(p2p_fetch *f, int idle_ms) {
+    struct pollfd pfd;
+    int rc;
+
+    for (;;) {
+        rc = p2p_fetch_step(f);
+        if (rc != P2P_AGAIN) {
+            return rc;
+        }
+        pfd.fd      = p2p_fetch_fd(f);
+        pfd.events  = p2p_fetch_events(f);
+        pfd.revents = 0;
+        rc = poll(&pfd, 1, idle_ms);
+        if (rc < 0 && errno != EINTR) {
+            return fetch_finish(f, P2P_ERR_IO);
+        }
+        if (rc == 0) {
+            errno = ETIMEDOUT;
+            return fetch_finish(f, P2P_ERR_IO);
+        }
+    }
+}
+
+uint64_t p2p_fetch_bytes(const p2p_fetch *f) {
+    return f->total;
+}
+
+int p2p_fetch_is_bundle(const p2p_fetch *f) {
+    return (f->leader ? f->leader : f)->bundle;
+}
+
+int p2p_fetch_tcp_info(const p2p_fetch *f, p2p_tcp_info *ti, double *app_share) {
+    if (f->leader) {
+        f = f->leader;
+    }
+    if (!f->sampled) {
+        return -1;
+    }
+    *ti = f->tcp;
+    if (app_share) {
+        *app_share = f->end_us > f->body_us
+                   ? (double)f->cb_us / (double)(f->end_us - f->body_us) : 0.0;
+    }
+    return 0;
+}
+
+void p2p_fetch_free(p2p_fetch *f) {
+    p2p_fetch *l;
+
+    if (!f) {
+        return;
+    }
+    l = f->leader;
+    follower_unlink(f);
+    if (l && l->released && !l->followers) {
+        fetch_release(l); // Last rider of a transfer whose owner already left
+    }
+
+    if (f->followers && f->state != FETCH_FINISHED) {
+        // Others still depend on this connection: keep it running for them
+        f->released = 1;
+        f->detached = 1;
+        return;
+    }
+    while (f->followers) {
+        p2p_fetch *fl = f->followers;
+        f->followers = fl->next_follower;
+        fl->leader   = NULL;
+    }
+    fetch_release(f);
+}
+
+struct p2p_writer {
+    int      fd;
+    int      mode;          // P2P_WRITE_* actually in effect
+    char    *buf;           // WRITER_ALIGN-aligned staging buffer
+    size_t   fill;          // Bytes staged in buf
+    uint64_t written;       // Bytes already handed to the kernel
+    uint64_t synced;        // BEHIND: start of the window not yet dropped
+};
+
+// Hand the whole staging buffer to the kernel at the current file offset
+static int writer_flush(p2p_writer *w, size_t len) {
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < len) {
+        n = write(w->fd, w->buf + off, len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += (size_t)n;
+    }
+    w->written += len;
+    return 0;
+}
+
+// BEHIND: start writeback of the newest window and drop the one before it,
+// so the download never occupies more than two windows of page cache
+static void writer_behind(p2p_writer *w, int final) {
+    while (w->written - w->synced >= WRITER_WINDOW || (final && w->written > w->synced)) {
+        uint64_t len = w->written - w->synced;
+        if (len > WRITER_WINDOW) len = WRITER_WINDOW;
+        (void)sync_file_range(w->fd, (off64_t)w->synced, (off64_t)len,
+                              SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                              SYNC_FILE_RANGE_WAIT_AFTER);
+        (void)posix_fadvise(w->fd, (off_t)w->synced, (off_t)len, POSIX_FADV_DONTNEED);
+        w->synced += len;
+    }
+    if (w->written > w->synced) {
+        // Kick off (without waiting for) writeback of the partial window
+        (void)sync_file_range(w->fd, (off64_t)w->synced,
+                              (off64_t)(w->written - w->synced), SYNC_FILE_RANGE_WRITE);
+    }
+}
+
+p2p_writer *p2p_writer_open(const char *path, int mode) {
+    p2p_writer *w;
+    void *mem;
+
+    w = calloc(1, sizeof(*w));
+    if (!w) {
+        return NULL;
+    }
+    if (posix_memalign(&mem, WRITER_ALIGN, WRITER_BUFSZ) != 0) {
+        free(w);
+        errno = ENOMEM;
+        return NULL;
+    }
+    w->buf  = mem;
+    w->mode = mode;
+
+    w->fd = -1;
+    if (mode == P2P_WRITE_DIRECT) {
+        w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (w->fd < 0 && errno == EINVAL) {
+            w->mode = P2P_WRITE_BEHIND; // e.g. tmpfs: no direct I/O support
+        }
+    }
+    if (w->fd < 0) {
+        w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (w->fd < 0) {
+        int saved = errno;
+        free(w->buf);
+        free(w);
+        errno = saved;
+        return NULL;
+    }
+    return w;
+}
+
+int p2p_writer_write(p2p_writer *w, const char *data, size_t len) {
+    size_t room;
+
+    while (len > 0) {
+        room = WRITER_BUFSZ - w->fill;
+        if (room > len) room = len;
+        memcpy(w->buf + w->fill, data, room);
+        w->fill += room;
+        data    += room;
+        len     -= room;
+
+        if (w->fill == WRITER_BUFSZ) {
+            if (writer_flush(w, w->fill) < 0) {
+                return -1;
+            }
+            w->fill = 0;
+            if (w->mode == P2P_WRITE_BEHIND) {
+                writer_behind(w, 0);
+            }
+        }
+    }
+    return 0;
+}
+
+int p2p_writer_cb(void *arg, const char *data, size_t len) {
+    return p2p_writer_write((p2p_writer *)arg, data, len);
+}
+
+int p2p_writer_mode(const p2p_writer *w) {
+    return w->mode;
+}
+
+int p2p_writer_close(p2p_writer *w) {
+    int rc = 0;
+    uint64_t size;
+
+    if (!w) {
+        return 0;
+    }
+    size = w->written + w->fill;
+
+    if (w->fill > 0) {
+        if (w->mode == P2P_WRITE_DIRECT) {
+            // O_DIRECT needs a whole number of blocks: pad the tail with zeros,
+            // write it, then cut the file back to the real content length
+            size_t padded = (w->fill + WRITER_ALIGN - 1) & ~(size_t)(WRITER_ALIGN - 1);
+            memset(w->buf + w->fill, 0, padded - w->fill);
+            if (writer_flush(w, padded) < 0 || ftruncate(w->fd, (off_t)size) < 0) {
+                rc = -1;
+            }
+        } else if (writer_flush(w, w->fill) < 0) {
+            rc = -1;
+        }
+    }
+    if (rc == 0 && w->mode == P2P_WRITE_BEHIND) {
+        w->written = size;
+        writer_behind(w, 1);
+    }
+
+    if (close(w->fd) < 0) {
+        rc = -1;
+    }
+    free(w->buf);
+    free(w);
+    return rc;
+}
+
+// Bounded SPSC ring: the producer owns slot head % PIPE_SLOTS while
+// head - tail < PIPE_SLOTS, the consumer owns slot tail % PIPE_SLOTS while
+// tail != head. Each index is written by one side only, so no locks are needed.
+struct p2p_pipeline {
+    pthread_t       thread;
+    int             fd;                 // Reader: file being read ahead
+    p2p_data_cb     sink;               // Writer: where full buffers go
+    void           *arg;
+    char           *mem;                // PIPE_SLOTS * PIPE_SLOTSZ bytes
+    size_t          len[PIPE_SLOTS];    // Valid bytes in each published slot
+    _Atomic size_t  head;               // Next slot the producer publishes
+    _Atomic size_t  tail;               // Next slot the consumer releases
+    _Atomic int     closing;            // Writer: producer done / reader: consumer gone
+    _Atomic int     eof;                // Reader: no more slots will be published
+    _Atomic int     failed;             // Sink write or file read failed
+    size_t          fill;               // Writer producer: bytes in the open slot
+    int             held;               // Reader consumer: a slot is still lent out
+    int             efd;                // Reader: signalled on every publish and at EOF
+};
+
+// Wait a little longer each time the ring is full/empty: spin briefly for the
+// common short stall, then sleep (up to 1 ms) so a stalled stage costs no CPU
+static void pipe_backoff(unsigned *spins) {
+    struct timespec ts;
+
+    if (*spins < 64) {
+        (*spins)++;
+        sched_yield();
+        return;
+    }
+    ts.tv_sec  = 0;
+    ts.tv_nsec = *spins < 1024 ? 50000 : 1000000;
+    if (*spins < 1024) (*spins)++;
+    nanosleep(&ts, NULL);
+}
+
+static char *pipe_slot(p2p_pipeline *p, size_t idx) {
+    return p->mem + (idx % PIPE_SLOTS) * PIPE_SLOTSZ;
+}
+
+// Writer consumer: drain published slots into the sink until the producer closes
+static void *pipe_writer_main(void *argp) {
+    p2p_pipeline *p = argp;
+    size_t t = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    unsigned spins = 0;
+
+    for (;;) {
+        int done = atomic_load_explicit(&p->closing, memory_order_acquire);
+        size_t h = atomic_load_explicit(&p->head, memory_order_acquire);
+        if (t == h) {
+            if (done) break;
+            pipe_backoff(&spins);
+            continue;
+        }
+        spins = 0;
+        if (!atomic_load_explicit(&p->failed, memory_order_relaxed) &&
+            p->sink(p->arg, pipe_slot(p, t), p->len[t % PIPE_SLOTS]) != 0) {
+            atomic_store_explicit(&p->failed, 1, memory_order_release);
+        }
+        atomic_store_explicit(&p->tail, ++t, memory_order_release);
+    }
+    return NULL;
+}
+
+// Tell a consumer waiting in select()/poll() that there is something new
+static void pipe_wake(p2p_pipeline *p) {
+    uint64_t one = 1;
+    if (p->efd >= 0) {
+        if (write(p->efd, &one, sizeof(one)) < 0) {
+            // Counter already set: the consumer wakes anyway
+        }
+    }
+}
+
+// Reader producer: read the file ahead into free slots until EOF or cancelled
+static void *pipe_reader_main(void *argp) {
+    p2p_pipeline *p = argp;
+    size_t h = atomic_load_explicit(&p->head, memory_order_relaxed);
+    unsigned spins = 0;
+    ssize_t n;
+
+    for (;;) {
+        if (atomic_load_explicit(&p->closing, memory_order_acquire)) break;
+        if (h - atomic_load_explicit(&p->tail, memory_order_acquire) == PIPE_SLOTS) {
+            pipe_backoff(&spins);
+            continue;
+        }
+        spins = 0;
+        n = read(p->fd, pipe_slot(p, h), PIPE_SLOTSZ);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0) atomic_store_explicit(&p->failed, 1, memory_order_relaxed);
+            break;
+        }
+        p->len[h % PIPE_SLOTS] = (size_t)n;
+        atomic_store_explicit(&p->head, ++h, memory_order_release);
+        pipe_wake(p);
+    }
+    atomic_store_explicit(&p->eof, 1, memory_order_release);
+    pipe_wake(p);
+    return NULL;
+}
+
+static p2p_pipeline *pipe_create(void *(*main_fn)(void *), int fd,
+                                 p2p_data_cb sink, void *arg) {
+    p2p_pipeline *p = calloc(1, sizeof(*p));
+
+    if (!p) {
+        return NULL;
+    }
+    p->mem = malloc((size_t)PIPE_SLOTS * PIPE_SLOTSZ);
+    if (!p->mem) {
+        free(p);
+        return NULL;
+    }
+    p->fd   = fd;
+    p->sink = sink;
+    p->arg  = arg;
+    p->efd  = sink ? -1 : eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!sink && p->efd < 0) {
+        free(p->mem);
+        free(p);
+        return NULL;
+    }
+    atomic_init(&p->head, 0);
+    atomic_init(&p->tail, 0);
+    atomic_init(&p->closing, 0);
+    atomic_init(&p->eof, 0);
+    atomic_init(&p->failed, 0);
+
+    if (pthread_create(&p->thread, NULL, main_fn, p) != 0) {
+        if (p->efd >= 0) close(p->efd);
+        free(p->mem);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+p2p_pipeline *p2p_pipeline_writer(p2p_data_cb sink, void *arg) {
+    return pipe_create(pipe_writer_main, -1, sink, arg);
+}
+
+p2p_pipeline *p2p_pipeline_reader(int fd) {
+    return pipe_create(pipe_reader_main, fd, NULL, NULL);
+}
+
+// Publish the producer's open slot to the writer thread
+static void pipe_publish(p2p_pipeline *p) {
+    size_t h = atomic_load_explicit(&p->head, memory_order_relaxed);
+
+    p->len[h % PIPE_SLOTS] = p->fill;
+    p->fill = 0;
+    atomic_store_explicit(&p->head, h + 1, memory_order_release);
+}
+
+int p2p_pipeline_cb(void *arg, const char *data, size_t len) {
+    p2p_pipeline *p = arg;
+    unsigned spins = 0;
+    size_t h;
+    size_t room;
+
+    while (len > 0) {
+        if (atomic_load_explicit(&p->failed, memory_order_acquire)) {
+            return -1;
+        }
+        h = atomic_load_explicit(&p->head, memory_order_relaxed);
+        if (h - atomic_load_explicit(&p->tail, memory_order_acquire) == PIPE_SLOTS) {
+            pipe_backoff(&spins); // Disk is behind: only now does the network wait
+            continue;
+        }
+        spins = 0;
+
+        // Coalesce small socket reads into one large disk write per slot
+        room = PIPE_SLOTSZ - p->fill;
+        if (room > len) room = len;
+        memcpy(pipe_slot(p, h) + p->fill, data, room);
+        p->fill += room;
+        data    += room;
+        len     -= room;
+        if (p->fill == PIPE_SLOTSZ) {
+            pipe_publish(p);
+        }
+    }
+    return 0;
+}
+
+long p2p_pipeline_try_read(p2p_pipeline *p, const char **data) {
+    size_t t = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    uint64_t cnt;
+
+    // Give the previously returned slot back to the reader thread
+    if (p->held) {
+        atomic_store_explicit(&p->tail, ++t, memory_order_release);
+        p->held = 0;
+    }
+
+    int eof = atomic_load_explicit(&p->eof, memory_order_acquire);
+    if (t == atomic_load_explicit(&p->head, memory_order_acquire)) {
+        if (eof) {
+            return atomic_load_explicit(&p->failed, memory_order_relaxed) ? -1 : 0;
+        }
+        // Reset the wakeup before the caller waits on it; a publish after
+        // the check above signals it again
+        if (read(p->efd, &cnt, sizeof(cnt)) < 0) {
+            // Nothing was signalled
+        }
+        if (t == atomic_load_explicit(&p->head, memory_order_acquire)) {
+            return -P2P_AGAIN;
+        }
+    }
+
+    p->held = 1;
+    *data = pipe_slot(p, t);
+    return (long)p->len[t % PIPE_SLOTS];
+}
+
+long p2p_pipeline_read(p2p_pipeline *p, const char **data) {
+    unsigned spins = 0;
+    long n;
+
+    while ((n = p2p_pipeline_try_read(p, data)) == -P2P_AGAIN) {
+        pipe_backoff(&spins);
+    }
+    return n;
+}
+
+int p2p_pipeline_fd(const p2p_pipeline *p) {
+    return p->efd;
+}
+
+int p2p_pipeline_close(p2p_pipeline *p) {
+    int rc;
+
+    if (!p) {
+        return 0;
+    }
+    if (p->sink && p->fill > 0) {
+        // Writer: the last partial slot still has to reach the sink
+        unsigned spins = 0;
+        size_t h = atomic_load_explicit(&p->head, memory_order_relaxed);
+        while (h - atomic_load_explicit(&p->tail, memory_order_acquire) == PIPE_SLOTS) {
+            pipe_backoff(&spins);
+        }
+        pipe_publish(p);
+    }
+    atomic_store_explicit(&p->closing, 1, memory_order_release);
+    pthread_join(p->thread, NULL);
+
+    rc = atomic_load_explicit(&p->failed, memory_order_acquire) ? -1 : 0;
+    if (p->efd >= 0) close(p->efd);
+    free(p->mem);
+    free(p);
+    return rc;
+}
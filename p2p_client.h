@@ -0,0 +1,451 @@
+// Embeddable P2P client: index lookups over UDP and non-blocking downloads over TCP
+//
+// The interactive peer is built on this library, and any other program can link
+// it to resolve content and fetch it straight into memory without spawning the
+// peer binary or going through a temporary file.
+//
+// A fetch never blocks: start it, add p2p_fetch_fd() to your poll()/select() set
+// with the events from p2p_fetch_events(), and call p2p_fetch_step() whenever the
+// fd is ready. The fetch is finished when p2p_fetch_step() returns P2P_DONE or an
+// error code.
+#ifndef P2P_CLIENT_H
+#define P2P_CLIENT_H
+
+#include <netinet/in.h>    // struct sockaddr_in
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>          // time_t
+
+// Protocol constants - must match the index server
+#define PEER_NAME_LEN    10   // Maximum length for peer identifier
+#define CONTENT_NAME_LEN 10   // Maximum length for content/file name
+#define IP_STRLEN        16   // IPv4 address string length (xxx.xxx.xxx.xxx\0)
+
+// PDU types (must match the index server)
+#define PDU_R  'R'  // Register content with index
+#define PDU_S  'S'  // Search for content at index
+#define PDU_T  'T'  // Deregister (terminate) content
+#define PDU_O  'O'  // Request online content list
+#define PDU_A  'A'  // Acknowledgment (success)
+#define PDU_E  'E'  // Error response
+#define PDU_D  'D'  // Download request (TCP)
+#define PDU_C  'C'  // Content delivery header (TCP)
+#define PDU_B  'B'  // Background download request: data follows over UDP (TCP)
+#define PDU_G  'G'  // Byte-range download request (TCP)
+#define PDU_M  'M'  // Sparse-aware download request: data extents only (TCP)
+#define PDU_X  'X'  // Add another address to an existing registration
+#define PDU_W  'W'  // Search returning every address of the chosen provider
+#define PDU_K  'K'  // Bundle delivery header: a directory tree follows (TCP)
+#define PDU_P  'P'  // Search returning every provider of the content, one row each
+#define PDU_N  'N'  // Multi-search: many names in one datagram, packed results
+#define PDU_H  'H'  // Session handshake; the reply carries a token
+#define PDU_r  'r'  // Compact register: token, port, content
+#define PDU_t  't'  // Compact deregister: token, content
+#define PDU_x  'x'  // Compact add-address: token, content, IPv4
+
+#define P2P_MAX_ADDRS    4    // Addresses one registration can advertise
+#define P2P_MULTI_MAX    64   // Names per 'N' datagram
+#define P2P_RANGE_SOURCES 16  // Providers one range fetch draws on
+#define P2P_STREAM_BUF   65536 // Per-direction buffer of an index stream
+#define P2P_HELLO_BACKOFF_S 5  // Wait after the index had no session free
+
+// Fixed-size protocol data unit exchanged with index via UDP
+typedef struct __attribute__((packed)) {
+    char     type;                      // PDU type character
+    char     peer[PEER_NAME_LEN];      // Peer identifier (sender/target)
+    char     content[CONTENT_NAME_LEN]; // Content name being registered/searched
+    char     ip[IP_STRLEN];            // IP address for TCP connections
+    uint16_t port_net;                 // TCP port in network byte order
+} PDU;
+
+// Result codes shared by all library calls (errors are negative)
+#define P2P_OK              0   // Request succeeded
+#define P2P_AGAIN           1   // Fetch still running; poll the fd and step again
+#define P2P_DONE            2   // Fetch completed, all content delivered
+#define P2P_ERR_IO         -1   // Socket error (errno holds the cause)
+#define P2P_ERR_TIMEOUT    -2   // Index did not answer in time
+#define P2P_ERR_NOTFOUND   -3   // Index or provider does not have the content
+#define P2P_ERR_PROTO      -4   // Unexpected reply on the wire
+#define P2P_ERR_FULL       -5   // Caller's buffer too small for the content
+#define P2P_ERR_ABORTED    -6   // Data callback asked to stop
+#define P2P_ERR_NOTLOCAL   -7   // Provider is not on this host; use the network
+#define P2P_ERR_BUNDLE     -8   // Content is a bundle; only a 'D' fetch can carry it
+
+// Channel to one index server: a UDP socket, or a TCP / Unix-domain stream
+typedef struct {
+    int                fd;     // Socket for all index communication
+    struct sockaddr_in addr;   // Index server address (UDP and TCP)
+    int                stream; // Length-prefixed frames over a connection
+    unsigned char     *rbuf;   // Stream: received bytes not yet taken
+    size_t             rlen;
+    unsigned char     *wbuf;   // Stream: frames queued for one write
+    size_t             wlen;
+    uint32_t           token;                   // Session token, 0 if none
+    char               sess_peer[PEER_NAME_LEN + 1]; // Identity the token stands for
+    char               sess_ip[IP_STRLEN];
+    int                no_sessions;             // Index predates 'H'
+    time_t             hello_after;             // No session was free: next 'H' not before then
+} p2p_index;
+
+// Receives each chunk of content in order; return 0 to continue, -1 to abort
+typedef int (*p2p_data_cb)(void *arg, const char *data, size_t len);
+
+typedef struct p2p_fetch p2p_fetch;
+
+// Copy at most 'limit' chars from src to dst, zero-pad remainder
+void fill_field_padded(char *dst, size_t dsz, const char *src, size_t limit);
+
+// Big-endian 64-bit fields used by the TCP transfer headers
+void     p2p_put_be64(unsigned char *p, uint64_t v);
+uint64_t p2p_get_be64(const unsigned char *p);
+
+// Human-readable text for a P2P_* result code
+const char *p2p_strerror(int code);
+
+// Open a UDP channel to the index at ip:port. Returns P2P_OK or P2P_ERR_IO
+int  p2p_index_open(p2p_index *ix, const char *ip, uint16_t port);
+void p2p_index_close(p2p_index *ix);
+
+// Connect to an index started with -t (TCP) or -u (Unix socket) instead.
+// Every request and reply travels as length (2, big endian) + the bytes a
+// datagram would carry, so all calls below work unchanged, without loss or
+// retransmission. Requests sent back to back go out in one write, and the
+// index answers them in order, also batched
+int  p2p_index_connect(p2p_index *ix, const char *ip, uint16_t port);
+int  p2p_index_connect_unix(p2p_index *ix, const char *path);
+
+// Send one PDU and wait up to 2 seconds for one reply
+int  p2p_index_request(p2p_index *ix, const PDU *out, PDU *in);
+
+// Send reqs[0..n) (single-reply types: R, S, T, X) and store their replies in
+// order. On a stream all requests leave in one write before any reply is
+// awaited; over UDP this is n p2p_index_request calls
+int  p2p_index_pipeline(p2p_index *ix, const PDU *reqs, int n, PDU *replies);
+
+// Ask the index for the least-loaded provider of 'content'; *provider holds the 'S' reply
+int  p2p_resolve(p2p_index *ix, const char *peer, const char *content, PDU *provider);
+
+// Like p2p_resolve, but fills addrs[0..max) with every address the chosen
+// provider advertised. Returns how many (>= 1) or an error code. Falls back to
+// a single-address 'S' lookup against index servers without 'W'
+int  p2p_resolve_all(p2p_index *ix, const char *peer, const char *content,
+                     PDU *addrs, int max);
+
+// Fill providers[0..max) with every provider of 'content' (its first address
+// each), least used first. Returns how many (>= 1) or an error code. Falls back
+// to the single 'S' provider against index servers without 'P'
+int  p2p_resolve_providers(p2p_index *ix, const char *peer, const char *content,
+                           PDU *providers, int max);
+
+// Resolve names[0..n) at once: like p2p_resolve for each, but P2P_MULTI_MAX
+// names travel per 'N' datagram and all datagrams are sent before the replies
+// are collected, so 1,000 names cost one round trip rather than 1,000.
+//   request: 'N' + id (2) + count (2) + count x name (10)
+//   reply:   'N' + id (2) + count (2) + count x (found (1) + peer (10) + IPv4 (4) + port (2))
+// results[i] is an 'S' PDU for names[i], or type 'E' if nobody provides it.
+// Returns how many were found, or an error code. Against an index without 'N'
+// it falls back to one 'S' per name
+int  p2p_resolve_many(p2p_index *ix, const char *const *names, int n, PDU *results);
+
+// Open a session for (peer, ip): the index answers 'H' + token (4) bound to
+// this socket's address. Afterwards register, deregister and add-address for
+// that peer send the token instead of the peer name, IP string and padding:
+//   'r' + token (4) + port (2) + content (10)         17 bytes instead of 39
+//   't' + token (4) + content (10)
+//   'x' + token (4) + content (10) + IPv4 (4)
+// and get a one-byte 'A' / 'E' back. The register call opens the session by
+// itself, so calling this is optional. P2P_ERR_NOTFOUND means the index has no
+// sessions; the calls then keep using the full PDUs. P2P_AGAIN means it had
+// none free, and register waits P2P_HELLO_BACKOFF_S before asking again
+int  p2p_index_hello(p2p_index *ix, const char *peer, const char *ip);
+
+// Register / deregister (peer, content) at the index. P2P_ERR_NOTFOUND means 'E'
+int  p2p_index_register(p2p_index *ix, const char *peer, const char *content,
+                        const char *ip, uint16_t port);
+
+// Advertise one more address (same port) for an existing registration, so
+// multi-homed providers can offer every interface
+int  p2p_index_add_address(p2p_index *ix, const char *peer, const char *content,
+                           const char *ip);
+int  p2p_index_deregister(p2p_index *ix, const char *peer, const char *content);
+
+// Happy-eyeballs connect to one provider's addresses (a p2p_resolve_all result):
+// attempt i+1 starts stagger_ms after attempt i, or at once if i fails, and the
+// first connection to complete wins while the rest are dropped. Returns the
+// connected non-blocking socket and sets *winner to its index, or returns -1
+// with errno set when nothing connects within timeout_ms
+int  p2p_connect_race(const PDU *addrs, int n, int stagger_ms, int timeout_ms, int *winner);
+
+// Start downloading 'content' from the provider in a resolved 'S' reply.
+// Bytes go to 'cb' when given, otherwise into buf[0..cap). Returns NULL on error
+p2p_fetch *p2p_fetch_start(const PDU *provider, const char *content,
+                           char *buf, size_t cap, p2p_data_cb cb, void *arg);
+
+// Same, over a socket that is already connected (e.g. from p2p_connect_race);
+// the fetch takes ownership of fd, which must be non-blocking
+p2p_fetch *p2p_fetch_start_fd(int fd, const char *content,
+                              char *buf, size_t cap, p2p_data_cb cb, void *arg);
+
+// Coalescing: like p2p_fetch_start, but if a p2p_fetch_join() fetch of the same
+// content is already running in this process, attach to it instead of opening
+// another connection. Bytes it already received are delivered before this
+// returns, and every later chunk reaches all attached fetches, each through its
+// own callback or buffer. A transfer accepts joiners for its first
+// P2P_JOIN_REPLAY bytes. Either side may be freed early; the connection lives
+// while anyone still needs it. Drive all joined fetches from one thread.
+// (Content is keyed by name; the protocol carries no separate version.)
+#define P2P_JOIN_REPLAY (4u << 20)
+
+p2p_fetch *p2p_fetch_join(const PDU *provider, const char *content,
+                          char *buf, size_t cap, p2p_data_cb cb, void *arg);
+
+// Nonzero while f rides on another fetch's connection
+int   p2p_fetch_joined(const p2p_fetch *f);
+
+// The fd to poll and the poll() events it is waiting for (POLLIN or POLLOUT)
+int   p2p_fetch_fd(const p2p_fetch *f);
+short p2p_fetch_events(const p2p_fetch *f);
+
+// Make as much progress as possible without blocking
+int   p2p_fetch_step(p2p_fetch *f);
+
+// Drive a fetch to completion, failing if the provider stays idle for idle_ms
+int   p2p_fetch_run(p2p_fetch *f, int idle_ms);
+
+// Content bytes delivered so far
+uint64_t p2p_fetch_bytes(const p2p_fetch *f);
+
+// Nonzero once the provider answered with 'K': the bytes are a bundle stream
+// (see p2p_unbundle_cb) rather than the file itself
+int   p2p_fetch_is_bundle(const p2p_fetch *f);
+
+// Close the connection (if still open) and release the fetch
+void  p2p_fetch_free(p2p_fetch *f);
+
+// Receive-side file writers, usable as a p2p_data_cb via p2p_writer_cb.
+// Bulk downloads written through the page cache evict the hot files this peer is
+// serving, so two cache-friendly policies are offered besides plain buffering:
+//   P2P_WRITE_DIRECT  O_DIRECT with aligned 1 MiB writes; the unaligned tail is
+//                     padded and the file truncated back (falls back to BEHIND
+//                     when the filesystem rejects O_DIRECT)
+//   P2P_WRITE_BEHIND  buffered writes, but each finished 8 MiB window is flushed
+//                     with sync_file_range() and dropped with POSIX_FADV_DONTNEED
+#define P2P_WRITE_BUFFERED 0
+#define P2P_WRITE_DIRECT   1
+#define P2P_WRITE_BEHIND   2
+
+typedef struct p2p_writer p2p_writer;
+
+// Create/truncate 'path'. Returns NULL with errno set on failure
+p2p_writer *p2p_writer_open(const char *path, int mode);
+
+// Append len bytes. Returns 0, or -1 with errno set
+int p2p_writer_write(p2p_writer *w, const char *data, size_t len);
+
+// p2p_data_cb adapter: arg is a p2p_writer *
+int p2p_writer_cb(void *arg, const char *data, size_t len);
+
+// The policy actually in effect (DIRECT may have fallen back to BEHIND)
+int p2p_writer_mode(const p2p_writer *w);
+
+// Write the tail, fix the file length and release the writer. Returns 0 or -1
+int p2p_writer_close(p2p_writer *w);
+
+// Pipelined transfers: a dedicated disk thread connected to the network side by
+// a bounded lock-free single-producer/single-consumer ring of 256 KiB buffers.
+// A slow write()/read() then only fills or drains the ring instead of stalling
+// the socket (and shrinking the TCP window), and vice versa.
+//
+// Download direction: p2p_pipeline_writer() starts a thread that hands full
+// buffers to 'sink'; feed it with p2p_pipeline_cb (a p2p_data_cb whose arg is
+// the pipeline). Upload direction: p2p_pipeline_reader() starts a thread that
+// reads 'fd' ahead; p2p_pipeline_read() returns the next filled buffer.
+typedef struct p2p_pipeline p2p_pipeline;
+
+p2p_pipeline *p2p_pipeline_writer(p2p_data_cb sink, void *arg);
+p2p_pipeline *p2p_pipeline_reader(int fd);
+
+// Producer side of a writer pipeline; blocks only while the ring is full
+int p2p_pipeline_cb(void *arg, const char *data, size_t len);
+
+// Consumer side of a reader pipeline: *data points at the next buffer, valid
+// until the next call. Returns its length, 0 at end of file, -1 on read error
+long p2p_pipeline_read(p2p_pipeline *p, const char **data);
+
+// The same without waiting: -P2P_AGAIN while the disk thread has nothing new.
+// p2p_pipeline_fd() then becomes readable once it has (an event loop only
+// needs to wait on it, not read it)
+long p2p_pipeline_try_read(p2p_pipeline *p, const char **data);
+int  p2p_pipeline_fd(const p2p_pipeline *p);
+
+// Stop and join the disk thread. For writers, everything queued is delivered
+// first. Returns 0, or -1 if the sink/read failed at any point
+int p2p_pipeline_close(p2p_pipeline *p);
+
+// Transfer telemetry (p2p_tcpstat.c): TCP_INFO snapshots of a transfer
+// connection. They are used to size socket buffers and I/O to the measured
+// bandwidth-delay product and to say which side limits a transfer. Fields the
+// running kernel does not report stay 0.
+typedef struct {
+    uint32_t rtt_us;            // Smoothed RTT of our own segments
+    uint32_t rcv_rtt_us;        // Receiver-side RTT estimate
+    uint32_t min_rtt_us;
+    uint32_t cwnd;              // Congestion window, in segments
+    uint32_t mss;
+    uint32_t retrans;           // Segments retransmitted so far
+    uint32_t ooo_packets;       // Segments that arrived out of order (loss upstream)
+    uint64_t delivery_rate;     // Latest delivery rate sample, bytes/s (sender)
+    int      app_limited;       // That sample was limited by the application
+    uint64_t busy_us;           // Sender: time with data in flight
+    uint64_t rwnd_limited_us;   // Sender: time stalled by the peer's receive window
+    uint64_t sndbuf_limited_us; // Sender: time stalled by our send buffer
+    int      sndbuf;            // SO_SNDBUF / SO_RCVBUF now in effect
+    int      rcvbuf;
+} p2p_tcp_info;
+
+// Snapshot the connection. Returns 0, or -1 with errno set
+int p2p_tcp_sample(int fd, p2p_tcp_info *ti);
+
+// Grow SO_SNDBUF (sending) or SO_RCVBUF to twice the bandwidth-delay product
+// for 'rate' bytes/s. Buffers are never shrunk, and never set below what
+// kernel autotuning already reached. Returns the suggested read/write size
+// (a quarter of the BDP, 16 KiB to 1 MiB)
+size_t p2p_tcp_tune(int fd, const p2p_tcp_info *ti, uint64_t rate, int sending);
+
+// Name the likely bottleneck of a transfer: "network", "peer" (the other end),
+// "disk" (our side of the application) or "sndbuf". app_share is the fraction
+// of the transfer time spent in local disk I/O, if known (receiving side)
+const char *p2p_tcp_bottleneck(const p2p_tcp_info *ti, double app_share, int sending);
+
+// Last TCP_INFO snapshot of a fetch connection (taken every 200 ms and before
+// it closes) and the fraction of time spent in the data callback. Returns 0,
+// or -1 if no snapshot was taken (e.g. a follower or a fetch over a socket
+// that was never read)
+int p2p_fetch_tcp_info(const p2p_fetch *f, p2p_tcp_info *ti, double *app_share);
+
+// Background transfers (p2p_ledbat.c): bulk data over UDP with LEDBAT-style
+// delay-based congestion control, selective acks and paced sending. The sender
+// keeps queueing delay near a 100 ms target, so it soaks up spare capacity and
+// backs off as soon as interactive traffic starts building a queue.
+//
+// Setup runs over the provider's normal TCP listener:
+//   downloader -> 'B' + content name (10) + receiver UDP port (2, network order)
+//   provider   -> 'C' + content size (8, big endian)   or   'E'
+// The TCP connection stays open as a control channel: closing it ends the transfer.
+
+// Provider side: send 'size' bytes of 'fd' to the receiver's UDP address 'dst'
+// Blocks until every segment is acknowledged or the receiver gives up on 'ctl'
+int p2p_bulk_send(int ctl, int fd, uint64_t size, const struct sockaddr_in *dst);
+
+// Receiver side: fetch 'content' in background mode, delivering bytes in order
+// Returns P2P_DONE or an error code; *total holds the bytes delivered
+int p2p_bulk_fetch(const PDU *provider, const char *content,
+                   p2p_data_cb cb, void *arg, uint64_t *total);
+
+// Parallel range downloads (p2p_ranges.c): the content is fetched as 1 MiB
+// ranges spread over several TCP connections to the same provider, so a long
+// fat path is not limited by one connection's window and loss recovery.
+//   downloader -> 'G' + content name (10) + offset (8) + length (8)
+//   provider   -> 'C' + size (8) + offset (8) + length (8) + bytes   or   'E'
+// Connections start at one and are added every 500 ms while each addition
+// raises throughput by more than 10%, up to max_streams. Each connection keeps
+// several requests queued; chunk size and queue depth track the measured
+// bandwidth-delay product, and idle connections take over queued ranges of
+// busy ones at the end (the old request is cancelled).
+
+// Receives each range piece with its file offset; pieces arrive out of order
+typedef int (*p2p_range_cb)(void *arg, uint64_t off, const char *data, size_t len);
+
+typedef struct {
+    uint64_t size;      // Content size reported by the provider
+    uint64_t bytes;     // Content bytes delivered
+    int      streams;   // Most connections open at once
+    int      sources;   // Providers that delivered data
+    uint64_t src_bytes[P2P_RANGE_SOURCES]; // Bytes from each provider, in the order given
+    int      depth;     // Most requests queued per connection
+    uint64_t chunk;     // Final request size
+    uint64_t rtt_ms;    // Smallest round trip measured
+    double   seconds;   // Wall time of the whole transfer
+    p2p_tcp_info tcp;   // Last TCP_INFO of the busiest connection
+    double   app_share; // Fraction of the time spent in cb (disk)
+} p2p_range_stats;
+
+// Fetch all of 'content' from the provider in a resolved 'S' reply. Blocks until
+// done; returns P2P_DONE or an error code. stats may be NULL
+int p2p_parallel_fetch(const PDU *provider, const char *content, int max_streams,
+                       p2p_range_cb cb, void *arg, p2p_range_stats *stats);
+
+// Goal for p2p_target_fetch: finish within 'seconds' of the start and/or
+// sustain 'rate' bytes/s. Zero fields are not part of the goal
+typedef struct {
+    double   seconds;
+    uint64_t rate;
+} p2p_target;
+
+// Same engine over several providers (a p2p_resolve_providers result, preferred
+// first). With a goal, connections are added (each to the provider with the
+// fewest) only while the projected finish misses the goal, and released once
+// fewer would still meet it. Without one (goal NULL) it behaves like
+// p2p_parallel_fetch. A provider that fails or answers 'E' is dropped while
+// others remain
+int p2p_target_fetch(const PDU *providers, int n, const char *content, int max_streams,
+                     const p2p_target *goal, p2p_range_cb cb, void *arg,
+                     p2p_range_stats *stats);
+
+// Sparse-aware downloads (p2p_sparse.c): holes are not transferred.
+//   downloader -> 'M' + content name (10)
+//   provider   -> 'C' + size (8), then offset (8) + length (8) + bytes for each
+//                 data extent in order, ending with offset = size, length = 0   or 'E'
+// Receiver side: fetch over the connected socket 'sock' (taken over and closed)
+// into the regular file out_fd, recreating the holes. Returns P2P_DONE or an
+// error; *size is the logical file size, *data the bytes that crossed the network
+int p2p_sparse_fetch(int sock, const char *content, int out_fd,
+                     uint64_t *size, uint64_t *data);
+
+// Same-host shortcut (p2p_local.c): next to each TCP listener a provider keeps
+// an abstract Unix socket named after its port. A downloader on the same
+// machine asks it for the file and receives an open descriptor (SCM_RIGHTS)
+// instead of the bytes, then reflinks or copy_file_range()s it at storage speed.
+
+// Provider side: listen for same-host requests for the content on TCP 'port'
+int p2p_local_listen(uint16_t port);
+
+// Provider side: answer an accepted request with 'C' + file_fd, or 'E' if file_fd < 0
+int p2p_local_reply(int sock, int file_fd);
+
+// Receiver side: copy 'content' into the regular file out_fd. Returns P2P_DONE,
+// P2P_ERR_NOTLOCAL when the provider is elsewhere (fall back to TCP), or an error
+int p2p_local_fetch(const PDU *provider, const char *content, int out_fd, uint64_t *total);
+
+// Content bundles (p2p_bundle.c): a directory registered as one content item.
+// A 'D' request is answered with 'K' and every file of the tree back to back:
+//   kind (1: 'f' file, 'd' directory, 0 end) + path length (2) + size (8)
+//   + relative path + size bytes of data, ending with an all-zero entry
+// so sharing 10,000 small files costs one registration and one connection.
+// 'G', 'M' and 'B' requests for a bundle get a bare 'K' (P2P_ERR_BUNDLE).
+typedef struct p2p_bundle    p2p_bundle;
+typedef struct p2p_unbundler p2p_unbundler;
+
+// Provider side: walk the directory open at dir_fd (not taken over). Symlinks
+// and special files are left out. Returns NULL on error
+p2p_bundle *p2p_bundle_open(int dir_fd);
+
+// Fill buf with the next part of the stream, opening and prefetching files a
+// few entries ahead. Returns the length, 0 once the end entry is out, -1 on error
+long p2p_bundle_read(p2p_bundle *b, char *buf, size_t cap);
+
+// File bytes not yet returned by p2p_bundle_read (headers not counted)
+uint64_t p2p_bundle_left(const p2p_bundle *b);
+void p2p_bundle_close(p2p_bundle *b);
+
+// Receiver side: recreate the tree below 'dir' (created if missing). Feed the
+// bytes after 'K' to p2p_unbundle_cb (arg is the unbundler); it refuses paths
+// that would leave 'dir'
+p2p_unbundler *p2p_unbundle_open(const char *dir);
+int p2p_unbundle_cb(void *arg, const char *data, size_t len);
+
+// Release the unbundler; *files counts the files written. Returns 0 only if the
+// stream was complete
+int p2p_unbundle_close(p2p_unbundler *u, uint64_t *files);
+
+#endif
@@ -0,0 +1,471 @@
+// Background bulk transfers over UDP with LEDBAT-style congestion control
+//
+// Wire format (all integers in network byte order):
+//   data: seq (4) | send timestamp in us (4) | payload length (2) | payload
+//   ack:  cum (4) | sack bitmap (4) | echoed timestamp (4) | one-way delay in us (4)
+// 'cum' is the first segment the receiver is still missing; bit i of the sack
+// bitmap reports segment cum + 1 + i. The one-way delay is measured against the
+// sender's clock, so it carries a constant offset that cancels out once the
+// sender subtracts its observed minimum (the base delay).
+#define _GNU_SOURCE        // ppoll() for sub-millisecond pacing
+#include "p2p_client.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BULK_SEG        1200            // Payload bytes per datagram (fits any path MTU)
+#define BULK_WIN        4096            // Max segments in flight / in the reorder buffer
+#define BULK_HDR        10              // seq + timestamp + length
+#define TARGET_US       100000          // LEDBAT target queueing delay (RFC 6817 maximum)
+#define GAIN            1.0             // cwnd gain per RTT at zero queueing delay
+#define MIN_CWND        (2.0 * BULK_SEG)
+#define ALLOWED_INCREASE 2              // cwnd may exceed flight size by this many segments
+#define BASE_ROTATE_US  60000000ull     // Base delay = min over the last two minutes
+#define MIN_RTO_US      200000ull
+#define IDLE_MS         5000            // Either side gives up after 5 s of silence
+
+// Segment states on the sender side
+#define SEG_FREE   0   // Not sent yet, or cumulatively acked
+#define SEG_FLIGHT 1   // Sent, awaiting ack
+#define SEG_SACKED 2   // Selectively acked
+#define SEG_LOST   3   // Queued for retransmission
+
+typedef struct __attribute__((packed)) {
+    uint32_t cum;
+    uint32_t sack;
+    uint32_t echo_ts;
+    uint32_t delay_us;
+} BulkAck;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static uint32_t seg_count(uint64_t size) {
+    return (uint32_t)((size + BULK_SEG - 1) / BULK_SEG);
+}
+
+static size_t seg_len(uint64_t size, uint32_t seq) {
+    uint64_t off = (uint64_t)seq * BULK_SEG;
+    return size - off < BULK_SEG ? (size_t)(size - off) : BULK_SEG;
+}
+
+// Sender state for one transfer
+typedef struct {
+    int       udp;                  // Connected to the receiver
+    int       fd;                   // File being sent
+    uint64_t  size;
+    uint32_t  nsegs;
+    uint32_t  next;                 // Next never-sent segment
+    uint32_t  cum;                  // Everything below is acknowledged
+    uint32_t  inflight;             // Segments in SEG_FLIGHT
+    uint8_t   st[BULK_WIN];         // SEG_* per seq % BULK_WIN
+    uint64_t  sent_at[BULK_WIN];
+    uint32_t  rtx[BULK_WIN];        // Retransmission queue (ring)
+    uint32_t  rtx_head, rtx_tail;
+    double    cwnd;                 // Congestion window in bytes
+    double    srtt_us;
+    uint32_t  base_cur, base_prev;  // Per-minute delay minima
+    int       have_base;
+    uint64_t  base_rotated_at;
+    uint64_t  last_ack_at;
+    uint64_t  last_loss_at;
+    uint64_t  next_send_at;         // Pacing clock
+} BulkSender;
+
+static void queue_lost(BulkSender *b, uint32_t seq) {
+    uint8_t *st = &b->st[seq % BULK_WIN];
+    if (*st == SEG_FLIGHT) {
+        b->inflight--;
+    }
+    *st = SEG_LOST;
+    // A full queue only holds stale entries; the next timeout rebuilds it
+    if (b->rtx_tail - b->rtx_head < BULK_WIN) {
+        b->rtx[b->rtx_tail++ % BULK_WIN] = seq;
+    }
+}
+
+// Track the base (minimum) one-way delay; rotating per-minute minima lets it
+// follow route changes instead of sticking to a stale low value forever
+static uint32_t update_base_delay(BulkSender *b, uint32_t delay, uint64_t now) {
+    if (!b->have_base) {
+        b->base_cur = b->base_prev = delay;
+        b->have_base = 1;
+        b->base_rotated_at = now;
+    }
+    if (now - b->base_rotated_at >= BASE_ROTATE_US) {
+        b->base_prev = b->base_cur;
+        b->base_cur  = delay;
+        b->base_rotated_at = now;
+    }
+    if ((int32_t)(delay - b->base_cur) < 0) b->base_cur = delay;
+    return (int32_t)(b->base_prev - b->base_cur) < 0 ? b->base_prev : b->base_cur;
+}
+
+static void process_ack(BulkSender *b, const BulkAck *a, uint64_t now) {
+    uint32_t cum   = ntohl(a->cum);
+    uint32_t sack  = ntohl(a->sack);
+    uint32_t delay = ntohl(a->delay_us);
+    uint32_t rtt   = (uint32_t)now - ntohl(a->echo_ts);
+    uint32_t acked = 0;
+    uint32_t highest = 0;
+    uint32_t s;
+    int i;
+    int lost = 0;
+    double qdelay;
+    double off_target;
+    double limit;
+
+    if (cum > b->next) {
+        return; // Acks something never sent: ignore
+    }
+    b->last_ack_at = now;
+    if (cum < b->cum) {
+        return; // Overtaken by a newer ack: its sack bits would mark the wrong segments
+    }
+
+    // Cumulative part
+    for (s = b->cum; s < cum; ++s) {
+        uint8_t *st = &b->st[s % BULK_WIN];
+        if (*st == SEG_FLIGHT) b->inflight--;
+        if (*st != SEG_SACKED) acked += (uint32_t)seg_len(b->size, s);
+        *st = SEG_FREE;
+    }
+    b->cum = cum;
+
+    // Selective part
+    for (i = 0; i < 32; ++i) {
+        if (!(sack & (1u << i))) continue;
+        s = cum + 1 + (uint32_t)i; // Relative to this ack's own cum
+        if (s >= b->next) break;
+        highest = s;
+        if (b->st[s % BULK_WIN] == SEG_FLIGHT || b->st[s % BULK_WIN] == SEG_LOST) {
+            if (b->st[s % BULK_WIN] == SEG_FLIGHT) b->inflight--;
+            b->st[s % BULK_WIN] = SEG_SACKED;
+            acked += (uint32_t)seg_len(b->size, s);
+        }
+    }
+
+    // A segment is lost once three later segments were acked past it
+    if (highest >= b->cum + 3) {
+        for (s = b->cum; s + 3 <= highest; ++s) {
+            if (b->st[s % BULK_WIN] == SEG_FLIGHT &&
+                now - b->sent_at[s % BULK_WIN] > (uint64_t)b->srtt_us) {
+                queue_lost(b, s);
+                lost = 1;
+            }
+        }
+    }
+
+    // RTT from the echoed timestamp (only for sane samples)
+    if (rtt < 10000000u) {
+        b->srtt_us = b->srtt_us <= 0 ? rtt : 0.875 * b->srtt_us + 0.125 * rtt;
+    }
+
+    // LEDBAT: grow/shrink in proportion to distance from the queueing delay target
+    qdelay = (double)(int32_t)(delay - update_base_delay(b, delay, now));
+    if (qdelay < 0) qdelay = 0;
+    off_target = (TARGET_US - qdelay) / TARGET_US;
+    b->cwnd += GAIN * off_target * acked * BULK_SEG / b->cwnd;
+
+    limit = (double)(b->inflight + ALLOWED_INCREASE) * BULK_SEG;
+    if (b->cwnd > limit) b->cwnd = limit;
+
+    // Loss: halve at most once per RTT
+    if (lost && now - b->last_loss_at > (uint64_t)b->srtt_us) {
+        b->cwnd /= 2;
+        b->last_loss_at = now;
+    }
+    if (b->cwnd < MIN_CWND) b->cwnd = MIN_CWND;
+}
+
+// Send one data segment; returns 0, 1 if the socket buffer is full, -1 on error
+static int send_segment(BulkSender *b, uint32_t seq, uint64_t now) {
+    char pkt[BULK_HDR + BULK_SEG];
+    uint32_t v;
+    uint16_t len = (uint16_t)seg_len(b->size, seq);
+    ssize_t n;
+
+    v = htonl(seq);            memcpy(pkt,     &v, 4);
+    v = htonl((uint32_t)now);  memcpy(pkt + 4, &v, 4);
+    len = htons(len);          memcpy(pkt + 8, &len, 2);
+    len = ntohs(len);
+
+    n = pread(b->fd, pkt + BULK_HDR, len, (off_t)seq * BULK_SEG);
+    if (n != (ssize_t)len) {
+        return -1;
+    }
+    if (send(b->udp, pkt, BULK_HDR + len, 0) < 0) {
+        if (errno == ENOBUFS || errno == EAGAIN) return 1; // Try again later
+        return -1;
+    }
+
+    b->st[seq % BULK_WIN]      = SEG_FLIGHT;
+    b->sent_at[seq % BULK_WIN] = now;
+    b->inflight++;
+    return 0;
+}
+
+int p2p_bulk_send(int ctl, int fd, uint64_t size, const struct sockaddr_in *dst) {
+    BulkSender *b;
+    struct pollfd pfd[2];
+    struct timespec ts;
+    BulkAck ack;
+    uint64_t now;
+    uint64_t rto;
+    uint64_t wait;
+    int rc = P2P_ERR_IO;
+
+    b = calloc(1, sizeof(*b));
+    if (!b) {
+        return P2P_ERR_IO;
+    }
+    b->fd    = fd;
+    b->size  = size;
+    b->nsegs = seg_count(size);
+    b->cwnd  = MIN_CWND;
+    b->last_ack_at = b->next_send_at = now_us();
+
+    b->udp = socket(AF_INET, SOCK_DGRAM, 0);
+    if (b->udp < 0 || connect(b->udp, (const struct sockaddr *)dst, sizeof(*dst)) < 0) {
+        goto out;
+    }
+
+    while (b->cum < b->nsegs) {
+        now = now_us();
+        rto = b->srtt_us > 0 ? (uint64_t)(4 * b->srtt_us) : 1000000ull;
+        if (rto < MIN_RTO_US) rto = MIN_RTO_US;
+
+        // Retransmission timeout: everything in flight is presumed lost
+        if ((b->inflight > 0 || b->rtx_head != b->rtx_tail) && now - b->last_ack_at > rto) {
+            uint32_t s;
+            if (now - b->last_ack_at > (uint64_t)IDLE_MS * 1000) {
+                rc = P2P_ERR_IO; // Receiver vanished
+                goto out;
+            }
+            b->rtx_head = b->rtx_tail = 0;
+            for (s = b->cum; s < b->next; ++s) {
+                uint8_t st = b->st[s % BULK_WIN];
+                if (st == SEG_FLIGHT || st == SEG_LOST) queue_lost(b, s);
+            }
+            b->cwnd = MIN_CWND;
+            b->last_ack_at = now - rto / 2; // Back off before the next timeout
+        }
+
+        // Paced sending: retransmissions first, then new data within cwnd and window
+        while (now >= b->next_send_at) {
+            uint32_t seq;
+            int sr;
+            while (b->rtx_head != b->rtx_tail &&
+                   b->st[b->rtx[b->rtx_head % BULK_WIN] % BULK_WIN] != SEG_LOST) {
+                b->rtx_head++;   // Acked meanwhile
+            }
+            if (b->rtx_head != b->rtx_tail) {
+                seq = b->rtx[b->rtx_head % BULK_WIN];
+            } else if ((double)b->inflight * BULK_SEG < b->cwnd &&
+                       b->next < b->nsegs && b->next < b->cum + BULK_WIN) {
+                seq = b->next;
+            } else {
+                break;
+            }
+            sr = send_segment(b, seq, now);
+            if (sr < 0) goto out;
+            if (sr > 0) break;
+            if (seq == b->next) b->next++; else b->rtx_head++;
+
+            // Spread cwnd over one RTT; never bank more than 2 ms of burst credit
+            if (b->next_send_at + 2000 < now) b->next_send_at = now - 2000;
+            b->next_send_at += (uint64_t)((b->srtt_us > 0 ? b->srtt_us : 1000) * BULK_SEG / b->cwnd);
+        }
+
+        // Sleep until the next paced send, an ack, or the control channel closing
+        wait = b->next_send_at > now ? b->next_send_at - now : 0;
+        if (wait == 0 || (double)b->inflight * BULK_SEG >= b->cwnd ||
+            b->next >= b->nsegs || b->next >= b->cum + BULK_WIN) {
+            if (b->rtx_head == b->rtx_tail) wait = rto;
+        }
+        if (wait == 0) wait = 50; // Socket buffer full: let it drain briefly
+        ts.tv_sec  = (time_t)(wait / 1000000);
+        ts.tv_nsec = (long)(wait % 1000000) * 1000;
+        pfd[0].fd = b->udp; pfd[0].events = POLLIN; pfd[0].revents = 0;
+        pfd[1].fd = ctl;    pfd[1].events = POLLIN; pfd[1].revents = 0;
+        if (ppoll(pfd, 2, &ts, NULL) < 0 && errno != EINTR) {
+            goto out;
+        }
+        while (recv(b->udp, &ack, sizeof(ack), MSG_DONTWAIT) == (ssize_t)sizeof(ack)) {
+            process_ack(b, &ack, now_us());
+        }
+        if (pfd[1].revents) {
+            // Receiver closes the control connection once it has everything
+            if (b->cum < b->nsegs) goto out;
+            break;
+        }
+    }
+    rc = P2P_DONE;
+
+out:
+    if (b->udp >= 0) close(b->udp);
+    free(b);
+    return rc;
+}
+
+int p2p_bulk_fetch(const PDU *provider, const char *content,
+                   p2p_data_cb cb, void *arg, uint64_t *total) {
+    struct sockaddr_in a;
+    struct sockaddr_in from;
+    socklen_t flen;
+    struct timeval tv;
+    char req[1 + CONTENT_NAME_LEN + 2];
+    unsigned char hdr[9];
+    char pkt[BULK_HDR + BULK_SEG];
+    char *reorder = NULL;
+    uint8_t *have = NULL;
+    uint64_t size = 0;
+    uint32_t nsegs;
+    uint32_t cum = 0;
+    uint16_t port;
+    int udp = -1;
+    int ctl = -1;
+    int have_from = 0;
+    int rc = P2P_ERR_IO;
+    int i;
+
+    *total = 0;
+
+    // Receiving UDP socket on an ephemeral port
+    memset(&a, 0, sizeof(a));
+    a.sin_family      = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_ANY);
+    udp = socket(AF_INET, SOCK_DGRAM, 0);
+    flen = (socklen_t)sizeof(a);
+    if (udp < 0 || bind(udp, (struct sockaddr *)&a, sizeof(a)) < 0 ||
+        getsockname(udp, (struct sockaddr *)&a, &flen) < 0) {
+        goto out;
+    }
+    port = a.sin_port;
+
+    // Control connection: 'B' + name + UDP port, answered by 'C' + size
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port   = provider->port_net;
+    if (inet_aton(provider->ip, &a.sin_addr) == 0) {
+        errno = EINVAL;
+        goto out;
+    }
+    ctl = socket(AF_INET, SOCK_STREAM, 0);
+    if (ctl < 0 || connect(ctl, (struct sockaddr *)&a, sizeof(a)) < 0) {
+        goto out;
+    }
+    tv.tv_sec  = IDLE_MS / 1000;
+    tv.tv_usec = 0;
+    (void)setsockopt(ctl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    req[0] = PDU_B;
+    fill_field_padded(req + 1, CONTENT_NAME_LEN, content, CONTENT_NAME_LEN);
+    memcpy(req + 1 + CONTENT_NAME_LEN, &port, 2);
+    if (write(ctl, req, sizeof(req)) != (ssize_t)sizeof(req)) {
+        goto out;
+    }
+    if (recv(ctl, hdr, 1, 0) != 1) {
+        rc = P2P_ERR_PROTO;
+        goto out;
+    }
+    if (hdr[0] == PDU_E || hdr[0] == PDU_K) {
+        rc = hdr[0] == PDU_E ? P2P_ERR_NOTFOUND : P2P_ERR_BUNDLE;
+        goto out;
+    }
+    if (hdr[0] != PDU_C || recv(ctl, hdr + 1, 8, MSG_WAITALL) != 8) {
+        rc = P2P_ERR_PROTO;
+        goto out;
+    }
+    size = p2p_get_be64(hdr + 1);
+    nsegs = seg_count(size);
+
+    reorder = malloc((size_t)BULK_WIN * BULK_SEG);
+    have    = calloc(BULK_WIN, 1);
+    if (!reorder || !have) {
+        goto out;
+    }
+
+    while (cum < nsegs) {
+        struct pollfd pfd[2];
+        uint32_t seq;
+        uint32_t ts;
+        uint16_t len;
+        uint32_t sack = 0;
+        BulkAck ack;
+        ssize_t n;
+
+        pfd[0].fd = udp; pfd[0].events = POLLIN; pfd[0].revents = 0;
+        pfd[1].fd = ctl; pfd[1].events = POLLIN; pfd[1].revents = 0;
+        n = poll(pfd, 2, IDLE_MS);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = ETIMEDOUT;
+            goto out;
+        }
+        if (pfd[1].revents) {
+            goto out; // Provider gave up
+        }
+
+        flen = (socklen_t)sizeof(from);
+        n = recvfrom(udp, pkt, sizeof(pkt), 0, (struct sockaddr *)&from, &flen);
+        if (n < BULK_HDR) continue;
+        if (!have_from) {
+            if (connect(udp, (struct sockaddr *)&from, flen) < 0) goto out; // Acks go back here
+            have_from = 1;
+        }
+        memcpy(&seq, pkt, 4);     seq = ntohl(seq);
+        memcpy(&ts,  pkt + 4, 4); ts  = ntohl(ts);
+        memcpy(&len, pkt + 8, 2); len = ntohs(len);
+        if (seq >= nsegs || len != seg_len(size, seq) || n != BULK_HDR + len) continue;
+
+        // Buffer in-window segments, then deliver the in-order prefix
+        if (seq >= cum && seq < cum + BULK_WIN && !have[seq % BULK_WIN]) {
+            memcpy(reorder + (size_t)(seq % BULK_WIN) * BULK_SEG, pkt + BULK_HDR, len);
+            have[seq % BULK_WIN] = 1;
+        }
+        while (cum < nsegs && have[cum % BULK_WIN]) {
+            size_t l = seg_len(size, cum);
+            if (cb(arg, reorder + (size_t)(cum % BULK_WIN) * BULK_SEG, l) != 0) {
+                rc = P2P_ERR_ABORTED;
+                goto out;
+            }
+            *total += l;
+            have[cum % BULK_WIN] = 0;
+            cum++;
+        }
+
+        // Ack every datagram so the sender sees each delay sample
+        for (i = 0; i < 32; ++i) {
+            uint32_t s = cum + 1 + (uint32_t)i;
+            if (s < nsegs && s < cum + BULK_WIN && have[s % BULK_WIN]) sack |= 1u << i;
+        }
+        ack.cum      = htonl(cum);
+        ack.sack     = htonl(sack);
+        ack.echo_ts  = htonl(ts);
+        ack.delay_us = htonl((uint32_t)now_us() - ts);
+        (void)send(udp, &ack, sizeof(ack), 0);
+        if (cum == nsegs) {
+            // Repeat the final ack in case one is lost; closing ctl also ends the sender
+            (void)send(udp, &ack, sizeof(ack), 0);
+            (void)send(udp, &ack, sizeof(ack), 0);
+        }
+    }
+    rc = P2P_DONE;
+
+out:
+    if (ctl >= 0) close(ctl);
+    if (udp >= 0) close(udp);
+    free(reorder);
+    free(have);
+    return rc;
+}
@@ -0,0 +1,238 @@
+// Same-host shortcut: a provider on this machine hands over an open file
+// descriptor through an abstract Unix socket instead of streaming the file
+// through TCP loopback (two user-space copies and the whole TCP stack).
+//   downloader -> 'D' + content name (10)
+//   provider   -> 'C' with the file descriptor attached (SCM_RIGHTS)   or   'E'
+// The socket is named after the provider's TCP port, so a downloader that was
+// handed ip:port by the index finds it without any extra index state. The
+// receiver then clones the file (FICLONE) where the filesystem supports
+// reflinks, and otherwise copies it inside the kernel with copy_file_range().
+#define _GNU_SOURCE        // copy_file_range()
+#include "p2p_client.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <linux/fs.h>      // FICLONE
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define LOCAL_COPY_MAX  (1u << 30)   // Bytes per copy_file_range() call
+
+// Abstract socket name "\0p2p-fd-<tcp port>": no file to clean up on exit
+static socklen_t local_name(struct sockaddr_un *a, uint16_t port) {
+    int n;
+
+    memset(a, 0, sizeof(*a));
+    a->sun_family = AF_UNIX;
+    n = snprintf(a->sun_path + 1, sizeof(a->sun_path) - 1, "p2p-fd-%u", (unsigned)port);
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + (size_t)n);
+}
+
+int p2p_local_listen(uint16_t port) {
+    struct sockaddr_un a;
+    socklen_t alen = local_name(&a, port);
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&a, alen) < 0 || listen(fd, 8) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int p2p_local_reply(int sock, int file_fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    char typ = file_fd >= 0 ? PDU_C : PDU_E;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base   = &typ;
+    iov.iov_len    = 1;
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+    if (file_fd >= 0) {
+        struct cmsghdr *c;
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control    = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type  = SCM_RIGHTS;
+        c->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &file_fd, sizeof(int));
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Is 'ip' one of this host's addresses? Only then can the socket name match
+static int is_local_address(const char *ip) {
+    struct in_addr want;
+    struct ifaddrs *ifs;
+    struct ifaddrs *it;
+    int found = 0;
+
+    if (inet_aton(ip, &want) == 0) {
+        return 0;
+    }
+    if ((ntohl(want.s_addr) >> 24) == 127) {
+        return 1;
+    }
+    if (getifaddrs(&ifs) < 0) {
+        return 0;
+    }
+    for (it = ifs; it && !found; it = it->ifa_next) {
+        if (it->ifa_addr && it->ifa_addr->sa_family == AF_INET &&
+            ((struct sockaddr_in *)it->ifa_addr)->sin_addr.s_addr == want.s_addr) {
+            found = 1;
+        }
+    }
+    freeifaddrs(ifs);
+    return found;
+}
+
+// Receive the one-byte reply and, for 'C', the attached descriptor
+static int local_recv_fd(int sock, int *file_fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *c;
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    char typ;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base       = &typ;
+    iov.iov_len        = 1;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n == 0) {
+        return P2P_ERR_NOTLOCAL; // Nothing to hand over (e.g. a bundle): use TCP
+    }
+    if (n != 1) {
+        return P2P_ERR_PROTO;
+    }
+    if (typ == PDU_E) {
+        return P2P_ERR_NOTFOUND;
+    }
+    c = CMSG_FIRSTHDR(&msg);
+    if (typ != PDU_C || !c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+        return P2P_ERR_PROTO;
+    }
+    memcpy(file_fd, CMSG_DATA(c), sizeof(int));
+    return P2P_OK;
+}
+
+// Copy in_fd into out_fd without moving the data through user space
+static int local_copy(int in_fd, int out_fd, uint64_t size, uint64_t *total) {
+    loff_t in_off = 0;
+    loff_t out_off = 0;
+    ssize_t n;
+
+    // Reflink: the copy shares extents with the original, so it costs nothing
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+        *total = size;
+        return P2P_DONE;
+    }
+
+    while ((uint64_t)in_off < size) {
+        uint64_t left = size - (uint64_t)in_off;
+        n = copy_file_range(in_fd, &in_off, out_fd, &out_off,
+                            left < LOCAL_COPY_MAX ? (size_t)left : LOCAL_COPY_MAX, 0);
+        if (n < 0 && in_off == 0 &&
+            (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            break; // Not supported for this pair of files: sendfile() below
+        }
+        if (n <= 0) {
+            *total = (uint64_t)in_off;
+            return P2P_ERR_IO;
+        }
+    }
+
+    while ((uint64_t)in_off < size) {
+        off_t off = (off_t)in_off;
+        uint64_t left = size - (uint64_t)in_off;
+        n = sendfile(out_fd, in_fd, &off, left < LOCAL_COPY_MAX ? (size_t)left : LOCAL_COPY_MAX);
+        if (n <= 0) {
+            *total = (uint64_t)in_off;
+            return P2P_ERR_IO;
+        }
+        in_off = off;
+    }
+    *total = (uint64_t)in_off;
+    return P2P_DONE;
+}
+
+int p2p_local_fetch(const PDU *provider, const char *content, int out_fd, uint64_t *total) {
+    struct sockaddr_un a;
+    socklen_t alen;
+    struct timeval tv;
+    struct stat st;
+    char req[1 + CONTENT_NAME_LEN];
+    int sock;
+    int file_fd = -1;
+    int rc;
+
+    *total = 0;
+    if (!is_local_address(provider->ip)) {
+        return P2P_ERR_NOTLOCAL;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return P2P_ERR_NOTLOCAL;
+    }
+    alen = local_name(&a, ntohs(provider->port_net));
+    if (connect(sock, (struct sockaddr *)&a, alen) < 0) {
+        close(sock); // Provider predates the shortcut, or lives in another netns
+        return P2P_ERR_NOTLOCAL;
+    }
+
+    // The provider answers from its event loop; don't wait forever on a stuck one
+    tv.tv_sec  = 2;
+    tv.tv_usec = 0;
+    (void)setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    (void)setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    req[0] = PDU_D;
+    fill_field_padded(req + 1, CONTENT_NAME_LEN, content, CONTENT_NAME_LEN);
+    if (send(sock, req, sizeof(req), MSG_NOSIGNAL) != (ssize_t)sizeof(req)) {
+        close(sock);
+        return P2P_ERR_IO;
+    }
+    rc = local_recv_fd(sock, &file_fd);
+    close(sock);
+    if (rc != P2P_OK) {
+        return rc;
+    }
+
+    if (fstat(file_fd, &st) < 0) {
+        rc = P2P_ERR_IO;
+    } else {
+        rc = local_copy(file_fd, out_fd, (uint64_t)st.st_size, total);
+    }
+    close(file_fd);
+    return rc;
+}
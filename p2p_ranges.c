@@ -0,0 +1,675 @@
+// Parallel range downloads: several TCP streams to one or more providers
+//
+// On a long fat path one TCP connection is capped by its window, and every loss
+// halves the whole transfer rate. The content is therefore cut into RANGE_CHUNK
+// pieces requested with 'G' over several connections at once:
+//   downloader -> 'G' + content name (10) + offset (8) + length (8)
+//   provider   -> 'C' + content size (8) + offset (8) + length (8) + bytes   or   'E'
+// A connection stays open for further 'G' requests, and each one keeps several
+// requests queued behind the reply it is receiving so no round trip is lost
+// between chunks. Chunk size and queue depth follow the measured bandwidth-delay
+// product: a chunk takes about CHUNK_TARGET_MS to arrive, and enough of them are
+// outstanding to cover a round trip plus one. The stream count starts at one and
+// grows every probe interval for as long as the extra stream still raises
+// measured throughput. Near the end, an idle connection takes over ranges still
+// queued on a busy one; the old request is cancelled (dropped if not yet sent,
+// its reply discarded otherwise).
+//
+// With a goal (finish time or throughput) the stream count follows the goal
+// instead: a connection is added while the measured rate projects a miss and
+// one is given back once the rest would still make it with TARGET_SLACK to
+// spare. New connections go to the provider with the fewest, so the swarm is
+// drawn in only as far as the goal needs it.
+#include "p2p_client.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RANGE_CHUNK       (1u << 20)   // Bytes per 'G' request until a rate is measured
+#define RANGE_CHUNK_MIN   (256u << 10)
+#define RANGE_CHUNK_MAX   (16u << 20)
+#define CHUNK_TARGET_MS   250          // Adapted chunks take about this long to arrive
+#define ADAPT_MIN_MS      50           // Chunk size and depth change at most this often
+#define RANGE_DEPTH       2            // Requests outstanding per connection, at least
+#define RANGE_MAX_DEPTH   16
+#define RANGE_MAX_STREAMS 16           // Hard cap on parallel connections
+#define RANGE_REQ_LEN     (1 + CONTENT_NAME_LEN + 16)
+#define RANGE_HDR_LEN     25           // 'C' + size + offset + length
+#define RANGE_BUF         65536        // Bytes read per recv() until TCP_INFO says more
+#define PROBE_MS          500          // Throughput sampling interval
+#define PROBE_GAIN        1.10         // An added stream must bring 10% more
+#define IDLE_MS           5000         // A silent connection is given up after 5 s
+#define RANGE_RETRIES     3            // Consecutive connection failures tolerated per source
+#define TARGET_SLACK      1.2          // A goal is met with this much headroom
+
+typedef struct {
+    uint64_t off;
+    uint64_t len;
+    int      cancelled;                     // Taken over by another stream: discard the reply
+} Span;
+
+typedef struct {
+    int           fd;                       // -1 when the slot is unused
+    int           src;                      // Provider it is connected to
+    int           connecting;
+    Span          span[RANGE_MAX_DEPTH];    // Assigned ranges in reply order
+    int           nspan;
+    int           nsent;                    // Ranges whose request is fully written
+    unsigned char req[RANGE_REQ_LEN];       // Request for span[nsent]
+    size_t        req_sent;
+    unsigned char hdr[RANGE_HDR_LEN];       // Reply header for span[0]
+    size_t        hdr_got;
+    uint64_t      got;                      // Body bytes of span[0] received
+    uint64_t      active_ms;                // Last time this connection made progress
+    uint64_t      asked_ms;                 // Request sent on an idle pipe: RTT sample pending
+} RangeStream;
+
+typedef struct {
+    struct sockaddr_in addr[RANGE_MAX_STREAMS]; // Providers, preferred first
+    int           nsrc;
+    int           src_fails[RANGE_MAX_STREAMS]; // Consecutive failures per provider
+    uint64_t      src_bytes[RANGE_MAX_STREAMS];
+    int           src_given[RANGE_MAX_STREAMS]; // Index in the caller's provider list
+    char          name[CONTENT_NAME_LEN];
+    p2p_range_cb  cb;
+    void         *arg;
+    char         *buf;
+    size_t        bufsz;                    // Read size, grown with the BDP
+    uint64_t      size;                     // Content size, valid once size_known
+    int           size_known;
+    uint64_t      next;                     // First byte not yet handed to any stream
+    Span          retry[RANGE_MAX_STREAMS * RANGE_MAX_DEPTH]; // Ranges of failed streams
+    int           nretry;
+    uint64_t      chunk;                    // Bytes per new request
+    int           depth;                    // Requests to keep outstanding per stream
+    uint64_t      rtt_ms;                   // Smallest round trip seen, 0 until measured
+    uint64_t      bytes;                    // Delivered so far
+    int           result;                   // First fatal error, P2P_OK while running
+    int           src_err;                  // Why the last provider was dropped, if it answered
+    p2p_tcp_info  tcp;                      // Merged snapshot of the connections
+    int           sampled;
+    uint64_t      cb_us;                    // Time spent in cb
+} RangeFetch;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+// The provider for a new connection: the one with the fewest open streams, so
+// each added connection brings in another provider before doubling up on one.
+// Providers that keep failing are left out. Returns -1 if none is left
+static int range_pick_source(RangeFetch *r, const RangeStream *streams, int n) {
+    int load[RANGE_MAX_STREAMS] = { 0 };
+    int best = -1;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (streams[i].fd >= 0) load[streams[i].src]++;
+    }
+    for (i = 0; i < r->nsrc; ++i) {
+        if (r->src_fails[i] >= RANGE_RETRIES) continue;
+        if (best < 0 || load[i] < load[best]) best = i;
+    }
+    return best;
+}
+
+static int range_connect(RangeFetch *r, RangeStream *s, int src) {
+    int flags;
+
+    memset(s, 0, sizeof(*s));
+    s->src = src;
+    s->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s->fd < 0) {
+        return -1;
+    }
+    flags = fcntl(s->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(s->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    if (connect(s->fd, (struct sockaddr *)&r->addr[src], sizeof(r->addr[src])) < 0) {
+        if (errno != EINPROGRESS) {
+            close(s->fd);
+            s->fd = -1;
+            return -1;
+        }
+        s->connecting = 1;
+    }
+    s->active_ms = now_ms();
+    return 0;
+}
+
+// Keep the smallest request-to-reply time seen: queueing only ever adds to it.
+// (The handshake is not used: a proxy or middlebox may complete it locally)
+static void range_rtt_sample(RangeFetch *r, uint64_t ms) {
+    if (ms == 0) {
+        ms = 1;
+    }
+    if (r->rtt_ms == 0 || ms < r->rtt_ms) {
+        r->rtt_ms = ms;
+    }
+}
+
+// TCP_INFO of every connection: grow its receive buffer and the read size to
+// the BDP at 'rate' (bytes/s per stream), and keep a merged snapshot with the
+// worst RTT and the losses of all of them
+static void range_sample(RangeFetch *r, RangeStream *streams, int n, uint64_t rate) {
+    p2p_tcp_info ti;
+    p2p_tcp_info m;
+    int any = 0;
+    int i;
+
+    memset(&m, 0, sizeof(m));
+    for (i = 0; i < n; ++i) {
+        size_t io;
+        if (streams[i].fd < 0 || streams[i].connecting) continue;
+        if (p2p_tcp_sample(streams[i].fd, &ti) < 0) continue;
+        io = p2p_tcp_tune(streams[i].fd, &ti, rate, 0);
+        if (io > r->bufsz) {
+            char *nb = realloc(r->buf, io);
+            if (nb) {
+                r->buf   = nb;
+                r->bufsz = io;
+            }
+        }
+        if (!any) {
+            m = ti;
+        } else {
+            if (ti.rtt_us > m.rtt_us)         m.rtt_us = ti.rtt_us;
+            if (ti.rcv_rtt_us > m.rcv_rtt_us) m.rcv_rtt_us = ti.rcv_rtt_us;
+            if (ti.min_rtt_us && (!m.min_rtt_us || ti.min_rtt_us < m.min_rtt_us)) {
+                m.min_rtt_us = ti.min_rtt_us;
+            }
+            m.retrans     += ti.retrans;
+            m.ooo_packets += ti.ooo_packets;
+        }
+        any = 1;
+    }
+    if (any) {
+        r->tcp     = m;
+        r->sampled = 1;
+    }
+}
+
+// Size chunks and queues from the measured rate of one stream (bytes per ms)
+// and the round trip: a chunk lasts about CHUNK_TARGET_MS, and depth * chunk
+// covers the bandwidth-delay product plus the chunk being received
+static void range_adapt(RangeFetch *r, double rate) {
+    double bdp = rate * (double)r->rtt_ms;
+    double chunk = rate * CHUNK_TARGET_MS;
+    int depth;
+
+    if (rate <= 0.0 || r->rtt_ms == 0) {
+        return;
+    }
+    if (chunk < RANGE_CHUNK_MIN) chunk = RANGE_CHUNK_MIN;
+    if (chunk > RANGE_CHUNK_MAX) chunk = RANGE_CHUNK_MAX;
+    r->chunk = (uint64_t)chunk & ~(uint64_t)0xffff;
+
+    depth = (int)(bdp / (double)r->chunk) + 2;
+    if (depth < RANGE_DEPTH)     depth = RANGE_DEPTH;
+    if (depth > RANGE_MAX_DEPTH) depth = RANGE_MAX_DEPTH;
+    r->depth = depth;
+}
+
+// Build the request for span[nsent] into s->req
+static void range_stage_request(RangeFetch *r, RangeStream *s) {
+    s->req[0] = PDU_G;
+    memcpy(s->req + 1, r->name, CONTENT_NAME_LEN);
+    p2p_put_be64(s->req + 1 + CONTENT_NAME_LEN,     s->span[s->nsent].off);
+    p2p_put_be64(s->req + 1 + CONTENT_NAME_LEN + 8, s->span[s->nsent].len);
+    s->req_sent = 0;
+}
+
+// Hand the stream its next range: retried ranges first, then fresh content
+static int range_assign(RangeFetch *r, RangeStream *s) {
+    Span sp;
+
+    if (r->nretry > 0) {
+        sp = r->retry[--r->nretry];
+    } else if (r->next < r->size) {
+        sp.off = r->next;
+        sp.len = r->size - r->next < r->chunk ? r->size - r->next : r->chunk;
+        r->next += sp.len;
+    } else {
+        return 0;
+    }
+    sp.cancelled = 0;
+    s->span[s->nspan++] = sp;
+    if (s->nsent == s->nspan - 1) {
+        range_stage_request(r, s);
+    }
+    return 1;
+}
+
+// Drop a connection and give back whatever it had not received yet
+static void range_fail(RangeFetch *r, RangeStream *s) {
+    int i;
+
+    for (i = 0; i < s->nspan; ++i) {
+        Span sp = s->span[i];
+        if (sp.cancelled) {
+            continue; // Another stream owns it now
+        }
+        if (i == 0) {
+            sp.off += s->got;
+            sp.len -= s->got;
+        }
+        if (sp.len > 0) {
+            r->retry[r->nretry++] = sp;
+        }
+    }
+    close(s->fd);
+    s->fd = -1;
+    r->src_fails[s->src]++;
+}
+
+// Endgame: nothing is left to assign, but idle stream s could be working.
+// Take the last range still queued behind another reply on the busiest stream.
+// If that request never left, it simply disappears from the victim's queue;
+// otherwise the victim discards the reply when it comes. Returns 1 on success
+static int range_steal(RangeFetch *r, RangeStream *s, RangeStream *streams, int n) {
+    RangeStream *victim = NULL;
+    Span *sp;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        RangeStream *v = &streams[i];
+        if (v == s || v->fd < 0 || v->nspan < 2 || v->span[v->nspan - 1].cancelled) {
+            continue;
+        }
+        if (!victim || v->nspan > victim->nspan) {
+            victim = v;
+        }
+    }
+    if (!victim) {
+        return 0;
+    }
+    sp = &victim->span[victim->nspan - 1];
+    s->span[s->nspan] = *sp;
+    if (victim->nsent < victim->nspan - 1 ||
+        (victim->nsent == victim->nspan - 1 && victim->req_sent == 0)) {
+        victim->nspan--; // Not on the wire yet
+    } else {
+        sp->cancelled = 1;
+    }
+    if (s->nsent == s->nspan++) {
+        range_stage_request(r, s);
+    }
+    return 1;
+}
+
+// Release a connection that has nothing outstanding
+static void range_retire(RangeStream *s) {
+    close(s->fd);
+    s->fd = -1;
+}
+
+// Check the reply header against the range it answers
+static int range_check_header(RangeFetch *r, RangeStream *s) {
+    uint64_t size = p2p_get_be64(s->hdr + 1);
+    uint64_t off  = p2p_get_be64(s->hdr + 9);
+    uint64_t len  = p2p_get_be64(s->hdr + 17);
+
+    if (!r->size_known) {
+        // The very first reply tells us how much there is to fetch
+        r->size       = size;
+        r->size_known = 1;
+        if (s->span[0].len > size) {
+            s->span[0].len = size;
+        }
+        r->next = s->span[0].len;
+    }
+    if (size != r->size || off != s->span[0].off || len != s->span[0].len) {
+        return P2P_ERR_PROTO; // Content changed under us, or a confused provider
+    }
+    return P2P_OK;
+}
+
+// Make as much progress as possible on one connection without blocking.
+// Returns P2P_OK, or an error that ends the whole transfer; connection-level
+// failures are absorbed by re-queueing the stream's ranges
+static int range_step(RangeFetch *r, RangeStream *s) {
+    ssize_t n;
+    int rc;
+
+    if (s->connecting) {
+        int err = 0;
+        socklen_t len = (socklen_t)sizeof(err);
+        if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            range_fail(r, s);
+            return P2P_OK;
+        }
+        s->connecting = 0;
+    }
+
+    // Requests: keep the queue behind the reply being received full
+    while (s->nsent < s->nspan) {
+        if (s->nsent == 0 && s->req_sent == 0) {
+            s->asked_ms = now_ms(); // Pipe was empty: the reply times a round trip
+        }
+        n = write(s->fd, s->req + s->req_sent, sizeof(s->req) - s->req_sent);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            range_fail(r, s);
+            return P2P_OK;
+        }
+        s->req_sent += (size_t)n;
+        if (s->req_sent == sizeof(s->req)) {
+            s->nsent++;
+            if (s->nsent < s->nspan) {
+                range_stage_request(r, s);
+            }
+        }
+    }
+
+    // Replies: header, then exactly the requested bytes
+    while (s->nsent > 0) {
+        if (s->hdr_got < RANGE_HDR_LEN) {
+            n = read(s->fd, s->hdr + s->hdr_got, RANGE_HDR_LEN - s->hdr_got);
+        } else {
+            uint64_t left = s->span[0].len - s->got;
+            n = read(s->fd, r->buf, left < r->bufsz ? (size_t)left : r->bufsz);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return P2P_OK;
+            range_fail(r, s);
+            return P2P_OK;
+        }
+        if (n == 0) {
+            range_fail(r, s); // Provider went away mid-reply
+            return P2P_OK;
+        }
+        s->active_ms = now_ms();
+        if (s->asked_ms) {
+            range_rtt_sample(r, s->active_ms - s->asked_ms);
+            s->asked_ms = 0;
+        }
+
+        if (s->hdr_got < RANGE_HDR_LEN) {
+            rc = P2P_OK;
+            if (s->hdr_got == 0 && s->hdr[0] == PDU_E)      rc = P2P_ERR_NOTFOUND;
+            else if (s->hdr_got == 0 && s->hdr[0] == PDU_K) rc = P2P_ERR_BUNDLE;
+            else if (s->hdr_got == 0 && s->hdr[0] != PDU_C) rc = P2P_ERR_PROTO;
+            else {
+                s->hdr_got += (size_t)n;
+                if (s->hdr_got < RANGE_HDR_LEN) continue;
+                rc = range_check_header(r, s);
+            }
+            if (rc != P2P_OK && rc != P2P_ERR_BUNDLE && r->nsrc > 1) {
+                // One provider lost the content or has another version: the
+                // others carry on without it
+                r->src_fails[s->src] = RANGE_RETRIES;
+                r->src_err = rc;
+                range_fail(r, s);
+                return P2P_OK;
+            }
+            if (rc != P2P_OK) return rc;
+        } else if (s->span[0].cancelled) {
+            s->got += (uint64_t)n; // Reassigned range: the new owner delivers it
+        } else {
+            uint64_t t0 = now_us();
+            rc = r->cb(r->arg, s->span[0].off + s->got, r->buf, (size_t)n);
+            r->cb_us += now_us() - t0;
+            if (rc != 0) {
+                return P2P_ERR_ABORTED;
+            }
+            s->got   += (uint64_t)n;
+            r->bytes += (uint64_t)n;
+            r->src_bytes[s->src]  += (uint64_t)n;
+            r->src_fails[s->src]   = 0;
+        }
+
+        if (s->got == s->span[0].len) {
+            // Range complete: the next queued one (if any) moves to the front
+            memmove(&s->span[0], &s->span[1], sizeof(Span) * (RANGE_MAX_DEPTH - 1));
+            s->nspan--;
+            s->nsent--;
+            s->hdr_got = 0;
+            s->got     = 0;
+        }
+    }
+    return P2P_OK;
+}
+
+// Rate (bytes per ms) the goal needs from now on, 0 for none
+static double range_goal_rate(const RangeFetch *r, const p2p_target *goal, uint64_t elapsed) {
+    double need = (double)goal->rate / 1000.0;
+
+    if (goal->seconds > 0.0 && r->size_known) {
+        double left_ms = goal->seconds * 1000.0 - (double)elapsed;
+        double d = left_ms > 0.0 ? (double)(r->size - r->bytes) / left_ms : 1e18; // Late: all out
+        if (d > need) need = d;
+    }
+    return need;
+}
+
+// Stream 0 asks for the first chunk; the header of the reply reveals the size.
+// Until it has, a failed probe moves on to the next provider after 'prev'
+// still under RANGE_RETRIES. Returns -1 once every provider is used up
+static int range_probe(RangeFetch *r, RangeStream *streams, int prev) {
+    int k;
+
+    for (k = 1; k <= r->nsrc * RANGE_RETRIES; ++k) {
+        int src = (prev + k) % r->nsrc;
+        if (r->src_fails[src] >= RANGE_RETRIES) continue;
+        if (range_connect(r, &streams[0], src) < 0) {
+            r->src_fails[src]++;
+            continue;
+        }
+        r->nretry = 0; // Only the failed probe's range, which is asked for again
+        streams[0].span[0].off = 0;
+        streams[0].span[0].len = RANGE_CHUNK;
+        streams[0].nspan = 1;
+        range_stage_request(r, &streams[0]);
+        return 0;
+    }
+    return -1;
+}
+
+int p2p_target_fetch(const PDU *providers, int n, const char *content, int max_streams,
+                     const p2p_target *goal, p2p_range_cb cb, void *arg,
+                     p2p_range_stats *stats) {
+    RangeFetch r;
+    RangeStream streams[RANGE_MAX_STREAMS];
+    struct pollfd pfd[RANGE_MAX_STREAMS];
+    int map[RANGE_MAX_STREAMS];
+    uint64_t start = now_ms();
+    uint64_t probe_at = start + PROBE_MS;
+    uint64_t probe_bytes = 0;
+    double best_rate = 0.0;
+    int target = 1;        // Streams we want open
+    int growing = 1;       // Still probing for a better stream count
+    int peak = 0;
+    int peak_depth = RANGE_DEPTH;
+    uint64_t adapt_at = 0;
+    uint64_t adapt_bytes = 0;
+    int probe_src = -1;    // Provider asked for the size last
+    int i;
+
+    if (max_streams < 1) max_streams = 1;
+    if (max_streams > RANGE_MAX_STREAMS) max_streams = RANGE_MAX_STREAMS;
+
+    if (goal && goal->seconds <= 0.0 && goal->rate == 0) goal = NULL;
+
+    memset(&r, 0, sizeof(r));
+    for (i = 0; i < n && i < P2P_RANGE_SOURCES && r.nsrc < RANGE_MAX_STREAMS; ++i) {
+        struct sockaddr_in *a = &r.addr[r.nsrc];
+        a->sin_family = AF_INET;
+        a->sin_port   = providers[i].port_net; // Already in network byte order
+        if (inet_aton(providers[i].ip, &a->sin_addr) != 0) {
+            r.src_given[r.nsrc++] = i;
+        }
+    }
+    if (r.nsrc == 0) {
+        errno = EINVAL;
+        return P2P_ERR_IO;
+    }
+    fill_field_padded(r.name, CONTENT_NAME_LEN, content, CONTENT_NAME_LEN);
+    r.cb    = cb;
+    r.arg   = arg;
+    r.chunk = RANGE_CHUNK;
+    r.depth = RANGE_DEPTH;
+    r.bufsz = RANGE_BUF;
+    r.buf   = malloc(r.bufsz);
+    if (!r.buf) {
+        return P2P_ERR_IO;
+    }
+    for (i = 0; i < RANGE_MAX_STREAMS; ++i) {
+        streams[i].fd = -1;
+    }
+
+    while (r.result == P2P_OK && !(r.size_known && r.bytes == r.size)) {
+        uint64_t now;
+        int nfds = 0;
+        int rc;
+
+        // No size yet and no probe under way: ask the next provider
+        if (!r.size_known && streams[0].fd < 0) {
+            if (range_probe(&r, streams, probe_src) < 0) {
+                r.result = r.src_err ? r.src_err : P2P_ERR_IO;
+                break;
+            }
+            probe_src = streams[0].src;
+        }
+
+        // Top up every connection's queue; open new ones up to the target
+        for (i = 0; i < max_streams && r.size_known; ++i) {
+            RangeStream *s = &streams[i];
+            if (s->fd < 0) {
+                int src;
+                if (i >= target || (r.nretry == 0 && r.next >= r.size)) continue;
+                src = range_pick_source(&r, streams, max_streams);
+                if (src < 0 || range_connect(&r, s, src) < 0) continue;
+            }
+            while (i < target && s->nspan < r.depth && range_assign(&r, s)) {
+            }
+            if (s->nspan == 0 && i < target && !s->connecting) {
+                (void)range_steal(&r, s, streams, max_streams);
+            }
+            if (s->nspan == 0) {
+                range_retire(s); // Nothing left for it, or retired by a lower target
+            }
+        }
+
+        for (i = 0; i < max_streams; ++i) {
+            if (streams[i].fd < 0) continue;
+            pfd[nfds].fd      = streams[i].fd;
+            pfd[nfds].events  = POLLIN;
+            if (streams[i].connecting || streams[i].nsent < streams[i].nspan) {
+                pfd[nfds].events |= POLLOUT;
+            }
+            pfd[nfds].revents = 0;
+            map[nfds++] = i;
+        }
+        if (nfds == 0) {
+            r.result = P2P_ERR_IO; // Every connection failed and retries are used up
+            break;
+        }
+        if (nfds > peak) peak = nfds;
+
+        rc = poll(pfd, (nfds_t)nfds, PROBE_MS / 5);
+        if (rc < 0 && errno != EINTR) {
+            r.result = P2P_ERR_IO;
+            break;
+        }
+        now = now_ms();
+        for (i = 0; i < nfds && r.result == P2P_OK; ++i) {
+            RangeStream *s = &streams[map[i]];
+            if (pfd[i].revents) {
+                r.result = range_step(&r, s);
+            } else if (now - s->active_ms > IDLE_MS) {
+                range_fail(&r, s); // Stalled connection: someone else takes its ranges
+            }
+        }
+
+        // Re-size chunks and queues once per round trip, from the rate of that round
+        if (r.rtt_ms && now >= adapt_at) {
+            uint64_t period = r.rtt_ms > ADAPT_MIN_MS ? r.rtt_ms : ADAPT_MIN_MS;
+            if (adapt_at != 0) {
+                double rate = (double)(r.bytes - adapt_bytes) / (double)(now - adapt_at + period);
+                range_adapt(&r, rate / (double)nfds);
+                range_sample(&r, streams, max_streams, (uint64_t)(rate * 1000.0) / (uint64_t)nfds);
+                if (r.depth > peak_depth) peak_depth = r.depth;
+            }
+            adapt_bytes = r.bytes;
+            adapt_at    = now + period;
+        }
+
+        // Adapt the stream count: with a goal, add connections (and so
+        // providers) while the projected finish misses it and give them back
+        // once one fewer would still make it; otherwise add one while it pays off
+        if (now >= probe_at) {
+            double rate = (double)(r.bytes - probe_bytes) / (double)(now - probe_at + PROBE_MS);
+            if (goal && r.size_known) {
+                double need = range_goal_rate(&r, goal, now - start);
+                if (rate < need && target < max_streams) {
+                    target++;
+                } else if (target > 1 &&
+                           rate * (double)(target - 1) / (double)target > need * TARGET_SLACK) {
+                    target--;
+                }
+            } else if (growing && r.size_known) {
+                if (rate > best_rate * PROBE_GAIN && target < max_streams) {
+                    best_rate = rate;
+                    target++;
+                } else {
+                    if (rate < best_rate && target > 1) {
+                        target--; // The last stream hurt: give it back
+                    }
+                    growing = 0;
+                }
+            }
+            probe_bytes = r.bytes;
+            probe_at    = now + PROBE_MS;
+        }
+    }
+
+    range_sample(&r, streams, max_streams, 0); // Final snapshot, nothing tuned
+    for (i = 0; i < RANGE_MAX_STREAMS; ++i) {
+        if (streams[i].fd >= 0) close(streams[i].fd);
+    }
+    free(r.buf);
+
+    if (stats) {
+        stats->size      = r.size;
+        stats->bytes     = r.bytes;
+        stats->streams   = peak;
+        stats->depth     = peak_depth;
+        stats->chunk     = r.chunk;
+        stats->rtt_ms    = r.rtt_ms;
+        stats->seconds   = (double)(now_ms() - start) / 1000.0;
+        stats->sources   = 0;
+        memset(stats->src_bytes, 0, sizeof(stats->src_bytes));
+        for (i = 0; i < r.nsrc; ++i) {
+            if (r.src_bytes[i] > 0) stats->sources++;
+            stats->src_bytes[r.src_given[i]] = r.src_bytes[i];
+        }
+        stats->tcp       = r.tcp;
+        stats->app_share = stats->seconds > 0.0 ? (double)r.cb_us / 1e6 / stats->seconds : 0.0;
+    }
+    return r.result == P2P_OK ? P2P_DONE : r.result;
+}
+
+int p2p_parallel_fetch(const PDU *provider, const char *content, int max_streams,
+                       p2p_range_cb cb, void *arg, p2p_range_stats *stats) {
+    return p2p_target_fetch(provider, 1, content, max_streams, NULL, cb, arg, stats);
+}
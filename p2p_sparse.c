@@ -0,0 +1,162 @@
+// Sparse-aware downloads: only the data extents of a file cross the network
+//
+// VM images and preallocated datasets are mostly holes, and a plain 'D' reply
+// reads and sends every one of those zero bytes. For an 'M' request the provider
+// walks the file with SEEK_DATA / SEEK_HOLE and sends each data extent with its
+// offset; the receiver pwrite()s the extents and sets the final length, so the
+// holes are recreated rather than filled in. On filesystems without extent
+// information the provider simply reports the whole file as one extent.
+#include "p2p_client.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SPARSE_BUF  (256u << 10)   // Bytes read from the socket per pwrite()
+#define IDLE_MS     5000           // Give up after 5 s without data
+
+// Read exactly len bytes, waiting up to IDLE_MS for each piece
+static int sparse_read(int sock, void *dst, size_t len) {
+    char *p = dst;
+    struct pollfd pfd;
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(sock, p, len);
+        if (n > 0) {
+            p   += n;
+            len -= (size_t)n;
+            continue;
+        }
+        if (n == 0) {
+            return P2P_ERR_PROTO; // Provider closed mid-reply
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return P2P_ERR_IO;
+        }
+        pfd.fd      = sock;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, IDLE_MS) == 0) {
+            errno = ETIMEDOUT;
+            return P2P_ERR_IO;
+        }
+    }
+    return P2P_OK;
+}
+
+// Receive one extent and write it at its offset
+static int sparse_extent(int sock, int out_fd, char *buf, uint64_t off, uint64_t len) {
+    while (len > 0) {
+        size_t want = len < SPARSE_BUF ? (size_t)len : SPARSE_BUF;
+        size_t done = 0;
+        int rc = sparse_read(sock, buf, want);
+        if (rc != P2P_OK) {
+            return rc;
+        }
+        while (done < want) {
+            ssize_t n = pwrite(out_fd, buf + done, want - done, (off_t)(off + done));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return P2P_ERR_ABORTED; // Local disk failed
+            }
+            done += (size_t)n;
+        }
+        off += want;
+        len -= want;
+    }
+    return P2P_OK;
+}
+
+int p2p_sparse_fetch(int sock, const char *content, int out_fd,
+                     uint64_t *size, uint64_t *data) {
+    char req[1 + CONTENT_NAME_LEN];
+    unsigned char hdr[16];
+    char *buf;
+    uint64_t end = 0;   // End of the last extent: the next one must not start before it
+    size_t sent = 0;
+    int rc;
+
+    *size = 0;
+    *data = 0;
+    req[0] = PDU_M;
+    fill_field_padded(req + 1, CONTENT_NAME_LEN, content, CONTENT_NAME_LEN);
+    while (sent < sizeof(req)) {
+        ssize_t n = send(sock, req + sent, sizeof(req) - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { sock, POLLOUT, 0 };
+                (void)poll(&pfd, 1, IDLE_MS);
+                continue;
+            }
+            close(sock);
+            return P2P_ERR_IO;
+        }
+        sent += (size_t)n;
+    }
+
+    // Reply: 'C' + logical size, or 'E'
+    rc = sparse_read(sock, hdr, 1);
+    if (rc == P2P_OK && hdr[0] == PDU_E) {
+        rc = P2P_ERR_NOTFOUND;
+    } else if (rc == P2P_OK && hdr[0] == PDU_K) {
+        rc = P2P_ERR_BUNDLE;
+    } else if (rc == P2P_OK && hdr[0] != PDU_C) {
+        rc = P2P_ERR_PROTO;
+    } else if (rc == P2P_OK) {
+        rc = sparse_read(sock, hdr, 8);
+    }
+    if (rc != P2P_OK) {
+        close(sock);
+        return rc;
+    }
+    *size = p2p_get_be64(hdr);
+
+    buf = malloc(SPARSE_BUF);
+    if (!buf) {
+        close(sock);
+        return P2P_ERR_IO;
+    }
+
+    // Extent records until the terminator (offset = size, length = 0)
+    for (;;) {
+        uint64_t off;
+        uint64_t len;
+
+        rc = sparse_read(sock, hdr, sizeof(hdr));
+        if (rc != P2P_OK) {
+            break;
+        }
+        off = p2p_get_be64(hdr);
+        len = p2p_get_be64(hdr + 8);
+        if (len == 0) {
+            rc = off == *size ? P2P_DONE : P2P_ERR_PROTO;
+            break;
+        }
+        if (off < end || off > *size || len > *size - off) {
+            rc = P2P_ERR_PROTO;
+            break;
+        }
+        rc = sparse_extent(sock, out_fd, buf, off, len);
+        if (rc != P2P_OK) {
+            break;
+        }
+        end    = off + len;
+        *data += len;
+    }
+    free(buf);
+    close(sock);
+
+    // Trailing holes: the file still has to end where the original does
+    if (rc == P2P_DONE && ftruncate(out_fd, (off_t)*size) < 0) {
+        rc = P2P_ERR_ABORTED;
+    }
+    return rc;
+}
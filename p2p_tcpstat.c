@@ -0,0 +1,113 @@
+// Transfer telemetry: TCP_INFO snapshots and buffer sizing from them
+//
+// The kernel already measures what a transfer needs to know about its path:
+// RTT, congestion window, retransmissions, delivery rate, and (on the sender)
+// how long the connection was held back by the receiver's window or by its own
+// send buffer. A transfer samples this every few hundred milliseconds, grows its
+// socket buffer to the bandwidth-delay product the numbers imply and sizes its
+// reads/writes to match. At the end, the same numbers show whether the network,
+// the other peer or the local disk set the pace.
+#include "p2p_client.h"
+
+#include <errno.h>
+#include <linux/tcp.h>     // struct tcp_info with the newer fields
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define TCP_BUF_MAX   (32u << 20)   // Largest buffer requested
+#define TCP_IO_MIN    (16u << 10)
+#define TCP_IO_MAX    (1u << 20)
+#define LIMITED_SHARE 0.3           // Stalled this much of the busy time = the limit
+#define DISK_SHARE    0.5           // Callback took this much of the time = disk bound
+
+int p2p_tcp_sample(int fd, p2p_tcp_info *ti) {
+    struct tcp_info k;
+    socklen_t len = (socklen_t)sizeof(k);
+    socklen_t ilen = (socklen_t)sizeof(int);
+
+    // Older kernels fill a shorter struct; the rest stays zero
+    memset(&k, 0, sizeof(k));
+    memset(ti, 0, sizeof(*ti));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &k, &len) < 0) {
+        return -1;
+    }
+    ti->rtt_us            = k.tcpi_rtt;
+    ti->rcv_rtt_us        = k.tcpi_rcv_rtt;
+    ti->min_rtt_us        = k.tcpi_min_rtt;
+    ti->cwnd              = k.tcpi_snd_cwnd;
+    ti->mss               = k.tcpi_snd_mss;
+    ti->retrans           = k.tcpi_total_retrans;
+    ti->ooo_packets       = k.tcpi_rcv_ooopack;
+    ti->delivery_rate     = k.tcpi_delivery_rate;
+    ti->app_limited       = k.tcpi_delivery_rate_app_limited;
+    ti->busy_us           = k.tcpi_busy_time;
+    ti->rwnd_limited_us   = k.tcpi_rwnd_limited;
+    ti->sndbuf_limited_us = k.tcpi_sndbuf_limited;
+    (void)getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &ti->sndbuf, &ilen);
+    ilen = (socklen_t)sizeof(int);
+    (void)getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ti->rcvbuf, &ilen);
+    return 0;
+}
+
+// net.core.[rw]mem_max: setsockopt() silently clamps to it, 0 if unreadable
+static int sysctl_max(const char *path) {
+    FILE *fp = fopen(path, "r");
+    int v = 0;
+
+    if (fp) {
+        if (fscanf(fp, "%d", &v) != 1) v = 0;
+        fclose(fp);
+    }
+    return v;
+}
+
+size_t p2p_tcp_tune(int fd, const p2p_tcp_info *ti, uint64_t rate, int sending) {
+    static int rmem_max = -1;
+    static int wmem_max = -1;
+    uint32_t rtt = sending || !ti->rcv_rtt_us ? ti->rtt_us : ti->rcv_rtt_us;
+    uint64_t bdp = rate * rtt / 1000000;
+    uint64_t want = 2 * bdp;
+    int cur = sending ? ti->sndbuf : ti->rcvbuf;
+    int max;
+    uint64_t io;
+
+    if (rmem_max < 0) {
+        rmem_max = sysctl_max("/proc/sys/net/core/rmem_max");
+        wmem_max = sysctl_max("/proc/sys/net/core/wmem_max");
+    }
+    max = sending ? wmem_max : rmem_max;
+    if (want > TCP_BUF_MAX) want = TCP_BUF_MAX;
+    if (max > 0 && want > (uint64_t)max) want = (uint64_t)max;
+
+    // A set buffer is locked, ending autotuning: only take over when the kernel
+    // grants more than it already has (it doubles the value for overhead)
+    if (bdp > 0 && 2 * want > (uint64_t)cur) {
+        int v = (int)want;
+        (void)setsockopt(fd, SOL_SOCKET, sending ? SO_SNDBUF : SO_RCVBUF, &v, sizeof(v));
+    }
+
+    io = bdp / 4;
+    if (io < TCP_IO_MIN) io = TCP_IO_MIN;
+    if (io > TCP_IO_MAX) io = TCP_IO_MAX;
+    return (size_t)(io & ~(uint64_t)(TCP_IO_MIN - 1));
+}
+
+const char *p2p_tcp_bottleneck(const p2p_tcp_info *ti, double app_share, int sending) {
+    if (sending) {
+        double busy = ti->busy_us ? (double)ti->busy_us : 1.0;
+        if (ti->rwnd_limited_us / busy >= LIMITED_SHARE)   return "peer";
+        if (ti->sndbuf_limited_us / busy >= LIMITED_SHARE) return "sndbuf";
+        if (ti->app_limited)                               return "disk";
+        return "network";
+    }
+    if (app_share >= DISK_SHARE) {
+        return "disk";
+    }
+    // Loss shows up as reordering at the receiver, queueing as a swollen RTT
+    if (ti->ooo_packets > 0 ||
+        (ti->min_rtt_us && ti->rcv_rtt_us > 2 * ti->min_rtt_us)) {
+        return "network";
+    }
+    return "peer";
+}
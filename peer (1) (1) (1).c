@@ -1,6 +1,8 @@
+#define _GNU_SOURCE        // SEEK_DATA / SEEK_HOLE for sparse uploads
 // Standard networking headers for socket programming
 #include <arpa/inet.h>     // inet_aton(), inet_ntoa(), htons(), ntohs()
 #include <netinet/in.h>    // struct sockaddr_in, INADDR_ANY
+#include <netinet/tcp.h>   // TCP_NOTSENT_LOWAT
 #include <stdint.h>        
 #include <stdio.h>         
 #include <stdlib.h>       
@@ -10,32 +12,46 @@
 #include <sys/types.h>     // socklen_t, ssize_t type definitions
 #include <unistd.h>        // close(), read(), write()
 #include <errno.h>         // errno for error checking
+#include <pthread.h>       // Background upload threads
+#include <fcntl.h>         // open(), O_WRONLY for named pipe sinks
+#include <signal.h>        // signal(), SIGPIPE
+#include <sys/stat.h>      // mkfifo(), stat()
+#include <time.h>          // clock_gettime() for upload scheduling
+#include <stdatomic.h>     // count of background sender threads
 
-// Protocol constants - must match index_server.c
-#define PEER_NAME_LEN    10   // Maximum length for peer identifier
-#define CONTENT_NAME_LEN 10   // Maximum length for content/file name
-#define IP_STRLEN        16   // IPv4 address string length (xxx.xxx.xxx.xxx\0)
+#include "p2p_client.h"      // PDU format, index client and download engine
 
 #define MAX_LISTEN       16   // Maximum simultaneous content registrations per peer
-
-// PDU types (must match index_server.c) 
-#define PDU_R  'R'  // Register content with index
-#define PDU_S  'S'  // Search for content at index
-#define PDU_T  'T'  // Deregister (terminate) content
-#define PDU_O  'O'  // Request online content list
-#define PDU_A  'A'  // Acknowledgment (success)
-#define PDU_E  'E'  // Error response
-#define PDU_D  'D'  // Download request (TCP)
-#define PDU_C  'C'  // Content delivery header (TCP)
-
-// Fixed-size protocol data unit exchanged with index via UDP
-typedef struct __attribute__((packed)) {
-    char     type;                      // PDU type character
-    char     peer[PEER_NAME_LEN];      // Peer identifier (sender/target)
-    char     content[CONTENT_NAME_LEN]; // Content name being registered/searched
-    char     ip[IP_STRLEN];            // IP address for TCP connections
-    uint16_t port_net;                 // TCP port in network byte order 
-} PDU;
+#define MAX_UPLOADS      32   // Maximum simultaneous outgoing transfers
+#define MAX_BULK_UPLOADS  8   // Background ('B') senders, one thread each, at once
+#define MAX_LOCAL_REQS    8   // Same-host requests still arriving, at once
+#define LOCAL_REQ_MS   1000   // A same-host requester silent this long loses its slot
+#define UPLOAD_CHUNK  65536   // File bytes sent per event-loop turn per upload (initially)
+#define TUNE_MS       200     // TCP_INFO sampling interval of an upload
+#define RANGE_HDR_LEN    25   // 'C' + size + offset + length (8 bytes each)
+
+// Download request lengths on the wire, type byte included
+#define REQ_D_LEN  (1 + CONTENT_NAME_LEN)        // 'D' + name
+#define REQ_M_LEN  (1 + CONTENT_NAME_LEN)        // 'M' + name
+#define REQ_B_LEN  (1 + CONTENT_NAME_LEN + 2)    // 'B' + name + UDP port
+#define REQ_G_LEN  (1 + CONTENT_NAME_LEN + 16)   // 'G' + name + offset + length
+
+#define CONNECT_STAGGER_MS   250   // Head start of each address over the next (RFC 8305)
+#define CONNECT_TIMEOUT_MS  5000   // Give up if no address connects in time
+
+// Upload scheduling policies (-s option)
+#define SCHED_FAIR  0              // Every ready upload sends a chunk per pass
+#define SCHED_SRPT  1              // Ready upload with the fewest bytes left goes first
+#define SCHED_TFT   2              // Tit-for-tat: best reciprocating peers plus one optimistic
+#define SRPT_AGE_MS 250            // A waiting upload's SRPT key halves every 250 ms
+#define SRPT_LOWAT  (128 * 1024)   // Unsent bytes the kernel may hold per upload under SRPT
+
+#define TFT_SLOTS             4    // Remote peers unchoked for what they gave us
+#define TFT_RECHOKE_MS    10000    // Regular unchoke set is recomputed this often
+#define TFT_OPTIMISTIC_MS 30000    // Optimistic slot moves to the next peer this often
+#define TFT_HALF_LIFE_MS  20000    // Received bytes count half as much after this long
+#define MAX_CREDITS          64    // Remote peers whose contribution is remembered
+#define MAX_SOURCES          16    // -t: providers a goal download may draw on
 
 // Tracks one locally registered content item
 typedef struct {
@@ -43,35 +59,85 @@ typedef struct {
     char  peer[PEER_NAME_LEN + 1];      // This peer's name (for consistency)
     char  content[CONTENT_NAME_LEN + 1]; // Content name being served
     int   listen_fd;                    // TCP socket listening for download requests
+    int   local_fd;                     // Unix socket for same-host requests, -1 if none
 } LocalEntry;
 
+// A same-host requester whose 'D' has not fully arrived; read by the main select() loop
+typedef struct {
+    int      in_use;
+    int      sock;                      // Non-blocking Unix connection to the requester
+    char     req[REQ_D_LEN];            // Request bytes read so far
+    size_t   req_len;
+    uint64_t since_ms;                  // When it connected
+} LocalReq;
+
+// One outgoing transfer, advanced a chunk at a time by the main select() loop so
+// any number of requesters (or parallel streams from one requester) progress together
+typedef struct {
+    int                in_use;
+    int                sock;               // Non-blocking connection to the requester
+    struct sockaddr_in cli;
+    unsigned char      req[REQ_G_LEN];     // Request bytes read so far
+    size_t             req_len;
+    int                sending;            // 0: waiting for a request, 1: replying
+    int                close_after;        // Close once the reply is out ('D', 'E', 'K')
+    int                file_fd;            // File being served, -1 if none
+    char               fname[CONTENT_NAME_LEN + 1];
+    uint64_t           off;                // Next file offset to send
+    uint64_t           remaining;          // File bytes left in this reply
+    uint64_t           size;               // 'M': file size, end of the extent walk
+    int                sparse;             // 'M': 1 while extents remain, 2 once terminated
+    char              *buf;                // RANGE_HDR_LEN + chunk bytes
+    size_t             chunk;              // File bytes per turn, grown to the path's BDP
+    const char        *out;                // Bytes being written (buf or a pipeline slot)
+    size_t             out_len;
+    size_t             out_sent;
+    p2p_pipeline      *pl;                 // -p read-ahead thread ('D' replies only)
+    int                pl_wait;            // -p: waits for the disk thread, not the socket
+    p2p_bundle        *bundle;             // 'D' for a directory: the tree being streamed
+    uint64_t           turn_ms;            // Last time the scheduler let it send
+    uint64_t           sent;               // Bytes written to the socket
+    uint64_t           tune_ms;            // Last TCP_INFO sample
+    uint64_t           tune_sent;          // 'sent' at that sample
+} Upload;
+
+// Bytes recently downloaded from one remote peer: what it has done for us
+typedef struct {
+    struct in_addr ip;
+    uint64_t       bytes;              // Halved every TFT_HALF_LIFE_MS
+    uint64_t       ms;                 // When 'bytes' was last brought up to date
+} Credit;
+
+// Every address the index returned for the chosen provider (primary first)
+typedef struct {
+    PDU addr[P2P_MAX_ADDRS];
+    int n;
+} Provider;
+
 // Global state: UDP channel to index and local content registry
-static int udp_fd = -1;                         // UDP socket for all index communication
-static struct sockaddr_in idx_addr;             // Index server address (cached from argv)
+static p2p_index g_index;                       // UDP channel for all index communication
 static char g_peer_name[PEER_NAME_LEN + 1];    // This peer's unique identifier
 static char g_advertise_ip[IP_STRLEN];          // Optional: IP to advertise (for NAT/firewall)
+static char g_extra_ips[P2P_MAX_ADDRS - 1][IP_STRLEN]; // Further addresses (multi-homed hosts)
+static int g_n_extra = 0;
 static LocalEntry local_[MAX_LISTEN];           // Array of registered content items
-
-// Zero out all fields of a PDU structure
-static void init_pdu_clear(PDU *p) {
-    memset(p, 0, sizeof(*p));
-}
-
-// Copy at most 'limit' chars from src to dst, zero-pad remainder
-// Ensures fixed-length fields in PDUs are properly formatted
-static void fill_field_padded(char *dst, size_t dsz, const char *src, size_t limit) {
-    size_t n = 0;
-    // Copy characters up to limit or null terminator
-    while (n < limit && src[n] != '\0') {
-        dst[n] = src[n];
-        n++;
-    }
-    // Zero-pad the rest of the destination buffer
-    while (n < dsz) {
-        dst[n] = '\0';
-        n++;
-    }
-}
+static Upload uploads_[MAX_UPLOADS];            // Transfers this peer is serving
+static LocalReq local_reqs_[MAX_LOCAL_REQS];    // Same-host requests being read
+static int g_write_mode = P2P_WRITE_BUFFERED;   // How downloads reach disk (-w option)
+static int g_pipelined = 0;                     // Separate disk thread per transfer (-p option)
+static int g_background = 0;                    // Fetch via LEDBAT/UDP background mode (-b option)
+static int g_streams = 1;                       // Max parallel TCP streams per download (-n option)
+static int g_sparse = 0;                        // Hole-aware downloads (-z option)
+static p2p_target g_goal;                       // Finish time / rate downloads aim for (-t option)
+static int g_same_host = 1;                     // Copy from co-located providers locally (-L disables)
+static int g_sched = SCHED_FAIR;                // Which ready uploads send each pass (-s option)
+static Credit credits_[MAX_CREDITS];            // -s tft: contribution per remote address
+static struct in_addr g_unchoked[TFT_SLOTS];    // -s tft: peers served for reciprocity
+static int g_n_unchoked = 0;
+static struct in_addr g_optimistic;             // -s tft: peer served on spec (0 if none)
+static unsigned g_optimistic_turn = 0;
+static uint64_t g_rechoke_ms = 0;
+static uint64_t g_optimistic_ms = 0;
 
 // Consume remaining characters on current input line
 // Prevents leftover input from affecting next scanf
@@ -120,6 +186,23 @@ static void detect_local_ip(char *buf) {
     close(s);
 }
 
+// After a successful registration, tell the index about this peer's other
+// addresses. Returns how many it accepted
+static int advertise_extra_addresses(const char *content, const char *primary) {
+    int added = 0;
+    int i;
+
+    for (i = 0; i < g_n_extra; ++i) {
+        if (strcmp(g_extra_ips[i], primary) == 0) {
+            continue;
+        }
+        if (p2p_index_add_address(&g_index, g_peer_name, content, g_extra_ips[i]) == P2P_OK) {
+            added++;
+        }
+    }
+    return added;
+}
+
 // Create a TCP listening socket on an OS-assigned ephemeral port
 // Returns socket fd on success, -1 on error; sets *port_out to assigned port
 static int open_content_listener(uint16_t *port_out) {
@@ -162,179 +245,1339 @@ static int open_content_listener(uint16_t *port_out) {
     return fd;
 }
 
-// Send a PDU to index server and wait for one reply (with 2s timeout)
-// Returns 0 on success, -1 on timeout/error
-static int send_pdu_wait_reply(const PDU *out, PDU *in) {
-    ssize_t n;
-    struct timeval tv;
-    fd_set rfds;
+// Write the whole buffer to fd, retrying short writes (pipes accept partial chunks)
+// Returns 0 on success, -1 if the reader went away or the write failed
+static int write_all(int fd, const char *buf, size_t len) {
+    ssize_t w;
 
-    // Transmit request PDU to index server
-    n = sendto(udp_fd, out, sizeof(*out), 0,
-               (struct sockaddr *)&idx_addr, sizeof(idx_addr));
-    if (n != (ssize_t)sizeof(*out)) {
-        perror("sendto");
-        return -1;
+    while (len > 0) {
+        w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        len -= (size_t)w;
     }
+    return 0;
+}
 
-    // Set up 2-second timeout for reply
-    FD_ZERO(&rfds);
-    FD_SET(udp_fd, &rfds);
-    tv.tv_sec  = 2;
-    tv.tv_usec = 0;
+// One background (LEDBAT over UDP) upload, owned by its own thread
+typedef struct {
+    int                ctl;      // TCP control connection from the requester
+    int                file_fd;  // File being served
+    uint64_t           size;
+    struct sockaddr_in dst;      // Requester's UDP address
+} BulkUpload;
+
+static atomic_int bulk_active_;     // Background senders running or being started
+
+// Release a background upload and its sender slot
+static void bulk_upload_free(BulkUpload *u) {
+    close(u->file_fd);
+    close(u->ctl);
+    free(u);
+    atomic_fetch_sub(&bulk_active_, 1);
+}
 
-    // Wait for response or timeout
-    if (select(udp_fd + 1, &rfds, NULL, NULL, &tv) <= 0) {
-        if (errno != 0) perror("select(udp)");
-        return -1;
+static void *bulk_upload_main(void *arg) {
+    BulkUpload *u = (BulkUpload *)arg;
+
+    (void)p2p_bulk_send(u->ctl, u->file_fd, u->size, &u->dst);
+    bulk_upload_free(u);
+    return NULL;
+}
+
+// Answer a 'B' request: send 'C' + 8-byte size on the control connection, then
+// push the data over UDP from a detached thread so the menu and other uploads
+// keep running for the (deliberately slow) lifetime of the transfer
+static void start_background_upload(int cfd, int file_fd, const struct sockaddr_in *cli,
+                                    uint16_t udp_port_net) {
+    struct stat st;
+    unsigned char hdr[9];
+    BulkUpload *u;
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    // Each one holds a thread for its whole (slow) lifetime: refuse past the cap
+    if (atomic_fetch_add(&bulk_active_, 1) >= MAX_BULK_UPLOADS) {
+        hdr[0] = PDU_E;
+        (void)write_all(cfd, (const char *)hdr, 1);
+        atomic_fetch_sub(&bulk_active_, 1);
+        close(file_fd);
+        close(cfd);
+        return;
+    }
+    if (fstat(file_fd, &st) < 0 || (u = malloc(sizeof(*u))) == NULL) {
+        atomic_fetch_sub(&bulk_active_, 1);
+        close(file_fd);
+        close(cfd);
+        return;
+    }
+    u->ctl     = cfd;
+    u->file_fd = file_fd;
+    u->size    = (uint64_t)st.st_size;
+    u->dst     = *cli;
+    u->dst.sin_port = udp_port_net;
+
+    hdr[0] = PDU_C;
+    p2p_put_be64(hdr + 1, u->size);
+    if (write_all(cfd, (const char *)hdr, sizeof(hdr)) < 0) {
+        bulk_upload_free(u); // Requester gone: send nothing
+        return;
     }
 
-    // Receive reply PDU from index
-    n = recvfrom(udp_fd, in, sizeof(*in), 0, NULL, NULL);
-    if (n != (ssize_t)sizeof(*in)) {
-        fprintf(stderr, "Short/long UDP reply (%ld bytes)\n", (long)n);
-        return -1;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, bulk_upload_main, u) != 0) {
+        perror("pthread_create");
+        bulk_upload_free(u);
     }
+    pthread_attr_destroy(&attr);
+}
 
-    return 0;
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
 }
 
-// Accept and handle one incoming download request on a TCP listener
-// Protocol: receive 'D' + content_name, respond with 'C' + file data or 'E'
-static void handle_single_download(int listen_fd) {
-    int cfd;
+// Release an upload slot and everything it holds
+static void upload_close(Upload *u) {
+    if (u->pl) {
+        (void)p2p_pipeline_close(u->pl);
+        u->pl = NULL;
+    }
+    u->pl_wait = 0;
+    p2p_bundle_close(u->bundle);
+    u->bundle = NULL;
+    if (u->file_fd >= 0) close(u->file_fd);
+    if (u->sock >= 0) close(u->sock);
+    free(u->buf);
+    u->buf     = NULL;
+    u->file_fd = -1;
+    u->sock    = -1;
+    u->in_use  = 0;
+}
+
+// Accept one incoming download connection into a free upload slot
+static void accept_upload(int listen_fd) {
     struct sockaddr_in cli;
     socklen_t clen;
-    char typ;
-    char namebuf[CONTENT_NAME_LEN];
-    char fname[CONTENT_NAME_LEN + 16];
-    FILE *fp;
-    char buf[4096];
-    size_t n;
+    char *buf;
+    int cfd;
+    int flags;
+    int i;
 
     clen = (socklen_t)sizeof(cli); // Accept incoming connection
-    cfd = accept(listen_fd, (struct sockaddr *)&cli, &clen); // Accept connection
+    cfd = accept(listen_fd, (struct sockaddr *)&cli, &clen);
     if (cfd < 0) {
         perror("accept");
         return;
     }
 
-    // Phase 1: Read download request header ('D')
-    if (read(cfd, &typ, 1) != 1 || typ != PDU_D) {
-        close(cfd);
-        return;
-    }
+    for (i = 0; i < MAX_UPLOADS; ++i) {
+        if (!uploads_[i].in_use) break;
+    }
+    flags = fcntl(cfd, F_GETFL, 0);
+    if (i == MAX_UPLOADS || flags < 0 || fcntl(cfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(cfd); // Too many transfers in progress: requester retries elsewhere
+        return;
+    }
+    buf = malloc(RANGE_HDR_LEN + UPLOAD_CHUNK);
+    if (!buf) {
+        close(cfd);
+        return;
+    }
+
+    if (g_sched != SCHED_FAIR) {
+        // Keep the unsent queue short, or megabytes already handed to the kernel
+        // for a big transfer would go out ahead of whatever the scheduler picks
+        int lowat = SRPT_LOWAT;
+        (void)setsockopt(cfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+    }
+
+    memset(&uploads_[i], 0, sizeof(uploads_[i]));
+    uploads_[i].in_use  = 1;
+    uploads_[i].sock    = cfd;
+    uploads_[i].cli     = cli;
+    uploads_[i].file_fd = -1;
+    uploads_[i].buf     = buf;
+    uploads_[i].chunk   = UPLOAD_CHUNK;
+    uploads_[i].tune_ms = now_ms();
+}
+
+// A name a remote peer may ask for: relative, without "." or ".." components,
+// so it cannot reach above or outside this peer's directory
+static int request_name_ok(const char *name) {
+    const char *c = name;
+
+    if (name[0] == '\0' || name[0] == '/') {
+        return 0;
+    }
+    while (*c) {
+        size_t len = strcspn(c, "/");
+        if ((len == 1 && c[0] == '.') || (len == 2 && c[0] == '.' && c[1] == '.')) {
+            return 0;
+        }
+        c += len;
+        if (*c == '/') c++;
+    }
+    return 1;
+}
+
+// A directory goes out as a bundle only if this peer registered it by that name
+static int is_registered(const char *name) {
+    int i;
+
+    for (i = 0; i < MAX_LISTEN; ++i) {
+        if (local_[i].in_use && strcmp(local_[i].content, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Reply with a single status byte and close: 'E' (not found) or 'K' (a bundle,
+// which only a 'D' request can carry)
+static void upload_reply_byte(Upload *u, char typ) {
+    u->buf[0]      = typ;
+    u->out         = u->buf;
+    u->out_len     = 1;
+    u->out_sent    = 0;
+    u->remaining   = 0;
+    u->close_after = 1;
+    u->sending     = 1;
+}
+
+// Start the reply to a complete request in u->req
+// Protocol: 'D' + content_name  -> 'C' + whole file, then close (or 'E')
+//                                  for a directory: 'K' + bundle stream, then close
+//           'G' + name + off + len -> 'C' + size + off + len + bytes; connection stays
+//                                     open for further 'G' requests
+//           'M' + content_name  -> 'C' + size, then offset + length + bytes per
+//                                  data extent, ending with (size, 0); then close
+//           'B' + name + UDP port -> handed to a background upload thread
+//           'G', 'M', 'B' for a directory -> 'K', then close
+static void upload_start_reply(Upload *u) {
+    char fname[CONTENT_NAME_LEN + 1];
+    struct stat st;
+    char typ = (char)u->req[0];
+    int k;
+
+    // Extract null-terminated filename from fixed-width buffer
+    for (k = 0; k < CONTENT_NAME_LEN; ++k) {
+        if (u->req[1 + k] == '\0' || u->req[1 + k] == ' ')
+            break;
+        fname[k] = (char)u->req[1 + k];
+    }
+    fname[k] = '\0';
+    u->turn_ms = now_ms(); // SRPT aging counts from the request
+
+    // Attempt to open requested file (kept open across 'G' requests for the same name)
+    if (u->file_fd >= 0 && strcmp(u->fname, fname) != 0) {
+        close(u->file_fd);
+        u->file_fd = -1;
+    }
+    if (!request_name_ok(fname)) {
+        upload_reply_byte(u, PDU_E);
+        return;
+    }
+    if (u->file_fd < 0) {
+        u->file_fd = open(fname, O_RDONLY);
+        strcpy(u->fname, fname);
+    }
+    if (u->file_fd < 0 || fstat(u->file_fd, &st) < 0) {
+        upload_reply_byte(u, PDU_E); // File not found
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        // Bundle: the whole tree as one stream, packed by upload_refill()
+        if (!is_registered(fname)) {
+            upload_reply_byte(u, PDU_E);
+        } else if (typ == PDU_D) {
+            u->bundle = p2p_bundle_open(u->file_fd);
+            upload_reply_byte(u, u->bundle ? PDU_K : PDU_E);
+        } else {
+            upload_reply_byte(u, PDU_K); // Ranges, extents and 'B' don't apply
+        }
+        return;
+    }
+
+    if (typ == PDU_B) {
+        uint16_t udp_port_net;
+        int flags = fcntl(u->sock, F_GETFL, 0);
+        memcpy(&udp_port_net, u->req + 1 + CONTENT_NAME_LEN, 2);
+        (void)fcntl(u->sock, F_SETFL, flags & ~O_NONBLOCK);
+        start_background_upload(u->sock, u->file_fd, &u->cli, udp_port_net);
+        u->sock    = -1; // Now owned by the background thread
+        u->file_fd = -1;
+        upload_close(u);
+        return;
+    }
+
+    u->out      = u->buf;
+    u->out_sent = 0;
+    u->sending  = 1;
+    if (typ == PDU_G) {
+        uint64_t size = (uint64_t)st.st_size;
+        uint64_t off  = p2p_get_be64(u->req + 1 + CONTENT_NAME_LEN);
+        uint64_t len  = p2p_get_be64(u->req + 1 + CONTENT_NAME_LEN + 8);
+        if (off > size) off = size;
+        if (len > size - off) len = size - off;
+        u->buf[0] = PDU_C;
+        p2p_put_be64((unsigned char *)u->buf + 1,  size);
+        p2p_put_be64((unsigned char *)u->buf + 9,  off);
+        p2p_put_be64((unsigned char *)u->buf + 17, len);
+        u->out_len     = RANGE_HDR_LEN;
+        u->off         = off;
+        u->remaining   = len;
+        u->sparse      = 0;
+        u->close_after = 0;
+        return;
+    }
+
+    if (typ == PDU_M) {
+        // Sparse reply: size now, extents are found one at a time by upload_refill()
+        u->buf[0] = PDU_C;
+        p2p_put_be64((unsigned char *)u->buf + 1, (uint64_t)st.st_size);
+        u->out_len     = 9;
+        u->off         = 0;
+        u->remaining   = 0;
+        u->size        = (uint64_t)st.st_size;
+        u->sparse      = 1;
+        u->close_after = 1;
+        return;
+    }
+
+    // 'D': success header, then the whole file
+    u->sparse      = 0;
+    u->buf[0]      = PDU_C;
+    u->out_len     = 1;
+    u->off         = 0;
+    u->remaining   = (uint64_t)st.st_size;
+    u->close_after = 1;
+    if (g_pipelined) {
+        // Disk thread reads ahead into the ring; a slow read no longer idles the socket
+        u->pl = p2p_pipeline_reader(u->file_fd);
+        if (!u->pl) {
+            perror("pthread_create"); // Fall back to reading from the event loop
+        }
+    }
+}
+
+// Socket readable while waiting for a request: collect it without blocking
+static void upload_on_readable(Upload *u) {
+    size_t need;
+    ssize_t n;
+
+    for (;;) {
+        if (u->req_len == 0) {
+            need = 1;
+        } else if (u->req[0] == PDU_D) {
+            need = REQ_D_LEN;
+        } else if (u->req[0] == PDU_M) {
+            need = REQ_M_LEN;
+        } else if (u->req[0] == PDU_B) {
+            need = REQ_B_LEN;
+        } else if (u->req[0] == PDU_G) {
+            need = REQ_G_LEN;
+        } else {
+            upload_close(u); // Unknown request type
+            return;
+        }
+
+        if (u->req_len == need) {
+            upload_start_reply(u);
+            return;
+        }
+
+        n = read(u->sock, u->req + u->req_len, need - u->req_len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            upload_close(u); // Requester closed (normal end of a 'G' session)
+            return;
+        }
+        u->req_len += (size_t)n;
+    }
+}
+
+// 'M' replies: stage the record header of the next data extent at or after
+// u->off, or the (size, 0) terminator once only holes are left
+static int upload_next_extent(Upload *u) {
+    off_t data = -1;
+    off_t hole;
+
+    if (u->off < u->size) {
+        data = lseek(u->file_fd, (off_t)u->off, SEEK_DATA);
+        if (data < 0 && errno != ENXIO) {
+            data = (off_t)u->off; // No extent information: the rest is all data
+        }
+    }
+    if (data < 0 || (uint64_t)data >= u->size) {
+        p2p_put_be64((unsigned char *)u->buf,     u->size);
+        p2p_put_be64((unsigned char *)u->buf + 8, 0);
+        u->sparse = 2;
+    } else {
+        hole = lseek(u->file_fd, data, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole > u->size) {
+            hole = (off_t)u->size;
+        }
+        p2p_put_be64((unsigned char *)u->buf,     (uint64_t)data);
+        p2p_put_be64((unsigned char *)u->buf + 8, (uint64_t)(hole - data));
+        u->off       = (uint64_t)data;
+        u->remaining = (uint64_t)(hole - data);
+    }
+    u->out      = u->buf;
+    u->out_len  = 16;
+    u->out_sent = 0;
+    return 1;
+}
+
+// Stage the next piece of file data; returns 0 when the reply is complete,
+// -1 if the disk thread has not read it yet (then u->pl_wait is set)
+static int upload_refill(Upload *u) {
+    size_t want;
+    ssize_t n;
+
+    if (u->bundle) {
+        // Many small files per write; the bundle opens and prefetches ahead
+        long len = p2p_bundle_read(u->bundle, u->buf, RANGE_HDR_LEN + u->chunk);
+        if (len <= 0) {
+            return 0; // End entry sent (or a read failed: the receiver sees it cut short)
+        }
+        u->out      = u->buf;
+        u->out_len  = (size_t)len;
+        u->out_sent = 0;
+        return 1;
+    }
+    if (u->remaining == 0) {
+        return u->sparse == 1 ? upload_next_extent(u) : 0;
+    }
+    if (u->pl) {
+        const char *chunk;
+        long len = p2p_pipeline_try_read(u->pl, &chunk);
+        if (len == -P2P_AGAIN) {
+            u->pl_wait = 1; // The event loop waits on the pipeline instead
+            return -1;
+        }
+        n = len > (long)u->remaining ? (ssize_t)u->remaining : (ssize_t)len;
+        u->out = chunk;
+    } else {
+        want = u->remaining < u->chunk ? (size_t)u->remaining : u->chunk;
+        n = pread(u->file_fd, u->buf, want, (off_t)u->off);
+        u->out = u->buf;
+    }
+    if (n <= 0) {
+        // File shrank under us: the reply can't be completed, so end the connection
+        u->remaining   = 0;
+        u->close_after = 1;
+        return 0;
+    }
+    u->out_len   = (size_t)n;
+    u->out_sent  = 0;
+    u->off       += (uint64_t)n;
+    u->remaining -= (uint64_t)n;
+    return 1;
+}
+
+// Every TUNE_MS: size the send buffer and the chunk to the bandwidth-delay
+// product TCP_INFO reports. Only between chunks, while buf holds nothing unsent
+static void upload_tune(Upload *u) {
+    p2p_tcp_info ti;
+    uint64_t rate;
+    size_t want;
+
+    if (u->turn_ms - u->tune_ms < TUNE_MS || p2p_tcp_sample(u->sock, &ti) < 0) {
+        return;
+    }
+    rate = ti.delivery_rate;
+    if (rate == 0 || ti.app_limited) {
+        // The kernel's sample only shows what we fed it: use our own count
+        rate = (u->sent - u->tune_sent) * 1000u / (u->turn_ms - u->tune_ms);
+    }
+    u->tune_ms   = u->turn_ms;
+    u->tune_sent = u->sent;
+    want = p2p_tcp_tune(u->sock, &ti, rate, 1);
+    if (want > u->chunk) {
+        char *nb = realloc(u->buf, RANGE_HDR_LEN + want);
+        if (nb) {
+            u->buf   = nb;
+            u->chunk = want;
+        }
+    }
+}
+
+// Socket writable while replying: send at most one chunk, so every active
+// upload gets a turn on each pass of the event loop
+static void upload_on_writable(Upload *u) {
+    ssize_t n;
+    int staged = 1;
+
+    u->turn_ms = now_ms();
+    if (u->out_sent == u->out_len) {
+        upload_tune(u);
+        staged = upload_refill(u);
+    }
+    if (staged < 0) {
+        return; // Disk behind: nothing to send this turn
+    }
+    if (staged == 0) {
+        if (u->close_after) {
+            upload_close(u);
+        } else {
+            u->sending = 0; // Ready for the next request on this connection
+            u->req_len = 0;
+        }
+        return;
+    }
+
+    n = write(u->sock, u->out + u->out_sent, u->out_len - u->out_sent);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            upload_close(u); // Connection closed
+        }
+        return;
+    }
+    u->out_sent += (size_t)n;
+    u->sent     += (uint64_t)n;
+}
+
+// Bytes an upload still has to send: the rest of the file for 'D' and 'M', the
+// requested range for 'G', the unsent files of a bundle
+static uint64_t upload_left(const Upload *u) {
+    uint64_t staged = u->out_len - u->out_sent;
+
+    if (u->bundle) {
+        return staged + p2p_bundle_left(u->bundle);
+    }
+    if (u->sparse == 1) {
+        return staged + (u->size - u->off);
+    }
+    return staged + u->remaining;
+}
+
+// SRPT: of the uploads that can send now, pick the one with the fewest bytes
+// left. Its key halves for every SRPT_AGE_MS since its last turn, so a 20 GB
+// transfer behind a stream of small ones still gets a chunk within a few
+// seconds. Returns the slot, or -1 if no upload is ready
+static int upload_pick_srpt(fd_set *wfds) {
+    uint64_t now = now_ms();
+    uint64_t best_key = 0;
+    int best = -1;
+    int i;
+
+    for (i = 0; i < MAX_UPLOADS; ++i) {
+        Upload *u = &uploads_[i];
+        uint64_t halvings;
+        uint64_t key;
+
+        if (!u->in_use || !u->sending || u->pl_wait || !FD_ISSET(u->sock, wfds)) {
+            continue;
+        }
+        halvings = (now - u->turn_ms) / SRPT_AGE_MS;
+        key = halvings >= 64 ? 0 : upload_left(u) >> halvings;
+        if (best < 0 || key < best_key) {
+            best     = i;
+            best_key = key;
+        }
+    }
+    return best;
+}
+
+// SRPT: the upload to send next, chosen among those whose sockets have room
+// right now. Returns the slot, or -1 if none has (then all wait for room)
+static int upload_pick_srpt_now(void) {
+    struct timeval zero = { 0, 0 };
+    fd_set ready;
+    int maxfd = -1;
+    int i;
+
+    FD_ZERO(&ready);
+    for (i = 0; i < MAX_UPLOADS; ++i) {
+        if (uploads_[i].in_use && uploads_[i].sending && !uploads_[i].pl_wait) {
+            FD_SET(uploads_[i].sock, &ready);
+            if (uploads_[i].sock > maxfd) {
+                maxfd = uploads_[i].sock;
+            }
+        }
+    }
+    if (maxfd < 0 || select(maxfd + 1, NULL, &ready, NULL, &zero) <= 0) {
+        return -1;
+    }
+    return upload_pick_srpt(&ready);
+}
+
+// Tit-for-tat: find (or make room for) the credit entry of 'ip', decayed to now
+static Credit *credit_get(struct in_addr ip, uint64_t now, int create) {
+    Credit *oldest = &credits_[0];
+    int i;
+
+    for (i = 0; i < MAX_CREDITS; ++i) {
+        Credit *c = &credits_[i];
+        if (c->ms != 0 && c->ip.s_addr == ip.s_addr) {
+            while (now - c->ms >= TFT_HALF_LIFE_MS) {
+                c->bytes /= 2;
+                c->ms    += TFT_HALF_LIFE_MS;
+            }
+            return c;
+        }
+        if (c->ms < oldest->ms) {
+            oldest = c;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    oldest->ip    = ip; // Forget whoever helped us least recently
+    oldest->bytes = 0;
+    oldest->ms    = now;
+    return oldest;
+}
+
+// Record a finished (or partial) download from 'provider'
+static void credit_add(const PDU *provider, uint64_t bytes) {
+    struct in_addr ip;
+    Credit *c;
+
+    if (bytes == 0 || inet_aton(provider->ip, &ip) == 0) {
+        return;
+    }
+    c = credit_get(ip, now_ms(), 1);
+    c->bytes += bytes;
+}
+
+static uint64_t credit_of(struct in_addr ip, uint64_t now) {
+    Credit *c = credit_get(ip, now, 0);
+    return c ? c->bytes : 0;
+}
+
+static int tft_is_unchoked(struct in_addr ip) {
+    int i;
+
+    if (g_optimistic.s_addr != 0 && g_optimistic.s_addr == ip.s_addr) {
+        return 1;
+    }
+    for (i = 0; i < g_n_unchoked; ++i) {
+        if (g_unchoked[i].s_addr == ip.s_addr) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Recompute who may receive data: the TFT_SLOTS requesting peers that sent us
+// the most recently, plus one optimistic slot that rotates through the rest so
+// newcomers (and peers we have not fetched from yet) get a chance to prove
+// themselves. Runs every TFT_RECHOKE_MS, and at once when a slot is vacant
+static void tft_rechoke(void) {
+    struct in_addr peers[MAX_UPLOADS];
+    uint64_t credit[MAX_UPLOADS];
+    uint64_t now = now_ms();
+    int n = 0;
+    int on = 0;
+    int want;
+    int i;
+    int j;
+
+    // Distinct requesting peers, ordered by what they gave us (insertion sort)
+    for (i = 0; i < MAX_UPLOADS; ++i) {
+        struct in_addr ip = uploads_[i].cli.sin_addr;
+        uint64_t c;
+        if (!uploads_[i].in_use) {
+            continue;
+        }
+        for (j = 0; j < n && peers[j].s_addr != ip.s_addr; ++j) {
+        }
+        if (j < n) {
+            continue;
+        }
+        on += tft_is_unchoked(ip);
+        c = credit_of(ip, now);
+        for (j = n; j > 0 && credit[j - 1] < c; --j) {
+            peers[j]  = peers[j - 1];
+            credit[j] = credit[j - 1];
+        }
+        peers[j]  = ip;
+        credit[j] = c;
+        n++;
+    }
+
+    // Nothing to change unless a timer expired or someone waits for a free slot
+    want = n < TFT_SLOTS + 1 ? n : TFT_SLOTS + 1;
+    if (now - g_rechoke_ms < TFT_RECHOKE_MS && now - g_optimistic_ms < TFT_OPTIMISTIC_MS &&
+        on >= want) {
+        return;
+    }
+    if (now - g_rechoke_ms >= TFT_RECHOKE_MS || on < want) {
+        g_rechoke_ms = now;
+        g_n_unchoked = n < TFT_SLOTS ? n : TFT_SLOTS;
+        for (i = 0; i < g_n_unchoked; ++i) {
+            g_unchoked[i] = peers[i];
+        }
+    }
+
+    // The optimistic slot goes round the peers left out of the regular set; it
+    // moves on when its time is up, or when its peer left or was promoted
+    for (j = g_n_unchoked; j < n && peers[j].s_addr != g_optimistic.s_addr; ++j) {
+    }
+    if (j == n || now - g_optimistic_ms >= TFT_OPTIMISTIC_MS) {
+        g_optimistic.s_addr = 0;
+        if (n > g_n_unchoked) {
+            g_optimistic = peers[g_n_unchoked + g_optimistic_turn++ % (unsigned)(n - g_n_unchoked)];
+            g_optimistic_ms = now;
+        }
+    }
+}
+
+// Milliseconds until tft_rechoke() may change the unchoked set on its own
+static uint64_t tft_wait_ms(void) {
+    uint64_t now = now_ms();
+    uint64_t next = g_rechoke_ms + TFT_RECHOKE_MS;
+
+    if (g_optimistic_ms + TFT_OPTIMISTIC_MS < next) {
+        next = g_optimistic_ms + TFT_OPTIMISTIC_MS;
+    }
+    return next > now ? next - now : 0;
+}
+
+// Answer a same-host request by passing an open descriptor of the file; the
+// requester copies it in the kernel, so nothing is streamed from here at all
+static void answer_local_request(int cfd, const char *req) {
+    char fname[CONTENT_NAME_LEN + 1];
+    struct stat st;
+    int file_fd;
+    int k;
+
+    if (req[0] != PDU_D) {
+        close(cfd);
+        return;
+    }
+
+    // Extract null-terminated filename from fixed-width buffer
+    for (k = 0; k < CONTENT_NAME_LEN; ++k) {
+        if (req[1 + k] == '\0' || req[1 + k] == ' ')
+            break;
+        fname[k] = req[1 + k];
+    }
+    fname[k] = '\0';
+    if (!request_name_ok(fname)) {
+        (void)p2p_local_reply(cfd, -1);
+        close(cfd);
+        return;
+    }
+
+    file_fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (file_fd >= 0 && fstat(file_fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+        // A bundle has no single descriptor to hand over: closing without a
+        // reply sends the requester to the TCP path
+        close(file_fd);
+        close(cfd);
+        return;
+    }
+    (void)p2p_local_reply(cfd, file_fd); // 'E' when the open failed
+    if (file_fd >= 0) {
+        close(file_fd);
+    }
+    close(cfd);
+}
+
+// Read what has arrived of a same-host request without blocking, and answer
+// it once complete. The slot is freed when answered or the requester left
+static void read_local_request(LocalReq *q) {
+    ssize_t n;
+
+    n = recv(q->sock, q->req + q->req_len, sizeof(q->req) - q->req_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        close(q->sock);
+        q->in_use = 0;
+        return;
+    }
+    q->req_len += (size_t)n;
+    if (q->req_len == sizeof(q->req)) {
+        answer_local_request(q->sock, q->req);
+        q->in_use = 0;
+    }
+}
+
+// Accept a same-host requester into a free slot. Its request is read by the
+// main loop as it arrives, so a silent requester never stalls anyone else;
+// when all slots are taken, one silent for LOCAL_REQ_MS is dropped for it
+static void accept_local(int local_fd) {
+    uint64_t now = now_ms();
+    int cfd;
+    int flags;
+    int i;
+
+    cfd = accept(local_fd, NULL, NULL);
+    if (cfd < 0) {
+        perror("accept(local)");
+        return;
+    }
+
+    for (i = 0; i < MAX_LOCAL_REQS; ++i) {
+        if (!local_reqs_[i].in_use) break;
+    }
+    if (i == MAX_LOCAL_REQS) {
+        for (i = 0; i < MAX_LOCAL_REQS; ++i) {
+            if (now - local_reqs_[i].since_ms >= LOCAL_REQ_MS) break;
+        }
+        if (i < MAX_LOCAL_REQS) {
+            close(local_reqs_[i].sock);
+            local_reqs_[i].in_use = 0;
+        }
+    }
+    flags = fcntl(cfd, F_GETFL, 0);
+    if (i == MAX_LOCAL_REQS || flags < 0 || fcntl(cfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(cfd); // Closing without a reply sends the requester to the TCP path
+        return;
+    }
+
+    local_reqs_[i].in_use   = 1;
+    local_reqs_[i].sock     = cfd;
+    local_reqs_[i].req_len  = 0;
+    local_reqs_[i].since_ms = now;
+    read_local_request(&local_reqs_[i]); // The requester sends right after connecting
+}
+
+// Menu action R: Register locally available content with the index server
+// Creates a TCP listener for downloads and notifies index of availability
+static void cmd_register_content(void) {
+    char content[CONTENT_NAME_LEN + 1];
+    char filename[128];
+    uint16_t port;
+    int listen_fd;
+    char myip[IP_STRLEN];
+    struct stat st;
+    int rc;
+    int i;
+
+    memset(content, 0, sizeof(content));
+    memset(filename, 0, sizeof(filename));
+
+    // Step 1: Prompt user for content name
+    printf("Content tag (max %d chars): ", CONTENT_NAME_LEN);
+    if (scanf("%10s", content) != 1) {
+        puts("Invalid content name.");
+        drain_stdin_line();
+        return;
+    }
+    drain_stdin_line();
+
+    // Step 2: Prompt for local filename
+    printf("Filename on disk to share: ");
+    if (scanf("%127s", filename) != 1) {
+        puts("Invalid filename.");
+        drain_stdin_line();
+        return;
+    }
+    drain_stdin_line();
+
+    // Constraint: For simplicity, filename must match content name
+    if (strcmp(filename, content) != 0) {
+        puts("For this peer implementation, filename must equal the content name.");
+        return;
+    }
+
+    // Step 3: Create TCP listener for serving this content
+    port = 0;
+    listen_fd = open_content_listener(&port);
+    if (listen_fd < 0) {
+        return;
+    }
+
+    // Step 4: Determine IP to advertise (manual override or auto-detect)
+    memset(myip, 0, sizeof(myip));
+    if (g_advertise_ip[0] != '\0') {
+        // Use manually specified IP (for NAT scenarios)
+        strncpy(myip, g_advertise_ip, IP_STRLEN - 1);
+    } else {
+        // Auto-detect local IP via routing trick
+        detect_local_ip(myip);
+    }
+
+    // Step 5: Send registration to index and await acknowledgment
+    rc = p2p_index_register(&g_index, g_peer_name, content, myip, port);
+    if (rc != P2P_ERR_IO && rc != P2P_ERR_TIMEOUT) {
+        if (rc == P2P_OK) {
+            // Success: store in local table to handle future download requests
+            for (i = 0; i < MAX_LISTEN; ++i) {
+                if (!local_[i].in_use) {
+                    local_[i].in_use = 1;
+                    fill_field_padded(local_[i].peer,    sizeof(local_[i].peer),
+                              g_peer_name, PEER_NAME_LEN);
+                    fill_field_padded(local_[i].content, sizeof(local_[i].content),
+                              content, CONTENT_NAME_LEN);
+                    local_[i].listen_fd = listen_fd;
+                    local_[i].local_fd  = p2p_local_listen(port);
+                    printf("Now serving '%s' from %s:%u (listener fd=%d)\n",
+                           content, myip, port, listen_fd);
+                    if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+                        puts("It is a directory: requesters receive the whole tree as one bundle.");
+                    }
+                    if (g_n_extra > 0) {
+                        printf("Also advertised on %d more address(es)\n",
+                               advertise_extra_addresses(content, myip));
+                    }
+                    break;
+                }
+            }
+            if (i == MAX_LISTEN) {
+                puts("Local table full; closing listener.");
+                close(listen_fd);
+            }
+        } else if (rc == P2P_ERR_NOTFOUND) {
+            // Index rejected (duplicate peer/content pair)
+            puts("Registration rejected by index: this peer name already registered that content.");
+            puts("Please choose a different peer name before registering this content.");
+            close(listen_fd);
+        } else {
+            puts("Registration failed (unexpected reply from index).");
+            close(listen_fd);
+        }
+    } else {
+        // No response from index (timeout/network issue)
+        puts("Could not reach the index server (no UDP reply).");
+        close(listen_fd);
+    }
+}
+
+// Phase 1 of a fetch: ask the index which peer currently serves 'content'
+// Returns 0 with the provider's addresses in *prov, -1 after printing why it failed
+static int lookup_provider(const char *content, Provider *prov) {
+    int rc = p2p_resolve_all(&g_index, g_peer_name, content, prov->addr, P2P_MAX_ADDRS);
+
+    if (rc == P2P_ERR_NOTFOUND) {
+        puts("Content not found on any peer.");
+        return -1;
+    }
+    if (rc == P2P_ERR_PROTO) {
+        puts("Unexpected response type from index.");
+        return -1;
+    }
+    if (rc < 0) {
+        puts("No response from index (check IP/port).");
+        return -1;
+    }
+    prov->n = rc;
+    return 0;
+}
+
+// Connect to the provider over whichever of its addresses answers first:
+// attempts start CONNECT_STAGGER_MS apart, so a dead or slow path only costs
+// that delay. Returns the connected (non-blocking) socket or -1; *ans is set
+// to the winning address
+static int connect_provider(const Provider *prov, FILE *log, const PDU **ans) {
+    int fd;
+    int w = 0;
+
+    fprintf(log, "Index chose provider %s:%u for this download\n",
+            prov->addr[0].ip, ntohs(prov->addr[0].port_net));
+    if (prov->n > 1) {
+        fprintf(log, "Racing TCP connections to %d advertised addresses ...\n", prov->n);
+    } else {
+        fprintf(log, "Opening TCP connection to provider %s:%u ...\n",
+                prov->addr[0].ip, ntohs(prov->addr[0].port_net));
+    }
+
+    fd = p2p_connect_race(prov->addr, prov->n, CONNECT_STAGGER_MS, CONNECT_TIMEOUT_MS, &w);
+    if (fd < 0) {
+        perror("connect");
+        return -1;
+    }
+    if (prov->n > 1) {
+        fprintf(log, "Connected via %s:%u\n", prov->addr[w].ip, ntohs(prov->addr[w].port_net));
+    }
+    *ans = &prov->addr[w];
+    return fd;
+}
+
+// Where a blocking download delivers its bytes: a stream fd and/or a file copy
+typedef struct {
+    int            out_fd;   // Stream consumer (stdout or FIFO), -1 if none
+    p2p_writer    *file;     // recv_<name> on disk, NULL if none
+    const char    *path;     // Its name, when a bundle may replace it with a tree
+    p2p_fetch     *fetch;    // Transfer feeding the sink, to spot a 'K' reply
+    p2p_unbundler *tree;     // Bundle being unpacked at 'path', NULL if none
+} FetchSink;
+
+// The first chunk of a bundle: the file copy becomes a directory tree. Only a
+// plain download can take one; a stream consumer expects a single file
+static int sink_start_bundle(FetchSink *sink) {
+    if (sink->out_fd >= 0 || !sink->path || !sink->file) {
+        fputs("Content is a bundle (a directory); fetch it with S instead.\n", stderr);
+        return -1;
+    }
+    (void)p2p_writer_close(sink->file);
+    sink->file = NULL;
+    remove(sink->path);
+    sink->tree = p2p_unbundle_open(sink->path);
+    if (!sink->tree) {
+        perror("mkdir(recv_*)");
+        return -1;
+    }
+    return 0;
+}
+
+// p2p_data_cb for FetchSink: forward the chunk to the stream, then the disk copy
+// A failed disk copy only aborts the transfer when it is the sole destination
+static int sink_write(void *arg, const char *data, size_t len) {
+    FetchSink *sink = (FetchSink *)arg;
+
+    if (!sink->tree && sink->fetch && p2p_fetch_is_bundle(sink->fetch) &&
+        sink_start_bundle(sink) < 0) {
+        return -1;
+    }
+    if (sink->tree) {
+        if (p2p_unbundle_cb(sink->tree, data, len) < 0) {
+            fputs("Malformed bundle or local write error; stopping.\n", stderr);
+            return -1;
+        }
+        return 0;
+    }
+    if (sink->out_fd >= 0 && write_all(sink->out_fd, data, len) < 0) {
+        perror("write(stream)");
+        return -1;
+    }
+    if (sink->file && p2p_writer_write(sink->file, data, len) < 0) {
+        perror("write(recv_*)");
+        if (sink->out_fd < 0) {
+            return -1;
+        }
+        (void)p2p_writer_close(sink->file);
+        sink->file = NULL;
+    }
+    return 0;
+}
+
+// One line of transfer telemetry: what TCP saw and which side set the pace
+static void print_tcp_stats(FILE *log, const p2p_tcp_info *ti, double app_share) {
+    uint32_t rtt = ti->rcv_rtt_us ? ti->rcv_rtt_us : ti->rtt_us;
+
+    fprintf(log, "TCP: RTT %.2f ms (min %.2f), %u retransmits, %u out of order, "
+                 "rcvbuf %d KiB, %.0f%% in disk writes; bottleneck: %s.\n",
+            rtt / 1000.0, ti->min_rtt_us / 1000.0, ti->retrans, ti->ooo_packets,
+            ti->rcvbuf >> 10, app_share * 100.0, p2p_tcp_bottleneck(ti, app_share, 0));
+}
+
+// Phase 2 of a fetch: download from the provider the index chose into 'sink'
+// Gives up if the provider sends nothing for 5 seconds. Returns 0 when the
+// whole content arrived, -1 otherwise (messages go to 'log')
+static int download_content(const Provider *prov, const char *content, FILE *log,
+                            FetchSink *sink, uint64_t *total) {
+    const PDU *ans;
+    p2p_fetch *f;
+    p2p_pipeline *pl;
+    p2p_data_cb cb;
+    p2p_tcp_info ti;
+    double app_share = 0.0;
+    int have_ti = 0;
+    void *arg;
+    int fd;
+    int rc;
+
+    fd = connect_provider(prov, log, &ans);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Pipelined mode: the socket loop only queues buffers, a disk thread drains them.
+    // Not for a stream sink: the ring holds bytes until a whole slot is full,
+    // and each chunk has to reach stdout or the FIFO as soon as it is read
+    pl = NULL;
+    if (g_pipelined && sink->out_fd < 0) {
+        pl = p2p_pipeline_writer(sink_write, sink);
+        if (!pl) {
+            perror("pthread_create"); // Fall back to writing from the socket loop
+        }
+    }
+
+    cb  = pl ? p2p_pipeline_cb : sink_write;
+    arg = pl ? (void *)pl : (void *)sink;
+
+    rc = P2P_ERR_BUNDLE;
+    if (g_background) {
+        // Yields to other traffic: UDP with delay-based congestion control
+        // (the race only picked the path; the bulk fetch sets up its own control)
+        close(fd);
+        fd = -1;
+        rc = p2p_bulk_fetch(ans, content, cb, arg, total);
+        if (rc == P2P_ERR_BUNDLE) {
+            fputs("Content is a bundle; fetching it over TCP instead.\n", log);
+            fd = connect_provider(prov, log, &ans);
+        }
+    }
+    if (rc == P2P_ERR_BUNDLE && fd >= 0) {
+        f = p2p_fetch_start_fd(fd, content, NULL, 0, cb, arg);
+        if (!f) {
+            perror("malloc");
+            close(fd);
+            (void)p2p_pipeline_close(pl);
+            return -1;
+        }
+        sink->fetch = f; // Consulted by sink_write(), so freed only after the disk stage
+        rc = p2p_fetch_run(f, 5000);
+        *total = p2p_fetch_bytes(f);
+    }
+    if (p2p_pipeline_close(pl) < 0 && rc == P2P_DONE) {
+        rc = P2P_ERR_ABORTED; // Disk stage failed after the network finished
+    }
+    if (sink->fetch) {
+        have_ti = p2p_fetch_tcp_info(sink->fetch, &ti, &app_share) == 0;
+        p2p_fetch_free(sink->fetch);
+        sink->fetch = NULL;
+    }
+    credit_add(ans, *total); // -s tft remembers who served us
+
+    if (rc == P2P_DONE && have_ti) {
+        print_tcp_stats(log, &ti, app_share);
+    } else if (rc == P2P_ERR_NOTFOUND) {
+        fputs("Content server reported: file not found.\n", log);
+    } else if (rc == P2P_ERR_PROTO) {
+        fputs("Unexpected header from content server.\n", log);
+    } else if (rc == P2P_ERR_IO) {
+        perror("read");
+    }
+    return rc == P2P_DONE ? 0 : -1;
+}
+
+// Phase 2 with -z: only the provider's data extents cross the network and the
+// holes are recreated here. Returns P2P_DONE or an error code, P2P_ERR_BUNDLE
+// when the content must come as one 'D' stream instead; *total is the file size
+static int download_sparse(const Provider *prov, const char *content, const char *outname,
+                           uint64_t *total) {
+    const PDU *ans;
+    uint64_t size = 0;
+    uint64_t data = 0;
+    int sock;
+    int fd;
+    int rc;
+
+    sock = connect_provider(prov, stdout, &ans);
+    if (sock < 0) {
+        return P2P_ERR_IO;
+    }
+    fd = open(outname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open(recv_*)");
+        close(sock);
+        return P2P_ERR_IO;
+    }
+    rc = p2p_sparse_fetch(sock, content, fd, &size, &data);
+    if (close(fd) < 0 && rc == P2P_DONE) {
+        perror("close(recv_*)");
+        rc = P2P_ERR_IO;
+    }
+    *total = rc == P2P_DONE ? size : data;
+    credit_add(ans, data);
+
+    if (rc == P2P_DONE) {
+        printf("Sparse transfer: %llu data bytes of %llu (holes kept as holes).\n",
+               (unsigned long long)data, (unsigned long long)size);
+    } else if (rc == P2P_ERR_NOTFOUND) {
+        puts("Content server reported: file not found.");
+    } else if (rc == P2P_ERR_PROTO) {
+        puts("Unexpected reply from content server (does it support sparse transfers?).");
+    } else if (rc == P2P_ERR_BUNDLE) {
+        puts("Content is a bundle; fetching it as one stream instead.");
+    } else {
+        printf("Download failed: %s\n", p2p_strerror(rc));
+    }
+    return rc;
+}
+
+// p2p_range_cb: ranges arrive out of order, so each lands at its own offset
+static int pwrite_range(void *arg, uint64_t off, const char *data, size_t len) {
+    int fd = *(int *)arg;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        off  += (uint64_t)n;
+        len  -= (size_t)n;
+    }
+    return 0;
+}
+
+// Phase 2 with -n: fetch 'content' as ranges over several TCP streams into 'outname'
+// Returns P2P_DONE or an error code, P2P_ERR_BUNDLE when the content must come
+// as one 'D' stream instead; *total holds the bytes written
+static int download_parallel(const Provider *prov, const char *content, const char *outname,
+                             uint64_t *total) {
+    const PDU *ans;
+    p2p_range_stats st;
+    int fd;
+    int rc;
+
+    // The race picks the path; the range streams then all use that address
+    fd = connect_provider(prov, stdout, &ans);
+    if (fd < 0) {
+        return P2P_ERR_IO;
+    }
+    close(fd);
+    printf("Fetching over up to %d parallel TCP streams ...\n", g_streams);
+
+    fd = open(outname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open(recv_*)");
+        return P2P_ERR_IO;
+    }
+    memset(&st, 0, sizeof(st));
+    rc = p2p_parallel_fetch(ans, content, g_streams, pwrite_range, &fd, &st);
+    if (close(fd) < 0 && rc == P2P_DONE) {
+        perror("close(recv_*)");
+        rc = P2P_ERR_IO;
+    }
+    *total = st.bytes;
+    credit_add(ans, st.bytes);
+
+    if (rc == P2P_DONE) {
+        printf("Used %d stream(s), %.1f MB/s (up to %d requests of %llu KiB queued, RTT %llu ms).\n",
+               st.streams, st.seconds > 0 ? (double)st.bytes / st.seconds / 1e6 : 0.0,
+               st.depth, (unsigned long long)(st.chunk >> 10), (unsigned long long)st.rtt_ms);
+        if (st.tcp.rcvbuf > 0) {
+            print_tcp_stats(stdout, &st.tcp, st.app_share);
+        }
+    } else if (rc == P2P_ERR_NOTFOUND) {
+        puts("Content server reported: file not found.");
+    } else if (rc == P2P_ERR_PROTO) {
+        puts("Unexpected header from content server.");
+    } else if (rc == P2P_ERR_BUNDLE) {
+        puts("Content is a bundle; fetching it as one stream instead.");
+    } else {
+        printf("Download failed: %s\n", p2p_strerror(rc));
+    }
+    return rc;
+}
+
+// Phase 2 with -t: ranges from as many providers and connections as it takes
+// to meet the goal, and no more. Returns P2P_DONE or an error code,
+// P2P_ERR_BUNDLE when the content must come as one 'D' stream instead
+static int download_target(const char *content, const char *outname, uint64_t *total) {
+    PDU src[MAX_SOURCES];
+    p2p_range_stats st;
+    int nsrc;
+    int fd;
+    int rc;
+    int i;
 
-    // Phase 2: Read requested content name (10 bytes, possibly padded)
-    if (read(cfd, namebuf, CONTENT_NAME_LEN) != CONTENT_NAME_LEN) {
-        close(cfd);
-        return;
+    nsrc = p2p_resolve_providers(&g_index, g_peer_name, content, src, MAX_SOURCES);
+    if (nsrc < 0) {
+        printf("Provider list failed: %s\n", p2p_strerror(nsrc));
+        return nsrc;
+    }
+    if (g_goal.seconds > 0.0) {
+        printf("Aiming to finish within %.1f s using up to %d provider(s) ...\n", g_goal.seconds, nsrc);
+    } else {
+        printf("Aiming for %.1f MB/s using up to %d provider(s) ...\n",
+               (double)g_goal.rate / 1e6, nsrc);
     }
 
-    // Extract null-terminated filename from fixed-width buffer
-    {
-        int k;
-        for (k = 0; k < CONTENT_NAME_LEN; ++k) {
-            if (namebuf[k] == '\0' || namebuf[k] == ' ')
-                break;
-            fname[k] = namebuf[k];
-        }
-        fname[k] = '\0';
+    fd = open(outname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open(recv_*)");
+        return P2P_ERR_IO;
+    }
+    memset(&st, 0, sizeof(st));
+    rc = p2p_target_fetch(src, nsrc, content, g_streams > 1 ? g_streams : MAX_SOURCES,
+                          &g_goal, pwrite_range, &fd, &st);
+    if (close(fd) < 0 && rc == P2P_DONE) {
+        perror("close(recv_*)");
+        rc = P2P_ERR_IO;
+    }
+    *total = st.bytes;
+    for (i = 0; i < nsrc && i < P2P_RANGE_SOURCES; ++i) {
+        credit_add(&src[i], st.src_bytes[i]); // -s tft: each provider for its share
     }
 
-    // Phase 3: Attempt to open requested file
-    fp = fopen(fname, "rb");
-    if (!fp) {
-        // File not found: send error response and close
-        typ = PDU_E;
-        (void)write(cfd, &typ, 1);
-        close(cfd);
-        return;
+    if (rc == P2P_DONE) {
+        double mbps = st.seconds > 0 ? (double)st.bytes / st.seconds / 1e6 : 0.0;
+        int met = (g_goal.seconds <= 0.0 || st.seconds <= g_goal.seconds) &&
+                  (g_goal.rate == 0 || mbps * 1e6 >= (double)g_goal.rate);
+        printf("Took %.1f s at %.1f MB/s from %d provider(s) over at most %d stream(s): goal %s.\n",
+               st.seconds, mbps, st.sources, st.streams, met ? "met" : "missed");
+    } else if (rc == P2P_ERR_NOTFOUND) {
+        puts("Content server reported: file not found.");
+    } else if (rc == P2P_ERR_PROTO) {
+        puts("Unexpected header from content server.");
+    } else if (rc == P2P_ERR_BUNDLE) {
+        puts("Content is a bundle; fetching it as one stream instead.");
+    } else {
+        printf("Download failed: %s\n", p2p_strerror(rc));
     }
+    return rc;
+}
 
-    // Phase 4: Send success header
-    typ = PDU_C;
-    (void)write(cfd, &typ, 1);
+// Phase 2 shortcut: when the provider runs on this machine, take the file over
+// a Unix socket and copy it in the kernel instead of through TCP loopback.
+// Only the primary address is tried: extra ones are often private bridge
+// addresses (172.17.0.1 ...) that this host may share with the provider's.
+// Returns P2P_ERR_NOTLOCAL when the network path should be used instead
+static int download_same_host(const Provider *prov, const char *content,
+                              const char *outname, uint64_t *total) {
+    int fd;
+    int rc;
 
-    // Phase 5: Stream file contents to requester
-    for (;;) {
-        n = fread(buf, 1, sizeof(buf), fp);
-        if (n == 0) break; // EOF reached
-        if (write(cfd, buf, n) < 0) break; // Connection closed
+    fd = open(outname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return P2P_ERR_NOTLOCAL; // The normal path reports the open error
+    }
+    rc = p2p_local_fetch(&prov->addr[0], content, fd, total);
+    if (close(fd) < 0 && rc == P2P_DONE) {
+        perror("close(recv_*)");
+        rc = P2P_ERR_IO;
     }
 
-    fclose(fp);
-    close(cfd);
+    if (rc == P2P_DONE) {
+        printf("Provider %s:%u is on this host: copied the file locally.\n",
+               prov->addr[0].ip, ntohs(prov->addr[0].port_net));
+        return rc;
+    }
+    // 'E' may come from an unrelated peer on this port: let TCP decide
+    if (rc != P2P_ERR_NOTLOCAL && rc != P2P_ERR_NOTFOUND) {
+        printf("Same-host copy failed (%s); using TCP instead.\n", p2p_strerror(rc));
+    }
+    remove(outname);
+    return P2P_ERR_NOTLOCAL;
 }
 
-// Menu action R: Register locally available content with the index server
-// Creates a TCP listener for downloads and notifies index of availability
-static void cmd_register_content(void) {
-    char content[CONTENT_NAME_LEN + 1];
-    char filename[128];
+// Phase 3 of a fetch: register this peer as a new provider of 'content'
+// (the downloaded copy is now served to others for load distribution)
+static void register_fetched_copy(const char *content) {
+    char myip[IP_STRLEN];
     uint16_t port;
     int listen_fd;
-    char myip[IP_STRLEN];
-    PDU r;
-    PDU ans;
+    int rc;
     int i;
 
-    memset(content, 0, sizeof(content));
-    memset(filename, 0, sizeof(filename));
-
-    // Step 1: Prompt user for content name
-    printf("Content tag (max %d chars): ", CONTENT_NAME_LEN);
-    if (scanf("%10s", content) != 1) {
-        puts("Invalid content name.");
-        drain_stdin_line();
-        return;
-    }
-    drain_stdin_line();
-
-    // Step 2: Prompt for local filename
-    printf("Filename on disk to share: ");
-    if (scanf("%127s", filename) != 1) {
-        puts("Invalid filename.");
-        drain_stdin_line();
-        return;
-    }
-    drain_stdin_line();
-
-    // Constraint: For simplicity, filename must match content name
-    if (strcmp(filename, content) != 0) {
-        puts("For this peer implementation, filename must equal the content name.");
-        return;
-    }
-
-    // Step 3: Create TCP listener for serving this content
     port = 0;
     listen_fd = open_content_listener(&port);
     if (listen_fd < 0) {
         return;
     }
 
-    // Step 4: Determine IP to advertise (manual override or auto-detect)
+    // Determine IP to advertise
     memset(myip, 0, sizeof(myip));
     if (g_advertise_ip[0] != '\0') {
-        // Use manually specified IP (for NAT scenarios)
         strncpy(myip, g_advertise_ip, IP_STRLEN - 1);
     } else {
-        // Auto-detect local IP via routing trick
         detect_local_ip(myip);
     }
 
-    // Step 5: Build registration PDU
-    init_pdu_clear(&r);
-    r.type = PDU_R;
-    fill_field_padded(r.peer,    sizeof(r.peer),    g_peer_name, PEER_NAME_LEN);
-    fill_field_padded(r.content, sizeof(r.content), content,     CONTENT_NAME_LEN);
-    fill_field_padded(r.ip,      sizeof(r.ip),      myip,        IP_STRLEN - 1);
-    r.port_net = htons(port);
-
-    // Step 6: Send registration to index and await acknowledgment
-    if (send_pdu_wait_reply(&r, &ans) == 0) {
-        if (ans.type == PDU_A) {
-            // Success: store in local table to handle future download requests
+    // Send auto-registration to index
+    rc = p2p_index_register(&g_index, g_peer_name, content, myip, port);
+    if (rc != P2P_ERR_IO && rc != P2P_ERR_TIMEOUT) {
+        if (rc == P2P_OK) {
+            // Success: add to local table to serve future requests
             for (i = 0; i < MAX_LISTEN; ++i) {
                 if (!local_[i].in_use) {
                     local_[i].in_use = 1;
@@ -343,27 +1586,24 @@ static void cmd_register_content(void) {
                     fill_field_padded(local_[i].content, sizeof(local_[i].content),
                               content, CONTENT_NAME_LEN);
                     local_[i].listen_fd = listen_fd;
-                    printf("Now serving '%s' from %s:%u (listener fd=%d)\n",
-                           content, myip, port, listen_fd);
+                    local_[i].local_fd  = p2p_local_listen(port);
+                    printf("[auto] Registered '%s' at %s:%u\n", content, myip, port);
+                    (void)advertise_extra_addresses(content, myip);
                     break;
                 }
             }
             if (i == MAX_LISTEN) {
-                puts("Local table full; closing listener.");
                 close(listen_fd);
             }
-        } else if (ans.type == PDU_E) {
-            // Index rejected (duplicate peer/content pair)
-            puts("Registration rejected by index: this peer name already registered that content.");
-            puts("Please choose a different peer name before registering this content.");
+        } else if (rc == P2P_ERR_NOTFOUND) {
+            puts("[auto] Registration rejected by index for this content/peer name.");
             close(listen_fd);
         } else {
-            puts("Registration failed (unexpected reply from index).");
+            puts("[auto] Registration failed (unexpected reply from index).");
             close(listen_fd);
         }
     } else {
-        // No response from index (timeout/network issue)
-        puts("Could not reach the index server (no UDP reply).");
+        puts("[auto] Could not reach the index server (no UDP reply).");
         close(listen_fd);
     }
 }
@@ -372,27 +1612,17 @@ static void cmd_register_content(void) {
 // Three-phase operation: query index → download from peer → become provider yourself
 static void cmd_search_and_fetch(void) {
     char content[CONTENT_NAME_LEN + 1];
-    PDU sreq;
-    PDU ans;
-    uint16_t tcp_port;
-    struct sockaddr_in a;
-    int cfd;
-    char padname[CONTENT_NAME_LEN];
-    char header;
+    Provider prov;
     char outname[64];
-    FILE *fp;
-    char buf[4096];
-    ssize_t n;
-    uint32_t total = 0;
-
-    PDU r;
-    PDU ack;
-    char myip[IP_STRLEN];
-    uint16_t port;
-    int listen_fd;
-    int i;
+    FetchSink sink;
+    uint64_t total = 0;
+    uint64_t files = 0;
+    int bundle = 0;
+    int ok;
+    int rc;
 
     memset(content, 0, sizeof(content));
+    memset(&sink, 0, sizeof(sink));
 
     // Step 1: Get content name from user
     printf("Type the content tag you want to look up and download: ");
@@ -404,184 +1634,178 @@ static void cmd_search_and_fetch(void) {
     drain_stdin_line();
 
     // Phase 1: Query index for content provider
-    init_pdu_clear(&sreq);
-    sreq.type = PDU_S;
-    fill_field_padded(sreq.peer,    sizeof(sreq.peer),    g_peer_name, PEER_NAME_LEN);
-    fill_field_padded(sreq.content, sizeof(sreq.content), content,     CONTENT_NAME_LEN);
-
-    if (send_pdu_wait_reply(&sreq, &ans) != 0) {
-        puts("No response from index (check IP/port).");
+    if (lookup_provider(content, &prov) != 0) {
         return;
     }
 
-    if (ans.type == PDU_E) {
-        puts("Content not found on any peer.");
-        return;
+    snprintf(outname, sizeof(outname), "recv_%s", content);
+
+    // Phase 2, in order of preference: same-host handover, data extents only
+    // (-z), ranges from enough providers to meet a goal (-t), ranges over
+    // several connections (-n), then a single stream through the chosen disk
+    // policy. A bundle (directory) always ends up on the last
+    rc = P2P_ERR_NOTLOCAL;
+    if (g_same_host && !g_background) {
+        rc = download_same_host(&prov, content, outname, &total);
     }
-    if (ans.type != PDU_S) {
-        puts("Unexpected response type from index.");
-        return;
+    if (rc == P2P_ERR_NOTLOCAL && g_sparse && !g_background) {
+        rc = download_sparse(&prov, content, outname, &total);
+    } else if (rc == P2P_ERR_NOTLOCAL && (g_goal.seconds > 0.0 || g_goal.rate) && !g_background) {
+        rc = download_target(content, outname, &total);
+    } else if (rc == P2P_ERR_NOTLOCAL && g_streams > 1 && !g_background) {
+        rc = download_parallel(&prov, content, outname, &total);
     }
+    if (rc != P2P_ERR_NOTLOCAL && rc != P2P_ERR_BUNDLE) {
+        ok = rc == P2P_DONE;
+    } else {
+        // Open local file to save downloaded content
+        sink.out_fd = -1;
+        sink.path   = outname;
+        sink.file   = p2p_writer_open(outname, g_write_mode);
+        if (!sink.file) {
+            perror("open(recv_*)");
+            return;
+        }
 
-    // Phase 2: Connect to provider and download content via TCP
-    memset(&a, 0, sizeof(a));
-    a.sin_family = AF_INET;
-    a.sin_port   = ans.port_net; // Already in network byte order
-    if (inet_aton(ans.ip, &a.sin_addr) == 0) {
-        puts("Bad IP address from index.");
-        return;
+        // Connect to provider and download content via TCP
+        total = 0;
+        ok = download_content(&prov, content, stdout, &sink, &total) == 0;
+        if (sink.file && p2p_writer_close(sink.file) < 0) {
+            perror("close(recv_*)");
+            ok = 0;
+        }
+        if (sink.tree) {
+            bundle = 1;
+            if (p2p_unbundle_close(sink.tree, &files) < 0) {
+                puts("Bundle incomplete: some files may be missing or truncated.");
+                ok = 0;
+            }
+        }
     }
-
-    tcp_port = ntohs(ans.port_net);
-    printf("Index chose provider %s:%u for this download\n", ans.ip, tcp_port);
-    printf("Opening TCP connection to provider %s:%u ...\n", ans.ip, tcp_port);
-
-    // Create TCP socket and connect to content provider
-    cfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (cfd < 0) {
-        perror("socket(TCP)");
+    if (!ok && total == 0) {
+        remove(outname); // Nothing arrived; don't leave an empty copy behind
         return;
     }
 
-    if (connect(cfd, (struct sockaddr *)&a, sizeof(a)) < 0) {
-        perror("connect");
-        close(cfd);
-        return;
+    if (bundle) {
+        printf("Finished download: bundle of %llu file(s), %llu bytes, unpacked under '%s/'.\n",
+               (unsigned long long)files, (unsigned long long)total, outname);
+    } else {
+        printf("Finished download: %llu bytes saved as '%s'.\n",
+               (unsigned long long)total, outname);
     }
-    // Set a 5-second receive timeout on the TCP socket
-    // If no data is received for 5 seconds, reads will fail with EAGAIN/EWOULDBLOCK.
-    {
-        struct timeval tv;
-        tv.tv_sec = 5;
-        tv.tv_usec = 0;
-        if (setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-            perror("setsockopt(SO_RCVTIMEO)");
-            // Can still try downloading without the timeout
-        }
+    if (total == 0) {
+        puts("Warning: downloaded 0 bytes – check that the server file is non-empty.");
     }
 
-    // Send download request: 'D' + content_name
-    header = PDU_D;
-    if (write(cfd, &header, 1) != 1) {
-        perror("write(D)");
-        close(cfd);
-        return;
+    // Phase 3: Auto-register as content provider for load distribution
+    if (ok) {
+        register_fetched_copy(content);
     }
+}
 
-    // Send content name (zero-padded to CONTENT_NAME_LEN)
-    memset(padname, 0, sizeof(padname));
-    memcpy(padname, content,
-           strlen(content) < CONTENT_NAME_LEN ? strlen(content) : CONTENT_NAME_LEN);
-
-    if (write(cfd, padname, CONTENT_NAME_LEN) != CONTENT_NAME_LEN) {
-        perror("write(name)");
-        close(cfd);
-        return;
-    }
+// Menu action F: Fetch content and stream it to stdout or a named pipe as it arrives
+// Each chunk is forwarded as soon as it is read, so a consumer (decompressor, loader)
+// overlaps with the network transfer; optionally tee a copy to recv_<name> for serving
+static void cmd_stream_fetch(void) {
+    char content[CONTENT_NAME_LEN + 1];
+    char dest[128];
+    char answer[8];
+    Provider prov;
+    int keep_copy;
+    FILE *log;
+    char outname[64];
+    FetchSink sink;
+    uint64_t total = 0;
+    int ok;
 
-    // Read response header from server
-    if (read(cfd, &header, 1) != 1) {
-        puts("No header from content server.");
-        close(cfd);
-        return;
-    }
+    memset(content, 0, sizeof(content));
+    memset(dest, 0, sizeof(dest));
+    memset(answer, 0, sizeof(answer));
+    memset(&sink, 0, sizeof(sink));
 
-    if (header == PDU_E) {
-        puts("Content server reported: file not found.");
-        close(cfd);
+    // Step 1: Get content name, destination and tee choice from user
+    printf("Type the content tag you want to stream: ");
+    if (scanf("%10s", content) != 1) {
+        puts("Invalid content name.");
+        drain_stdin_line();
         return;
     }
+    drain_stdin_line();
 
-    if (header != PDU_C) {
-        puts("Unexpected header from content server.");
-        close(cfd);
+    printf("Stream destination ('-' for stdout, or a named pipe path): ");
+    if (scanf("%127s", dest) != 1) {
+        puts("Invalid destination.");
+        drain_stdin_line();
         return;
     }
+    drain_stdin_line();
 
-    // Open local file to save downloaded content
-    snprintf(outname, sizeof(outname), "recv_%s", content);
-    fp = fopen(outname, "wb");
-    if (!fp) {
-        perror("fopen(recv_*)");
-        close(cfd);
-        return;
+    printf("Also keep a copy on disk and serve it afterwards? (y/n): ");
+    if (scanf("%7s", answer) != 1) {
+        answer[0] = 'n';
     }
-
-    // Stream content from TCP connection to local file
-    for (;;) {
-        n = read(cfd, buf, sizeof(buf));
-        if (n < 0) {
-            perror("read");
-            break;
+    drain_stdin_line();
+    keep_copy = (answer[0] == 'y' || answer[0] == 'Y');
+
+    // Step 2: Open the sink before contacting the provider; a FIFO open blocks
+    // until the consumer attaches, so the transfer never waits on a missing reader
+    if (strcmp(dest, "-") == 0) {
+        fflush(stdout);
+        sink.out_fd = STDOUT_FILENO;
+        log = stderr; // Keep status text out of the data stream
+    } else {
+        struct stat st;
+        if (stat(dest, &st) < 0) {
+            if (mkfifo(dest, 0600) < 0) {
+                perror("mkfifo");
+                return;
+            }
+        } else if (!S_ISFIFO(st.st_mode)) {
+            printf("'%s' exists and is not a named pipe.\n", dest);
+            return;
         }
-        if (n == 0) break; // EOF
-        if (fwrite(buf, 1, (size_t)n, fp) != (size_t)n) {
-            perror("fwrite");
-            break;
+        printf("Waiting for a reader to open %s ...\n", dest);
+        fflush(stdout);
+        sink.out_fd = open(dest, O_WRONLY);
+        if (sink.out_fd < 0) {
+            perror("open(fifo)");
+            return;
         }
-        total += (uint32_t)n;
-    }
-
-    fclose(fp);
-    close(cfd);
-
-    printf("Finished download: %u bytes saved as '%s'.\n", total, outname);
-    if (total == 0) {
-        puts("Warning: downloaded 0 bytes – check that the server file is non-empty.");
+        log = stdout;
     }
 
-    // Phase 3: Auto-register as content provider for load distribution
-    port = 0;
-    listen_fd = open_content_listener(&port);
-    if (listen_fd < 0) {
+    // Phase 1: Locate a provider
+    if (lookup_provider(content, &prov) != 0) {
+        if (sink.out_fd != STDOUT_FILENO) close(sink.out_fd);
         return;
     }
 
-    // Determine IP to advertise
-    memset(myip, 0, sizeof(myip));
-    if (g_advertise_ip[0] != '\0') {
-        strncpy(myip, g_advertise_ip, IP_STRLEN - 1);
-    } else {
-        detect_local_ip(myip);
+    sink.file = NULL;
+    if (keep_copy) {
+        snprintf(outname, sizeof(outname), "recv_%s", content);
+        sink.file = p2p_writer_open(outname, g_write_mode);
+        if (!sink.file) {
+            perror("open(recv_*)"); // Keep streaming even without the disk copy
+        }
     }
 
-    // Build auto-registration PDU
-    init_pdu_clear(&r);
-    r.type = PDU_R;
-    fill_field_padded(r.peer,    sizeof(r.peer),    g_peer_name, PEER_NAME_LEN);
-    fill_field_padded(r.content, sizeof(r.content), content,     CONTENT_NAME_LEN);
-    fill_field_padded(r.ip,      sizeof(r.ip),      myip,        IP_STRLEN - 1);
-    r.port_net = htons(port);
+    // Phase 2: Every chunk goes to the consumer immediately, in arrival order
+    ok = download_content(&prov, content, log, &sink, &total) == 0;
+    if (sink.out_fd != STDOUT_FILENO) close(sink.out_fd);
 
-    // Send auto-registration to index
-    if (send_pdu_wait_reply(&r, &ack) == 0) {
-        if (ack.type == PDU_A) {
-            // Success: add to local table to serve future requests
-            for (i = 0; i < MAX_LISTEN; ++i) {
-                if (!local_[i].in_use) {
-                    local_[i].in_use = 1;
-                    fill_field_padded(local_[i].peer,    sizeof(local_[i].peer),
-                              g_peer_name, PEER_NAME_LEN);
-                    fill_field_padded(local_[i].content, sizeof(local_[i].content),
-                              content, CONTENT_NAME_LEN);
-                    local_[i].listen_fd = listen_fd;
-                    printf("[auto] Registered '%s' at %s:%u\n", content, myip, port);
-                    break;
-                }
-            }
-            if (i == MAX_LISTEN) {
-                close(listen_fd);
-            }
-        } else if (ack.type == PDU_E) {
-            puts("[auto] Registration rejected by index for this content/peer name.");
-            close(listen_fd);
-        } else {
-            puts("[auto] Registration failed (unexpected reply from index).");
-            close(listen_fd);
+    fprintf(log, "Finished stream: %llu bytes delivered to '%s'.\n",
+            (unsigned long long)total, dest);
+
+    // Phase 3: Only a complete on-disk copy can be served to other peers
+    if (sink.file) {
+        if (p2p_writer_close(sink.file) < 0) {
+            perror("close(recv_*)");
+            ok = 0;
+        }
+        if (ok) {
+            register_fetched_copy(content);
         }
-    } else {
-        puts("[auto] Could not reach the index server (no UDP reply).");
-        close(listen_fd);
     }
 }
 
@@ -589,8 +1813,6 @@ static void cmd_search_and_fetch(void) {
 // Removes entry from both index server and local table
 static void cmd_deregister_content(void) {
     char content[CONTENT_NAME_LEN + 1];
-    PDU t;
-    PDU ans;
     int i;
 
     memset(content, 0, sizeof(content));
@@ -617,18 +1839,16 @@ static void cmd_deregister_content(void) {
         return;
     }
 
-    // Step 3: Build deregistration PDU
-    init_pdu_clear(&t);
-    t.type = PDU_T;
-    fill_field_padded(t.peer,    sizeof(t.peer),    g_peer_name, PEER_NAME_LEN);
-    fill_field_padded(t.content, sizeof(t.content), content,     CONTENT_NAME_LEN);
-
-    // Step 4: Send deregistration request to index
-    if (send_pdu_wait_reply(&t, &ans) == 0 && ans.type == PDU_A) {
+    // Step 3: Send deregistration request to index
+    if (p2p_index_deregister(&g_index, g_peer_name, content) == P2P_OK) {
         printf("Deregistered '%s' from index.\n", content);
         // Clean up: close TCP listener and free table slot
         close(local_[i].listen_fd);
         local_[i].listen_fd = -1;
+        if (local_[i].local_fd >= 0) {
+            close(local_[i].local_fd);
+        }
+        local_[i].local_fd = -1;
         local_[i].in_use = 0;
     } else {
         puts("Deregister failed (index did not ack).");
@@ -645,11 +1865,11 @@ static void cmd_show_online(void) {
     printf("Catalogue reported by index (one line per active entry):\n");
 
     // Step 1: Send list request to index
-    init_pdu_clear(&o);
+    memset(&o, 0, sizeof(o));
     o.type = PDU_O;
 
-    n = sendto(udp_fd, &o, sizeof(o), 0,
-               (struct sockaddr *)&idx_addr, sizeof(idx_addr));
+    n = sendto(g_index.fd, &o, sizeof(o), 0,
+               (struct sockaddr *)&g_index.addr, sizeof(g_index.addr));
     if (n != (ssize_t)sizeof(o)) {
         perror("send(O)");
         return;
@@ -657,7 +1877,7 @@ static void cmd_show_online(void) {
 
     // Step 2: Receive and display content entries until terminator
     for (;;) {
-        n = recvfrom(udp_fd, &row, sizeof(row), 0, NULL, NULL);
+        n = recvfrom(g_index.fd, &row, sizeof(row), 0, NULL, NULL);
         if (n != (ssize_t)sizeof(row)) {
             fprintf(stderr, "Short/long O row (%ld bytes)\n", (long)n);
             return;
@@ -685,36 +1905,127 @@ static void show_peer_menu(void) {
     printf("\n=== P2P Peer Console ===\n");
     printf("R : Share a local file with the network\n");
     printf("S : Locate a file and fetch it from another peer\n");
+    printf("F : Stream a file to stdout or a named pipe as it downloads\n");
     printf("O : Show the index's list of advertised content\n");
     printf("T : Stop sharing one advertised file\n");
     printf("Q : Remove everything you share and exit\n");
-    printf("Select option (R/S/O/T/Q): ");
+    printf("Select option (R/S/F/O/T/Q): ");
     fflush(stdout);
 }
 
+// Print command-line syntax to stderr
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-b] [-L] [-n streams] [-p] [-s fair|srpt|tft] [-t secs|MB/s] [-w buffered|direct|behind] [-z] <index_ip> <index_udp_port> [advertise_ip[,ip...]]\n",
+            prog);
+}
+
 // Main entry point: parse arguments, initialize UDP channel, run event loop
 int main(int argc, char *argv[]) {
     int i;
     char line[32];
     fd_set rfds;
+    fd_set wfds;
+    struct timeval tv;
+    struct timeval *timeout;
     int maxfd;
-
-    // Validate command-line arguments
-    if (argc < 3 || argc > 4) {
-        fprintf(stderr,
-                "Usage: %s <index_ip> <index_udp_port> [advertise_ip]\n",
-                argv[0]);
+    int opt;
+    int pick;
+    int prompt = 1;
+
+    // Parse options, then validate positional arguments
+    while ((opt = getopt(argc, argv, "bLn:ps:t:w:z")) != -1) {
+        switch (opt) {
+        case 'b':
+            // Downloads become background transfers that back off under contention
+            g_background = 1;
+            break;
+        case 'L':
+            // Always go through the network, even to a provider on this host
+            g_same_host = 0;
+            break;
+        case 'n':
+            // High bandwidth-delay paths: split downloads over up to N TCP streams
+            g_streams = atoi(optarg);
+            if (g_streams < 1) {
+                fprintf(stderr, "Bad stream count '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            // Decouple disk and network: each transfer gets its own disk thread
+            g_pipelined = 1;
+            break;
+        case 's':
+            // Upload order: fair round-robin, shortest remaining transfer first,
+            // or reciprocity (tit-for-tat)
+            if (strcmp(optarg, "fair") == 0)      g_sched = SCHED_FAIR;
+            else if (strcmp(optarg, "srpt") == 0) g_sched = SCHED_SRPT;
+            else if (strcmp(optarg, "tft") == 0)  g_sched = SCHED_TFT;
+            else {
+                fprintf(stderr, "Unknown upload scheduler '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 't': {
+            // Deadline ("30s") or throughput ("40MB/s") downloads should meet
+            char *end;
+            double v = strtod(optarg, &end);
+            if (v > 0 && strcmp(end, "s") == 0) {
+                g_goal.seconds = v;
+            } else if (v > 0 && (strcmp(end, "MB/s") == 0 || strcmp(end, "M") == 0)) {
+                g_goal.rate = (uint64_t)(v * 1e6);
+            } else {
+                fprintf(stderr, "Bad goal '%s' (e.g. 30s or 40MB/s)\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'w':
+            // Disk policy for downloads: keep big transfers out of the page cache
+            if (strcmp(optarg, "buffered") == 0)    g_write_mode = P2P_WRITE_BUFFERED;
+            else if (strcmp(optarg, "direct") == 0) g_write_mode = P2P_WRITE_DIRECT;
+            else if (strcmp(optarg, "behind") == 0) g_write_mode = P2P_WRITE_BEHIND;
+            else {
+                fprintf(stderr, "Unknown write mode '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'z':
+            // Mostly-empty images: skip the holes instead of sending zeros
+            g_sparse = 1;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 2 || argc - optind > 3) {
+        print_usage(argv[0]);
         return 1;
     }
+    // Shift so argv[1..3] are the positional arguments again
+    argc -= optind - 1;
+    argv += optind - 1;
 
     // Initialize global state
     memset(g_peer_name, 0, sizeof(g_peer_name));
     memset(g_advertise_ip, 0, sizeof(g_advertise_ip));
     memset(local_, 0, sizeof(local_));
 
-    // Optional: use manually specified IP for NAT scenarios
+    // A stream consumer or downloader that disconnects must not kill the peer
+    signal(SIGPIPE, SIG_IGN);
+
+    // Optional: manually specified IP(s) for NAT or multi-homed hosts,
+    // comma-separated with the preferred address first
     if (argc == 4) {
-        strncpy(g_advertise_ip, argv[3], IP_STRLEN - 1);
+        char *tok = strtok(argv[3], ",");
+        if (tok) {
+            strncpy(g_advertise_ip, tok, IP_STRLEN - 1);
+        }
+        while ((tok = strtok(NULL, ",")) != NULL && g_n_extra < P2P_MAX_ADDRS - 1) {
+            strncpy(g_extra_ips[g_n_extra++], tok, IP_STRLEN - 1);
+        }
     }
 
     // Prompt for peer identifier (used in all registrations)
@@ -726,33 +2037,31 @@ int main(int argc, char *argv[]) {
     }
     drain_stdin_line();
 
-    // Create UDP socket for index communication
-    udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (udp_fd < 0) {
-        perror("socket(UDP)");
-        return 1;
-    }
-
-    // Parse and store index server address
-    memset(&idx_addr, 0, sizeof(idx_addr));
-    idx_addr.sin_family = AF_INET;
-    idx_addr.sin_port   = htons((uint16_t)atoi(argv[2]));
-    if (inet_aton(argv[1], &idx_addr.sin_addr) == 0) {
-        fprintf(stderr, "Bad index IP address: %s\n", argv[1]);
-        close(udp_fd);
+    // Create UDP socket for index communication and store index server address
+    if (p2p_index_open(&g_index, argv[1], (uint16_t)atoi(argv[2])) != P2P_OK) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "Bad index IP address: %s\n", argv[1]);
+        } else {
+            perror("socket(UDP)");
+        }
         return 1;
     }
 
     printf("Peer '%s' is up. Talking to index at %s:%s\n",
            g_peer_name, argv[1], argv[2]);
 
-    // Main event loop: multiplex between user input and incoming download requests
+    // Main event loop: multiplex between user input, incoming download requests
+    // and the uploads in progress
     for (;;) {
         int ready;
-        show_peer_menu();
+        if (prompt) {
+            show_peer_menu(); // Only after user input, not on every upload wakeup
+            prompt = 0;
+        }
 
-        // Build file descriptor set: stdin + all active TCP listeners
+        // Build file descriptor sets: stdin + all active TCP listeners + uploads
         FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
         FD_SET(STDIN_FILENO, &rfds);
         maxfd = STDIN_FILENO;
 
@@ -764,10 +2073,64 @@ int main(int argc, char *argv[]) {
                     maxfd = local_[i].listen_fd;
                 }
             }
+            if (local_[i].in_use && local_[i].local_fd >= 0) {
+                FD_SET(local_[i].local_fd, &rfds);
+                if (local_[i].local_fd > maxfd) {
+                    maxfd = local_[i].local_fd;
+                }
+            }
+        }
+        for (i = 0; i < MAX_LOCAL_REQS; ++i) {
+            if (local_reqs_[i].in_use) {
+                FD_SET(local_reqs_[i].sock, &rfds);
+                if (local_reqs_[i].sock > maxfd) {
+                    maxfd = local_reqs_[i].sock;
+                }
+            }
+        }
+
+        // Uploads wait for their next request or for room in the socket buffer.
+        // Only uploads allowed to send are waited for: under SRPT the one
+        // picked among those with room (all of them if none has), under TFT
+        // the unchoked ones. A writable socket left out would wake select at
+        // once on every pass; instead the wait ends when the choice may
+        // change (keys age, the unchoked set is recomputed)
+        timeout = NULL;
+        pick = g_sched == SCHED_SRPT ? upload_pick_srpt_now() : -1;
+        if (g_sched == SCHED_TFT) {
+            tft_rechoke();
+        }
+        for (i = 0; i < MAX_UPLOADS; ++i) {
+            if (!uploads_[i].in_use) {
+                continue;
+            }
+            if (!uploads_[i].sending) {
+                FD_SET(uploads_[i].sock, &rfds);
+            } else if (uploads_[i].pl_wait) {
+                int efd = p2p_pipeline_fd(uploads_[i].pl);
+                FD_SET(efd, &rfds);
+                if (efd > maxfd) {
+                    maxfd = efd;
+                }
+            } else if (g_sched == SCHED_SRPT && pick >= 0 && i != pick) {
+                tv.tv_sec  = 0;
+                tv.tv_usec = SRPT_AGE_MS * 1000;
+                timeout = &tv;
+            } else if (g_sched != SCHED_TFT || tft_is_unchoked(uploads_[i].cli.sin_addr)) {
+                FD_SET(uploads_[i].sock, &wfds);
+            } else if (!timeout) {
+                uint64_t wait = tft_wait_ms();
+                tv.tv_sec  = (time_t)(wait / 1000);
+                tv.tv_usec = (suseconds_t)(wait % 1000) * 1000;
+                timeout = &tv;
+            }
+            if (uploads_[i].sock > maxfd) {
+                maxfd = uploads_[i].sock;
+            }
         }
 
-        // Block until stdin or a TCP listener has activity
-        ready = select(maxfd + 1, &rfds, NULL, NULL, NULL);
+        // Block until stdin, a TCP listener or an upload has activity
+        ready = select(maxfd + 1, &rfds, &wfds, NULL, timeout);
         if (ready < 0) {
             perror("select");
             break;
@@ -780,12 +2143,13 @@ int main(int argc, char *argv[]) {
                 break;
             }
 
-            if (line[0] == '\n' || line[0] == '\0') {
-                continue; // Blank line: redisplay menu
-            }
+            prompt = 1;
 
-            // Dispatch menu command
+            // Dispatch menu command (blank line: just redisplay menu)
             switch (line[0]) {
+            case '\n':
+            case '\0':
+                break;
             case 'R':
             case 'r':
                 cmd_register_content();
@@ -794,6 +2158,10 @@ int main(int argc, char *argv[]) {
             case 's':
                 cmd_search_and_fetch();
                 break;
+            case 'F':
+            case 'f':
+                cmd_stream_fetch();
+                break;
             case 'O':
             case 'o':
                 cmd_show_online();
@@ -807,23 +2175,21 @@ int main(int argc, char *argv[]) {
                 // Graceful shutdown: deregister all content before exit
                 for (i = 0; i < MAX_LISTEN; ++i) {
                     if (local_[i].in_use) {
-                        PDU t;
-                        PDU ans;
-                        init_pdu_clear(&t);
-                        t.type = PDU_T;
-                        fill_field_padded(t.peer,    sizeof(t.peer),    g_peer_name, PEER_NAME_LEN);
-                        fill_field_padded(t.content, sizeof(t.content),
-                                  local_[i].content, CONTENT_NAME_LEN);
-                        (void)send_pdu_wait_reply(&t, &ans); // Best-effort deregister
+                        // Best-effort deregister
+                        (void)p2p_index_deregister(&g_index, g_peer_name, local_[i].content);
                         if (local_[i].listen_fd >= 0) {
                             close(local_[i].listen_fd);
                         }
+                        if (local_[i].local_fd >= 0) {
+                            close(local_[i].local_fd);
+                        }
                         local_[i].listen_fd = -1;
+                        local_[i].local_fd  = -1;
                         local_[i].in_use = 0;
                     }
                 }
                 printf("Shutting down peer and deregistering any remaining content.\n");
-                close(udp_fd);
+                p2p_index_close(&g_index);
                 return 0;
             default:
                 puts("Unknown choice.");
@@ -836,12 +2202,46 @@ int main(int argc, char *argv[]) {
             if (local_[i].in_use &&
                 local_[i].listen_fd >= 0 &&
                 FD_ISSET(local_[i].listen_fd, &rfds)) { // Incoming request
-                handle_single_download(local_[i].listen_fd); // Handle one download
+                accept_upload(local_[i].listen_fd);
+            }
+            if (local_[i].in_use &&
+                local_[i].local_fd >= 0 &&
+                FD_ISSET(local_[i].local_fd, &rfds)) { // Same-host request
+                accept_local(local_[i].local_fd);
+            }
+        }
+        for (i = 0; i < MAX_LOCAL_REQS; ++i) {
+            if (local_reqs_[i].in_use && FD_ISSET(local_reqs_[i].sock, &rfds)) {
+                read_local_request(&local_reqs_[i]);
+            }
+        }
+
+        // Advance every upload that is ready (slots accepted above wait a round).
+        // Only uploads allowed to send are in wfds: under SRPT the others get
+        // later passes once the pick's socket buffer is full or their aged key
+        // wins; under TFT choked ones keep their connection and wait
+        if (g_sched == SCHED_SRPT && pick < 0) {
+            pick = upload_pick_srpt(&wfds); // Woken by the first socket with room
+        }
+        for (i = 0; i < MAX_UPLOADS; ++i) {
+            if (!uploads_[i].in_use) {
+                continue;
+            }
+            if (uploads_[i].pl_wait) {
+                if (FD_ISSET(p2p_pipeline_fd(uploads_[i].pl), &rfds)) {
+                    uploads_[i].pl_wait = 0; // Data read ahead: back to the socket next pass
+                }
+            } else if (uploads_[i].sending && FD_ISSET(uploads_[i].sock, &wfds)) {
+                if (g_sched != SCHED_SRPT || i == pick) {
+                    upload_on_writable(&uploads_[i]);
+                }
+            } else if (!uploads_[i].sending && FD_ISSET(uploads_[i].sock, &rfds)) {
+                upload_on_readable(&uploads_[i]);
             }
         }
     }
 
     // Clean up on abnormal exit
-    close(udp_fd);
+    p2p_index_close(&g_index);
     return 0;
 }
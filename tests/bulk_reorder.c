@@ -0,0 +1,199 @@
+// Loopback check for background transfers (p2p_ledbat.c) over an emulated
+// bottleneck. A UDP shim between p2p_bulk_send() and p2p_bulk_fetch() limits
+// the data rate, adds random delay (which reorders datagrams in both
+// directions) and drops a share of data and acks. The transfer must complete
+// with every byte intact within the time limit; exit status 0 means it did.
+//
+//   gcc -pthread -I. tests/bulk_reorder.c p2p_*.c -o bulk_reorder
+//   ./bulk_reorder [MB=4] [rate_MBps=10] [jitter_ms=5] [loss_pct=2] [seed=1] [limit_s=60]
+#include "p2p_client.h"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHIM_QUEUE 8192  // Datagrams held at once
+
+typedef struct {
+    uint64_t           at;    // Release time in us
+    struct sockaddr_in to;
+    size_t             len;
+    char               buf[1500];
+} Held;
+
+static uint64_t size_;
+static double   rate_;        // Bytes per us through the bottleneck (data only)
+static unsigned jitter_us_;
+static unsigned loss_pct_;
+static int      shim_;        // The shim's UDP socket
+static struct sockaddr_in receiver_;
+static char    *data_;
+static int      tcp_;
+static Held     held_[SHIM_QUEUE];
+static int      n_held_;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+// Forward datagrams between the sender and receiver_, through the bottleneck
+static void *shim_main(void *arg) {
+    struct sockaddr_in sender, from;
+    int have_sender = 0;
+    uint64_t link_free = 0;  // When the bottleneck finishes the last data datagram
+    (void)arg;
+
+    for (;;) {
+        uint64_t now = now_us(), next = now + 100000;
+        for (int i = 0; i < n_held_; ) {
+            if (held_[i].at <= now) {
+                (void)sendto(shim_, held_[i].buf, held_[i].len, 0,
+                             (struct sockaddr *)&held_[i].to, sizeof(held_[i].to));
+                held_[i] = held_[--n_held_];
+                continue;
+            }
+            if (held_[i].at < next) next = held_[i].at;
+            ++i;
+        }
+        struct pollfd p = { shim_, POLLIN, 0 };
+        if (poll(&p, 1, (int)((next - now + 999) / 1000)) <= 0) continue;
+
+        Held *h = &held_[n_held_];
+        socklen_t fl = sizeof(from);
+        ssize_t n = recvfrom(shim_, h->buf, sizeof(h->buf), 0, (struct sockaddr *)&from, &fl);
+        if (n <= 0 || n_held_ == SHIM_QUEUE) continue;
+        int from_receiver = from.sin_port == receiver_.sin_port;
+        if (!from_receiver && !have_sender) {
+            sender = from;
+            have_sender = 1;
+        }
+        if (from_receiver && !have_sender) continue;
+        if ((unsigned)rand() % 100 < loss_pct_) continue;
+
+        now = now_us();
+        h->len = (size_t)n;
+        h->to  = from_receiver ? sender : receiver_;
+        h->at  = now + (jitter_us_ ? (unsigned)rand() % jitter_us_ : 0);
+        if (!from_receiver) {
+            link_free = (link_free > now ? link_free : now) + (uint64_t)((double)n / rate_);
+            h->at += link_free - now;
+        }
+        n_held_++;
+    }
+    return NULL;
+}
+
+// Provider side: answer one 'B' request, sending through the shim
+static void *provider_main(void *arg) {
+    char req[1 + CONTENT_NAME_LEN + 2];
+    unsigned char hdr[9];
+    struct sockaddr_in a;
+    socklen_t al = sizeof(a);
+    (void)arg;
+
+    int ctl = accept(tcp_, NULL, NULL);
+    if (ctl < 0 || recv(ctl, req, sizeof(req), MSG_WAITALL) != (ssize_t)sizeof(req)) return NULL;
+    memset(&receiver_, 0, sizeof(receiver_));
+    receiver_.sin_family      = AF_INET;
+    receiver_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    memcpy(&receiver_.sin_port, req + 1 + CONTENT_NAME_LEN, 2);
+
+    char path[] = "/tmp/bulk_reorderXXXXXX";
+    int fd = mkstemp(path);
+    unlink(path);
+    if (fd < 0 || write(fd, data_, size_) != (ssize_t)size_) return NULL;
+    hdr[0] = PDU_C;
+    p2p_put_be64(hdr + 1, size_);
+    if (write(ctl, hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) return NULL;
+
+    getsockname(shim_, (struct sockaddr *)&a, &al);
+    // Fails when the receiver has everything and closes before the last acks
+    // get through the shim; only the receiver's result counts
+    (void)p2p_bulk_send(ctl, fd, size_, &a);
+    close(fd);
+    close(ctl);
+    return NULL;
+}
+
+// A stalled transfer can keep both ends busy with retransmissions forever
+static void *watchdog_main(void *arg) {
+    sleep(*(unsigned *)arg);
+    printf("FAIL: no result after %u s\n", *(unsigned *)arg);
+    exit(1);
+}
+
+typedef struct {
+    uint64_t got;
+    int      bad;
+} Check;
+
+static int check_cb(void *arg, const char *buf, size_t len) {
+    Check *c = arg;
+    if (c->got + len > size_ || memcmp(data_ + c->got, buf, len) != 0) c->bad = 1;
+    c->got += len;
+    return 0;
+}
+
+static int listen_on(int type, struct sockaddr_in *a) {
+    socklen_t al = sizeof(*a);
+    int s = socket(AF_INET, type, 0);
+    memset(a, 0, sizeof(*a));
+    a->sin_family      = AF_INET;
+    a->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (s < 0 || bind(s, (struct sockaddr *)a, sizeof(*a)) < 0 ||
+        (type == SOCK_STREAM && listen(s, 1) < 0) || getsockname(s, (struct sockaddr *)a, &al) < 0) {
+        perror("socket");
+        exit(2);
+    }
+    return s;
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_in a;
+    pthread_t th;
+    PDU prov;
+    Check c = { 0, 0 };
+    uint64_t total = 0;
+    unsigned limit;
+
+    size_      = (uint64_t)((argc > 1 ? atof(argv[1]) : 4) * 1e6);
+    rate_      = (argc > 2 ? atof(argv[2]) : 10.0);
+    jitter_us_ = (unsigned)((argc > 3 ? atof(argv[3]) : 5.0) * 1000);
+    loss_pct_  = (unsigned)(argc > 4 ? atoi(argv[4]) : 2);
+    srand((unsigned)(argc > 5 ? atoi(argv[5]) : 1));
+    limit      = (unsigned)(argc > 6 ? atoi(argv[6]) : 60);
+
+    data_ = malloc(size_);
+    if (!data_) return 2;
+    for (uint64_t i = 0; i < size_; ++i) data_[i] = (char)rand();
+
+    shim_ = listen_on(SOCK_DGRAM, &a);
+    tcp_  = listen_on(SOCK_STREAM, &a);
+    memset(&prov, 0, sizeof(prov));
+    strcpy(prov.ip, "127.0.0.1");
+    prov.port_net = a.sin_port;
+    pthread_create(&th, NULL, provider_main, NULL);
+    pthread_detach(th);
+    pthread_create(&th, NULL, shim_main, NULL);
+    pthread_detach(th);
+    pthread_create(&th, NULL, watchdog_main, &limit);
+    pthread_detach(th);
+
+    uint64_t t0 = now_us();
+    int rc = p2p_bulk_fetch(&prov, "bulk", check_cb, &c, &total);
+    double secs = (double)(now_us() - t0) / 1e6;
+    int ok = rc == P2P_DONE && !c.bad && c.got == size_;
+    printf("%s: %llu of %llu bytes in %.1f s (%.1f MB/s, bottleneck %.1f MB/s)%s\n",
+           ok ? "OK" : "FAIL", (unsigned long long)c.got, (unsigned long long)size_, secs,
+           secs > 0 ? (double)c.got / secs / 1e6 : 0.0, rate_, c.bad ? ", corrupt" : "");
+    if (rc != P2P_DONE) printf("fetch: %s\n", p2p_strerror(rc));
+    return ok ? 0 : 1;
+}